@@ -1,13 +1,17 @@
 #include "accel_adxl330.h"
+#include "lsmod_config.h"
 #include "adc.h"
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <math.h>
 #include <stddef.h>
 #include <assert.h>
 #include <stdlib.h>
 
+#ifdef ADXL330_USED
+
 /****************************************************************************
  * Private types/enumerations/variables                                     *
  ****************************************************************************/
@@ -19,7 +23,7 @@ static volatile uint8_t xcount, ycount, zcount;
 static ADXL330_VALUES accelPrev;
 static volatile bool calculated;
 static ADXL330_VALUES accelAccum;
-static const uint32_t prescale2[8] = {0, 1, 8, 32, 64, 128, 256, 1024};
+static const uint16_t prescale2[8] PROGMEM = {0, 1, 8, 32, 64, 128, 256, 1024};
 
 /****************************************************************************
  * Public types/enumerations/variables                                      *
@@ -27,9 +31,10 @@ static const uint32_t prescale2[8] = {0, 1, 8, 32, 64, 128, 256, 1024};
 
 volatile bool Adxl330_HitDetected = false;
 volatile bool Adxl330_MotionDetected = false;
+volatile uint8_t Adxl330_HitTime;
+volatile uint8_t Adxl330_MotionTime;
 
 ADXL330_VALUES Adxl330_AccelReal;
-ADXL330_ANGLES Adxl330_AnglesReal;
 
 /****************************************************************************
  * Private functions                                                        *
@@ -72,7 +77,7 @@ static void timer2Setup(uint16_t freq)
   
   div = 0;
   do {
-    ocr = F_CPU / (freq * prescale2[++div]) - 1;
+    ocr = F_CPU / ((uint32_t)freq * pgm_read_word(&prescale2[++div])) - 1;
   } while (ocr > UINT8_MAX);
   TCCR2A = 0x00;
   TCCR2B = 0x00;
@@ -111,6 +116,10 @@ ISR(TIMER2_COMPA_vect)
       (abs(Adxl330_AccelReal.y - accelPrev.y) > ADXL330_HIT) ||
       (abs(Adxl330_AccelReal.z - accelPrev.z) > ADXL330_HIT))
   {
+    if (!Adxl330_HitDetected)
+    {
+      Adxl330_HitTime = TCNT0;
+    }
     Adxl330_HitDetected = true;
   }
   else
@@ -119,6 +128,10 @@ ISR(TIMER2_COMPA_vect)
         (abs(Adxl330_AccelReal.y - accelPrev.y) > ADXL330_MOTION) ||
         (abs(Adxl330_AccelReal.z - accelPrev.z) > ADXL330_MOTION))
     {
+      if (!Adxl330_MotionDetected)
+      {
+        Adxl330_MotionTime = TCNT0;
+      }
       Adxl330_MotionDetected = true;
     }
   }
@@ -137,8 +150,6 @@ ISR(TIMER2_COMPA_vect)
 
 void Adxl330_Init(void)
 {
-  Adxl330_AnglesReal.roll = 0;
-  Adxl330_AnglesReal.pitch = 0;
   Adxl330_AccelReal.x = 0;
   Adxl330_AccelReal.y = 0;
   Adxl330_AccelReal.z = 0;
@@ -178,3 +189,5 @@ void Adxl330_Get(ADXL330_ANGLES* angles)
   angles->roll = (float)(asin(sinRoll) * 180 / M_PI);
   angles->pitch = (float)(asin(sinPitch) * 180 / M_PI);
 }
+
+#endif // ADXL330_USED
@@ -27,9 +27,10 @@ typedef struct {
 
 extern volatile bool Adxl330_HitDetected;
 extern volatile bool Adxl330_MotionDetected;
+extern volatile uint8_t Adxl330_HitTime;  // Timer0 count the flag was raised at
+extern volatile uint8_t Adxl330_MotionTime;
 
 extern ADXL330_VALUES Adxl330_AccelReal;
-extern ADXL330_ANGLES Adxl330_AnglesReal;
 
 void Adxl330_Init(void);
 void Adxl330_Get(ADXL330_ANGLES* angles);
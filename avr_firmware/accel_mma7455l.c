@@ -1,4 +1,5 @@
 #include "accel_mma7455l.h"
+#include "lsmod_config.h"
 #include "i2c.h"
 
 #include <avr/io.h>
@@ -9,6 +10,9 @@
 
 #include "debug.h"
 
+// Only the sensor chosen in lsmod_config.h takes RAM and its interrupt
+#ifdef MMA7455L_USED
+
 /****************************************************************************
  * Private types/enumerations/variables                                     *
  ****************************************************************************/
@@ -181,3 +185,5 @@ bool Mma7455l_Get(MMA7455L_ANGLES* angles)
   Mma7455l_Error = true;
   return false;
 }
+
+#endif // MMA7455L_USED
@@ -35,9 +35,12 @@ ISR(ADC_vect)
   uint8_t ch;
   
   ch = ADMUX & 0xF;
-  values[ch] = ADCW;
-  handlers[ch]();
-  if(++ch >= ADC_TOTAL_CHANNELS)
+  if (ch < ADC_TOTAL_CHANNELS)
+  {
+    values[ch] = ADCW;
+    handlers[ch]();
+  }
+  if(++ch >= ADC_SCAN_CHANNELS)
   {
     ch = 0;
   }
@@ -59,7 +62,7 @@ void ADC_Init(void)
     ADMUX = ADC_VREF;
     ADCSRA = (1 << ADEN) | (1 << ADIE) | ADC_ADPS;
     ADCSRB = ADC_ADTS;
-    for (i = 0; i < 8; i++)
+    for (i = 0; i < ADC_TOTAL_CHANNELS; i++)
     {
       values[i] = 0;
       handlers[i] = dummyHandler;
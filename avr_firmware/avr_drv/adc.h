@@ -4,7 +4,8 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
-#define ADC_TOTAL_CHANNELS  8
+#define ADC_TOTAL_CHANNELS  4  // Inputs 0-3 have a value and a handler
+#define ADC_SCAN_CHANNELS   8  // Inputs converted in turn, sets the rate each one is sampled at
 
 #define ADC_VREF  ((0 << REFS0) | (0 << REFS1))  // AREF pin
 #define ADC_ADTS  ((0 << ADTS2) | (0 << ADTS1) | (0 << ADTS0))  // Free running
@@ -2,6 +2,7 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <stddef.h>
 
 /****************************************************************************
@@ -10,8 +11,19 @@
 
 static bool continious = false;
 static uint8_t* data;
-static uint8_t* read;
 static uint8_t tx_len, rx_len, cnt;
+static SPIHandler handler = NULL;
+
+#define STREAM_OFF      0
+#define STREAM_PENDING  1  // Waits for the transfer in flight
+#define STREAM_ON       2
+
+#define STREAM_SIZE  16  // Power of two
+
+static volatile uint8_t streamState = STREAM_OFF;
+static bool streamIdle, streamClosing, streamLost;
+static uint8_t stream[STREAM_SIZE];
+static uint8_t streamHead, streamTail;
 
 /****************************************************************************
  * Public types/enumerations/variables                                      *
@@ -32,7 +44,63 @@ static void chipSelect(bool select)
   else
   {
     PORTB |= (1 << PB2);
-  }   
+  }
+}
+
+// Stream may be opened from an interrupt, so the bus is taken atomically. A
+// stream keeps it for a whole page, the caller tries again later then.
+static bool claim(void)
+{
+  bool claimed;
+
+  claimed = false;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if (SPI_TransferCompleted)
+    {
+      SPI_TransferCompleted = false;
+      claimed = true;
+    }
+  }
+  return claimed;
+}
+
+static void streamClose(void)
+{
+  chipSelect(false);
+  streamState = STREAM_OFF;
+  SPI_TransferCompleted = true;
+}
+
+static void streamNext(void)
+{
+  if (streamHead != streamTail)
+  {
+    streamIdle = false;
+    SPDR = stream[streamTail];
+    streamTail = (streamTail + 1) & (STREAM_SIZE - 1);
+  }
+  else
+  {
+    streamIdle = true;
+    if (streamClosing)
+    {
+      streamClose();
+    }
+  }
+}
+
+static void start(void)
+{
+  SPI_TransferCompleted = false;
+  if (tx_len != 0)
+  {
+    SPDR = *data;
+  }
+  else
+  {
+    SPDR = 0xFF;
+  }
 }
 
 /****************************************************************************
@@ -41,9 +109,18 @@ static void chipSelect(bool select)
 
 ISR(SPI_STC_vect)
 {
+  if (streamState == STREAM_ON)
+  {
+    streamNext();
+    return;
+  }
   if (cnt < (tx_len + rx_len))
   {
-    *(data + cnt) = SPDR;
+    // Transmitted bytes are kept, only the reply is stored
+    if (cnt >= tx_len)
+    {
+      *(data + cnt) = SPDR;
+    }
     cnt++;
   }
   if (cnt < tx_len)
@@ -58,16 +135,24 @@ ISR(SPI_STC_vect)
     }
     else
     {
-      if (continious)
+      if (!continious)
       {
-        *read = SPDR;
-      }
-      else
-      {      
         chipSelect(false);
-      }      
+        // Bus goes to the stream before anybody else gets it
+        if (streamState == STREAM_PENDING)
+        {
+          streamState = STREAM_ON;
+          chipSelect(true);
+          streamNext();
+          return;
+        }
+      }
       SPI_TransferCompleted = true;
-    }    
+      if (handler)
+      {
+        handler();
+      }
+    }
   }
 }
 
@@ -78,61 +163,140 @@ ISR(SPI_STC_vect)
 void SPI_Init(void)
 {
   uint8_t dummy;
-  
+
   PORTB |= (1 << PB2);
   DDRB |= (1 << DDB2) | (1 << DDB3) | (1 << DDB5);
   dummy = SPSR;
   dummy = dummy;
   SPCR = (0 << CPOL) | (0 << CPHA) | (1 << SPE) | (1 << SPIE) | (1 << MSTR);
   SPCR |= (1 << SPR0) | (0 << SPR1); // 1.25 Mbit (20 MHz clock)
-  SPI_TransferCompleted = false;
+  SPI_TransferCompleted = true;
 }
 
-void SPI_WriteRead(uint8_t* dat, uint8_t tx_ln, uint8_t rx_ln)
+// Transfer starts only when the bus is free, returns false otherwise
+bool SPI_WriteRead(uint8_t* dat, uint8_t tx_ln, uint8_t rx_ln)
 {
+  if (!claim())
+  {
+    return false;
+  }
   cnt = 0;
   data = dat;
   tx_len = tx_ln;
   rx_len = rx_ln;
-  SPI_TransferCompleted = false;
+  handler = NULL;
+  continious = false;
   chipSelect(true);
-  if (tx_ln != 0)
-  {
-    SPDR = *data;
-  }
-  else
-  {
-    SPDR = 0xFF;
-  }
+  start();
+  return true;
 }
 
-void SPI_WriteReadContinious(uint8_t* dat, uint8_t tx_ln, uint8_t* rd)
+bool SPI_WriteReadContinious(uint8_t* dat, uint8_t tx_ln, SPIHandler hnd)
 {
+  if (!claim())
+  {
+    return false;
+  }
   cnt = 0;
   data = dat;
   tx_len = tx_ln;
   rx_len = 0;
-  read = rd;
+  handler = hnd;
   continious = true;
-  SPI_TransferCompleted = false;
   chipSelect(true);
-  if (tx_ln != 0)
+  start();
+  return true;
+}
+
+// Chip stays selected, so the transfer continues where the previous one ended
+void SPI_WriteReadContiniousNext(uint8_t* dat, uint8_t tx_ln, uint8_t rx_ln, SPIHandler hnd)
+{
+  while (!SPI_TransferCompleted) {}
+  cnt = 0;
+  data = dat;
+  tx_len = tx_ln;
+  rx_len = rx_ln;
+  handler = hnd;
+  start();
+}
+
+void SPI_WriteReadContiniousStop(void)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    SPDR = *data;
+    // Byte in flight (if any) completes the transfer without touching data
+    tx_len = 0;
+    rx_len = 0;
+    cnt = 0;
+    handler = NULL;
+    continious = false;
+    chipSelect(false);
+    if ((streamState == STREAM_PENDING) && SPI_TransferCompleted)
+    {
+      SPI_TransferCompleted = false;
+      streamState = STREAM_ON;
+      chipSelect(true);
+      streamNext();
+    }
+  }
+}
+
+// Stream functions are meant for interrupt context, where the bytes come one
+// at a time. They go out from the transfer interrupt while the chip stays
+// selected. A transfer in flight is finished first, a stream still going out
+// is not cut.
+bool SPI_StreamBegin(void)
+{
+  if (streamState != STREAM_OFF)
+  {
+    return false;
+  }
+  streamHead = 0;
+  streamTail = 0;
+  streamIdle = true;
+  streamClosing = false;
+  streamLost = false;
+  // Chip stays selected between the parts of a continuous transfer
+  if (SPI_TransferCompleted && !continious)
+  {
+    SPI_TransferCompleted = false;
+    streamState = STREAM_ON;
+    chipSelect(true);
   }
   else
   {
-    SPDR = 0xFF;
+    streamState = STREAM_PENDING;
   }
+  return true;
 }
 
-void SPI_WriteReadContiniousNext(void)
+bool SPI_StreamByte(uint8_t b)
 {
-  SPDR = 0xFF;
+  uint8_t head;
+
+  head = (streamHead + 1) & (STREAM_SIZE - 1);
+  if (head == streamTail)
+  {
+    streamLost = true;
+    return false;
+  }
+  stream[streamHead] = b;
+  streamHead = head;
+  if ((streamState == STREAM_ON) && streamIdle)
+  {
+    streamNext();
+  }
+  return true;
 }
 
-void SPI_WriteReadContiniousStop(void)
+// Chip is released once the queued bytes are out. Returns false when some
+// did not fit the queue, the chip got the stream with a gap then.
+bool SPI_StreamEnd(void)
 {
-  continious = false;
-  chipSelect(false);
+  streamClosing = true;
+  if ((streamState == STREAM_ON) && streamIdle)
+  {
+    streamClose();
+  }
+  return !streamLost;
 }
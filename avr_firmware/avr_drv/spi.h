@@ -4,12 +4,17 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
+typedef void (*SPIHandler)(void);
+
 extern volatile bool SPI_TransferCompleted;
 
 void SPI_Init(void);
-void SPI_WriteRead(uint8_t* dat, uint8_t tx_ln, uint8_t rx_ln);
-void SPI_WriteReadContinious(uint8_t* dat, uint8_t tx_ln, uint8_t* rd);
-void SPI_WriteReadContiniousNext(void);
+bool SPI_WriteRead(uint8_t* dat, uint8_t tx_ln, uint8_t rx_ln);
+bool SPI_WriteReadContinious(uint8_t* dat, uint8_t tx_ln, SPIHandler hnd);
+void SPI_WriteReadContiniousNext(uint8_t* dat, uint8_t tx_ln, uint8_t rx_ln, SPIHandler hnd);
 void SPI_WriteReadContiniousStop(void);
+bool SPI_StreamBegin(void);
+bool SPI_StreamByte(uint8_t b);
+bool SPI_StreamEnd(void);
 
 #endif // __SPI_H
@@ -1,9 +1,10 @@
 #include "comport.h"
+#include "scheduler.h"
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/setbaud.h>
-#include <assert.h>
+#include <util/crc16.h>
 #include <stdlib.h>
 
 /****************************************************************************
@@ -11,22 +12,45 @@
  ****************************************************************************/
 
 static uint8_t tx_buffer[TX_BUFFER_SIZE];
-static uint8_t tx_wr_index, tx_rd_index, tx_counter;
-static uint8_t rx_buffer[RX_BUFFER_SIZE];
-static uint8_t rx_wr_index, rx_rd_index, rx_counter;
-static bool rx_buffer_overflow;
+static uint8_t tx_wr_index, tx_rd_index;
+static volatile uint8_t tx_counter;  // Waited on while the buffer is full
+static volatile bool tx_active;  // Byte in the data or shift register
 
-static LsmodPacket packet;
+// Packets are framed and checked in the receive interrupt. The one taken by
+// the handler stays queued until its reply is sent, the reply is built in it.
+static LsmodPacket queue[COMPORT_QUEUE_LEN];
+static uint8_t queue_wr_index, queue_rd_index;
+static volatile uint8_t queue_count;
+static LsmodPacket *packet;
 static ParserHandler parser_handler;
-static bool packet_received, good_packet;
+
+static LsmodPacket *received;
 static uint8_t received_part_index;
-static uint16_t received_data_index;
+static uint8_t received_data_index;
+static bool received_escape;  // Next data byte comes escaped
+static uint16_t received_crc;  // Over the bytes so far, the crc bytes included
+static bool received_streaming;  // Payload goes to the stream handlers, not to the packet
+static uint16_t received_stream_len;  // Payload bytes still to come, the crc follows
+
+static StreamBeginHandler stream_begin;
+static StreamByteHandler stream_byte;
+static StreamEndHandler stream_end;
+
+#define BAUD_IDLE     0
+#define BAUD_SWITCH   1  // Acknowledge is still going out at the old rate
+#define BAUD_CONFIRM  2  // New rate is kept once a packet comes at it
+
+static uint8_t baud_state = BAUD_IDLE;
+static uint32_t baud_next;
+static uint16_t baud_since;
+static volatile bool baud_confirmed;
 
 /****************************************************************************
  * Public types/enumerations/variables                                      *
  ****************************************************************************/
 
 volatile bool ComportIsDataToParse, ComportNeedFeedback;
+volatile uint16_t ComportOverflows, ComportCrcErrors, ComportFramingErrors;
 
 /****************************************************************************
  * Private functions                                                        *
@@ -49,69 +73,289 @@ static void _putchar(uint8_t c)
   {
     UDR0 = c;
   }
+  tx_active = true;
   sei();
 }
 
-static uint8_t _getchar(void)
+// Packet being received is given up, the stream gets nothing more of it
+static void drop(void)
+{
+  received_part_index = LSMOD_PACKET_HEADER_INDEX;
+  if (received_streaming)
+  {
+    received_streaming = false;
+    stream_end(false);
+  }
+}
+
+static void baudDefault(void)
+{
+  UBRR0H = UBRRH_VALUE;
+  UBRR0L = UBRRL_VALUE;
+#if USE_2X
+  UCSR0A |= (1 << U2X0);
+#else
+  UCSR0A &= ~(1 << U2X0);
+#endif
+}
+
+// Divider at double speed, rates off by more than 2% are not taken
+static uint16_t baudDivider(uint32_t baud)
 {
-  uint8_t data;
-  while (rx_counter == 0);
-  data = rx_buffer[rx_rd_index++];
-  if (rx_rd_index == RX_BUFFER_SIZE)
+  uint32_t div, real;
+
+  if ((baud == 0) || (baud > COMPORT_BAUD_MAX))
+  {
+    return 0;
+  }
+  div = (F_CPU / 8 + baud / 2) / baud;
+  if ((div == 0) || (div > 4096))
+  {
+    return 0;
+  }
+  real = F_CPU / 8 / div;
+  if (((real > baud) ? (real - baud) : (baud - real)) > (baud / 50))
   {
-    rx_rd_index = 0;
+    return 0;
   }
+  return (uint16_t)div;
+}
+
+// Packet in the middle of the switch is lost, the sender waits for the
+// acknowledge anyway
+static void baudSet(uint32_t baud)
+{
+  uint16_t ubrr;
+
   cli();
-  --rx_counter;
+  if (baud == LSMOD_BAUDRATE)
+  {
+    baudDefault();
+  }
+  else
+  {
+    ubrr = baudDivider(baud) - 1;
+    UBRR0H = (uint8_t)(ubrr >> 8);
+    UBRR0L = (uint8_t)ubrr;
+    UCSR0A |= (1 << U2X0);
+  }
+  drop();
+  baud_confirmed = false;
   sei();
-  if (rx_counter == 0)
+}
+
+static void baudPoll(void)
+{
+  switch (baud_state) {
+    case BAUD_SWITCH:
+      if (!tx_active)
+      {
+        baudSet(baud_next);
+        baud_since = SchedulerTicks();
+        baud_state = (baud_next == LSMOD_BAUDRATE) ? BAUD_IDLE : BAUD_CONFIRM;
+      }
+      break;
+    case BAUD_CONFIRM:
+      if (baud_confirmed)
+      {
+        baud_state = BAUD_IDLE;
+      }
+      else if ((uint16_t)(SchedulerTicks() - baud_since) > SCHEDULER_MS(LSMOD_BAUD_TIMEOUT_MS))
+      {
+        baudSet(LSMOD_BAUDRATE);
+        baud_state = BAUD_IDLE;
+      }
+      break;
+  }
+}
+
+static void _putescaped(uint8_t c)
+{
+  if ((LSMOD_PACKET_HDR == c) ||
+      (LSMOD_PACKET_MSK == c) ||
+      (LSMOD_PACKET_END == c))
   {
-    ComportIsDataToParse = false;
+    _putchar(LSMOD_PACKET_MSK);
+    _putchar((uint8_t)(0xFF - c));
+  }
+  else
+  {
+    _putchar(c);
   }
-  return data;
 }
 
-static void send()
+static void send(uint8_t to, uint8_t cmd, uint8_t *data, uint8_t len)
 {
   uint8_t i;
-  uint8_t crc;
-  
-  crc = 0;
+  uint16_t crc;
+
+  crc = LSMOD_CRC_INIT;
   _putchar(LSMOD_PACKET_HDR);
-  crc += LSMOD_PACKET_HDR;
-  _putchar(packet.to);
-  crc += packet.to;
+  crc = _crc_xmodem_update(crc, LSMOD_PACKET_HDR);
+  _putchar(to);
+  crc = _crc_xmodem_update(crc, to);
   _putchar(LSMOD_ADDR);
-  crc += LSMOD_ADDR;
-  _putchar(packet.cmd);
-  crc += packet.cmd;
-  for (i = 0; i < packet.len; ++i)
+  crc = _crc_xmodem_update(crc, LSMOD_ADDR);
+  _putchar(cmd);
+  crc = _crc_xmodem_update(crc, cmd);
+  for (i = 0; i < len; ++i)
   {
-    if ((LSMOD_PACKET_HDR == packet.data[i]) ||
-        (LSMOD_PACKET_MSK == packet.data[i]) ||
-        (LSMOD_PACKET_END == packet.data[i]))
-    {     
-      _putchar(LSMOD_PACKET_MSK);
-      _putchar((uint8_t)(0xFF - packet.data[i]));
-     }
-    else
-    {
-      _putchar(packet.data[i]);
-    }
-    crc += packet.data[i];
+    _putescaped(data[i]);
+    crc = _crc_xmodem_update(crc, data[i]);
   }
-  if ((LSMOD_PACKET_HDR == crc) ||
-      (LSMOD_PACKET_MSK == crc) ||
-      (LSMOD_PACKET_END == crc))
-  {     
-    _putchar(LSMOD_PACKET_MSK);
-    _putchar((uint8_t)(0xFF - crc));
+  _putescaped((uint8_t)(crc >> 8));
+  _putescaped((uint8_t)crc);
+  _putchar(LSMOD_PACKET_END);
+}
+
+// Reply is on its way, the packet slot takes the next one
+static void release(void)
+{
+  if (++queue_rd_index == COMPORT_QUEUE_LEN)
+  {
+    queue_rd_index = 0;
   }
-  else
+  cli();
+  if (--queue_count == 0)
   {
-    _putchar(crc);
+    ComportIsDataToParse = false;
+  }
+  sei();
+  ComportNeedFeedback = false;
+}
+
+// Runs in the receive interrupt, one byte at a time
+static void receive(uint8_t rec_byte)
+{
+  // Header is never escaped, it starts a new packet whatever came before
+  if (rec_byte == LSMOD_PACKET_HDR)
+  {
+    if (received_part_index != LSMOD_PACKET_HEADER_INDEX)
+    {
+      ComportFramingErrors++;
+    }
+    drop();
+    if (queue_count == COMPORT_QUEUE_LEN)
+    {
+      ComportOverflows++;
+      return;
+    }
+    received = &queue[queue_wr_index];
+    received->header = rec_byte;
+    received_crc = _crc_xmodem_update(LSMOD_CRC_INIT, rec_byte);
+    received_escape = false;
+    received_data_index = 0;
+    received_part_index = LSMOD_PACKET_TO_INDEX;
+    return;
+  }
+  switch (received_part_index) {
+    case LSMOD_PACKET_TO_INDEX:
+      if (rec_byte == LSMOD_ADDR)
+      {
+        received->to = rec_byte;
+        received_crc = _crc_xmodem_update(received_crc, rec_byte);
+        received_part_index = LSMOD_PACKET_FROM_INDEX;
+      }
+      else
+      {
+        received_part_index = LSMOD_PACKET_HEADER_INDEX;
+      }
+      break;
+    case LSMOD_PACKET_FROM_INDEX:
+      received->from = rec_byte;
+      received_crc = _crc_xmodem_update(received_crc, rec_byte);
+      received_part_index = LSMOD_PACKET_CMD_INDEX;
+      break;
+    case LSMOD_PACKET_CMD_INDEX:
+      received->cmd = rec_byte;
+      received_crc = _crc_xmodem_update(received_crc, rec_byte);
+      received_part_index = LSMOD_PACKET_DATA_INDEX;
+      break;
+    case LSMOD_PACKET_DATA_INDEX:
+      if (rec_byte == LSMOD_PACKET_END)
+      {
+        if ((received_data_index < LSMOD_CRC_LEN) || received_escape ||
+            (received_streaming && ((received_stream_len != 0) || (received_data_index != (LSMOD_PAGE_HDR_LEN + LSMOD_CRC_LEN)))))
+        {
+          ComportFramingErrors++;
+          drop();
+          break;
+        }
+        received_part_index = LSMOD_PACKET_HEADER_INDEX;
+        // Last data bytes are the crc, they went into the crc as well
+        received->len = received_data_index - LSMOD_CRC_LEN;
+        received->crc = ((uint16_t)received->data[received->len] << 8) | received->data[received->len + 1];
+        received->end = rec_byte;
+        if (received_crc != 0)
+        {
+          ComportCrcErrors++;
+          drop();
+          break;
+        }
+        if (received_streaming)
+        {
+          received_streaming = false;
+          // Payload the flash could not take is sent again
+          if (!stream_end(true))
+          {
+            ComportOverflows++;
+            break;
+          }
+        }
+        if (++queue_wr_index == COMPORT_QUEUE_LEN)
+        {
+          queue_wr_index = 0;
+        }
+        queue_count++;
+        ComportIsDataToParse = true;
+        baud_confirmed = true;
+      }
+      else if (rec_byte == LSMOD_PACKET_MSK)
+      {
+        received_escape = true;
+      }
+      else if (received_streaming && (received_stream_len != 0))
+      {
+        if (received_escape)
+        {
+          rec_byte = 0xFF - rec_byte;
+          received_escape = false;
+        }
+        stream_byte(rec_byte);
+        received_stream_len--;
+        received_crc = _crc_xmodem_update(received_crc, rec_byte);
+      }
+      else if (received_data_index < sizeof(received->data))
+      {
+        if (received_escape)
+        {
+          rec_byte = 0xFF - rec_byte;
+          received_escape = false;
+        }
+        received->data[received_data_index++] = rec_byte;
+        received_crc = _crc_xmodem_update(received_crc, rec_byte);
+        // Page header is in, its payload is not kept in the packet
+        if ((received->cmd == LSMOD_CONTROL_LOAD_PAGE) && !received_streaming &&
+            (received_data_index == LSMOD_PAGE_HDR_LEN) && stream_begin)
+        {
+          received_stream_len = ((uint16_t)received->data[LSMOD_PAGE_SIZE_INDEX] << 8) |
+                                received->data[LSMOD_PAGE_SIZE_INDEX + 1];
+          if (!stream_begin(received))
+          {
+            ComportOverflows++;
+            received_part_index = LSMOD_PACKET_HEADER_INDEX;
+            break;
+          }
+          received_streaming = true;
+        }
+      }
+      else
+      {
+        ComportFramingErrors++;
+        drop();
+      }
+      break;
   }
-  _putchar(LSMOD_PACKET_END);
 }
 
 /****************************************************************************
@@ -129,31 +373,26 @@ ISR(USART_TX_vect)
       tx_rd_index = 0;
     }
   }
+  else
+  {
+    tx_active = false;
+  }
 }
 
 ISR(USART_RX_vect)
 {
-  if ((UCSR0A & ((1 << FE0) | (1 << UPE0) | (1 << DOR0))) == 0)
+  uint8_t status, data;
+
+  status = UCSR0A;
+  data = UDR0;
+  // Broken byte spoils the packet it belongs to, the sender repeats it
+  if (status & ((1 << FE0) | (1 << UPE0) | (1 << DOR0)))
   {
-    rx_buffer[rx_wr_index++] = UDR0;
-    if (rx_wr_index == RX_BUFFER_SIZE)
-    {
-      rx_wr_index = 0;
-    }  
-    if (++rx_counter == RX_BUFFER_SIZE)
-    {
-      rx_counter = 0;
-      rx_buffer_overflow = true;
-    }
-    if (rx_counter > 0)
-    {
-      ComportIsDataToParse = true;
-    }
-    else
-    {
-      ComportIsDataToParse = false;
-    }    
+    ComportFramingErrors++;
+    drop();
+    return;
   }
+  receive(data);
 }
 
 /****************************************************************************
@@ -162,22 +401,30 @@ ISR(USART_RX_vect)
 
 void ComportSetup(ParserHandler handler)
 {
-  UBRR0H = UBRRH_VALUE;
-  UBRR0L = UBRRL_VALUE;
-#if USE_2X
-  UCSR0A |= (1 << U2X0);
-#else
-  UCSR0A &= ~(1 << U2X0);
-#endif
+  baudDefault();
   UCSR0B = (1 << TXEN0) | (1 << RXEN0) | (1 << TXCIE0) | (1 << RXCIE0);
   UCSR0C = (1 << UCSZ00) | (1 << UCSZ01);
   parser_handler = handler;
   ComportIsDataToParse = false;
-  packet_received = false;
-  good_packet = false;
   ComportNeedFeedback = false;
-  received_part_index = 0;
-  received_data_index = 0;
+  ComportOverflows = 0;
+  ComportCrcErrors = 0;
+  ComportFramingErrors = 0;
+  queue_count = 0;
+  queue_wr_index = 0;
+  queue_rd_index = 0;
+  received_part_index = LSMOD_PACKET_HEADER_INDEX;
+  received_streaming = false;
+}
+
+// Payload of the page loads goes to the handlers byte by byte as it comes,
+// the packet keeps only the page header. End handler is told whether the
+// payload is good and answers whether it was taken.
+void ComportSetupStream(StreamBeginHandler begin, StreamByteHandler byte, StreamEndHandler end)
+{
+  stream_begin = begin;
+  stream_byte = byte;
+  stream_end = end;
 }
 
 void ComportDebug(char ch)
@@ -193,140 +440,181 @@ void ComportDebugString(char *str)
   }
 }
 
+// Hands the oldest received packet to the handler
 void ComportParse(void)
 {
-  uint8_t rec_byte, check_crc;
-  uint16_t i, j;
-  
-  rec_byte = _getchar();
-  if ((received_part_index == LSMOD_PACKET_DATA_INDEX) && (rec_byte == LSMOD_PACKET_END))
+  baudPoll();
+  if (!ComportIsDataToParse || ComportNeedFeedback)
   {
-    packet.end = rec_byte;
-    packet.len = received_data_index;
-    packet_received = true;
-    received_part_index = LSMOD_PACKET_HEADER_INDEX;
+    return;
   }
-  if (received_part_index == LSMOD_PACKET_DATA_INDEX)
-  {
-    if (received_data_index < LSMOD_DATA_MAX_LEN)
-    {
-      packet.data[received_data_index++] = rec_byte;
-    }
-    else
-    {
-      received_part_index = 0;
-    }
-  }
-  if (received_part_index == LSMOD_PACKET_CMD_INDEX)
-  {
-    packet.cmd = rec_byte;
-    received_part_index = LSMOD_PACKET_DATA_INDEX;
-  }
-  if (received_part_index == LSMOD_PACKET_FROM_INDEX)
-  {
-    packet.from = rec_byte;
-    received_part_index = LSMOD_PACKET_CMD_INDEX;
-  }
-  if (received_part_index == LSMOD_PACKET_TO_INDEX)
-  {
-    if (rec_byte == LSMOD_ADDR)
-    {
-      packet.to = rec_byte;
-      received_part_index = LSMOD_PACKET_FROM_INDEX;
-    }
-    else
-    {
-      received_part_index = 0;
-    }
-  }
-  if ((received_part_index == LSMOD_PACKET_HEADER_INDEX) && (rec_byte == LSMOD_PACKET_HDR) && (!packet_received))
+  packet = &queue[queue_rd_index];
+  ComportNeedFeedback = true;
+  parser_handler(packet);
+}
+
+// Rate is switched once the acknowledge to the request is out. It falls back
+// to LSMOD_BAUDRATE unless a good packet comes within LSMOD_BAUD_TIMEOUT_MS.
+bool ComportBaud(uint32_t baud)
+{
+  if ((baud != LSMOD_BAUDRATE) && (baudDivider(baud) == 0))
   {
-    packet.header = rec_byte;
-    received_data_index = 0;
-    received_part_index = LSMOD_PACKET_TO_INDEX;
+    return false;
   }
-  if (packet_received)
-  {
-    packet_received = false;
-    for (i = 0; i < packet.len; i++)
-    {
-      if (LSMOD_PACKET_MSK == packet.data[i])
-      {
-        assert(i < (packet.len - 1));
-        packet.data[i] = 0xFF - packet.data[i + 1];
-        for (j = (i + 1); j < (packet.len - 1); j++)
-        {
-          packet.data[j] = packet.data[j + 1];
-        }
-        packet.len--;
-      }
-    }
-    packet.crc = packet.data[packet.len - 1];
-    packet.len--;
-    check_crc = 0;
-    check_crc += packet.header;
-    check_crc += packet.to;
-    check_crc += packet.from;
-    check_crc += packet.cmd;
-    for (i = 0; i < packet.len; i++)
-    {
-      check_crc += packet.data[i];
-    }
-    if (check_crc == packet.crc)
-    {
-      good_packet = true;
-    }
-  }
-  if (good_packet)
+  baud_next = baud;
+  baud_state = BAUD_SWITCH;
+  return true;
+}
+
+// Frame the host did not ask for. It goes only when the transmit buffer
+// takes it whole, so the caller never waits.
+bool ComportSend(uint8_t to, uint8_t cmd, uint8_t *data, uint8_t len)
+{
+  if ((TX_BUFFER_SIZE - tx_counter) < (LSMOD_SRV_LEN + 2 * (len + LSMOD_CRC_LEN)))
   {
-    good_packet = false;
-    ComportNeedFeedback = true;
-    parser_handler(&packet);
+    return false;
   }
+  send(to, cmd, data, len);
+  return true;
 }
 
 void ComportReplyError(uint8_t cmd)
 {
-  packet.to = packet.from;
-  packet.cmd = LSMOD_REPLY_ERROR;
-  packet.data[0] = cmd;
-  packet.len = 1;
-  send();
-  ComportNeedFeedback = false;
+  packet->data[0] = cmd;
+  packet->len = 1;
+  send(packet->from, LSMOD_REPLY_ERROR, packet->data, packet->len);
+  release();
 }
 
 void ComportReplyAck(uint8_t cmd)
 {
-  packet.to = packet.from;
-  packet.cmd = LSMOD_REPLY_ACK;
-  packet.data[0] = cmd;
-  packet.len = 1;
-  send();
-  ComportNeedFeedback = false;
+  packet->data[0] = cmd;
+  packet->len = 1;
+  send(packet->from, LSMOD_REPLY_ACK, packet->data, packet->len);
+  release();
 }
 
-void ComportReplyLoaded(uint8_t bytes)
+void ComportReplyLoaded(uint8_t seq)
 {
-  packet.to = packet.from;
-  packet.cmd = LSMOD_REPLY_LOADED;
-  packet.data[0] = bytes;
-  packet.len = 1;
-  send();
-  ComportNeedFeedback = false;
+  packet->data[0] = seq;
+  packet->len = 1;
+  send(packet->from, LSMOD_REPLY_LOADED, packet->data, packet->len);
+  release();
 }
 
-void ComportReplyStat(uint8_t axh, uint8_t axl, uint8_t ayh, uint8_t ayl, uint8_t azh, uint8_t azl, uint8_t vlt)
+// Packet with this sequence number is missing, the ones behind it are kept
+void ComportReplyNak(uint8_t seq)
 {
-  packet.to = packet.from;
-  packet.cmd = LSMOD_REPLY_STAT;
-  packet.data[0] = axh;
-  packet.data[1] = axl;
-  packet.data[2] = ayh;
-  packet.data[3] = ayl;
-  packet.data[4] = azh;
-  packet.data[5] = azl;
-  packet.data[6] = vlt;
-  packet.len = 7;
-  send();
-  ComportNeedFeedback = false;
+  packet->data[0] = seq;
+  packet->len = 1;
+  send(packet->from, LSMOD_REPLY_NAK, packet->data, packet->len);
+  release();
+}
+
+// Address asked for is still in the packet, the crc goes behind it
+void ComportReplyCrc(uint16_t crc)
+{
+  packet->data[LSMOD_DATA_IDX_LEN] = (uint8_t)(crc >> 8);
+  packet->data[LSMOD_DATA_IDX_LEN + 1] = (uint8_t)crc;
+  packet->len = LSMOD_DATA_IDX_LEN + 2;
+  send(packet->from, LSMOD_REPLY_CRC, packet->data, packet->len);
+  release();
+}
+
+// Bytes are read into the packet behind the address asked for
+void ComportReplyRead(uint8_t len)
+{
+  packet->len = LSMOD_DATA_IDX_LEN + len;
+  send(packet->from, LSMOD_REPLY_READ, packet->data, packet->len);
+  release();
+}
+
+// Acknowledge to LOAD_BEGIN with the address the track is placed at
+void ComportReplyBegin(uint32_t addr)
+{
+  packet->data[0] = LSMOD_CONTROL_LOAD_BEGIN;
+  packet->data[1] = (uint8_t)(addr >> 24);
+  packet->data[2] = (uint8_t)(addr >> 16);
+  packet->data[3] = (uint8_t)(addr >> 8);
+  packet->data[4] = (uint8_t)addr;
+  packet->len = LSMOD_DATA_IDX_LEN + 1;
+  send(packet->from, LSMOD_REPLY_ACK, packet->data, packet->len);
+  release();
+}
+
+// Crcs are in the packet already behind the address and the count
+void ComportReplyPageCrc(uint8_t count)
+{
+  packet->len = LSMOD_DATA_IDX_LEN + 1 + 2 * count;
+  send(packet->from, LSMOD_REPLY_PAGE_CRC, packet->data, packet->len);
+  release();
+}
+
+void ComportReplyTrack(uint32_t addr, uint32_t len, uint8_t format, uint16_t crc, uint8_t kind, uint16_t rate, uint32_t loopStart, uint32_t loopEnd)
+{
+  packet->data[1] = (uint8_t)(addr >> 24);
+  packet->data[2] = (uint8_t)(addr >> 16);
+  packet->data[3] = (uint8_t)(addr >> 8);
+  packet->data[4] = (uint8_t)addr;
+  packet->data[5] = (uint8_t)(len >> 24);
+  packet->data[6] = (uint8_t)(len >> 16);
+  packet->data[7] = (uint8_t)(len >> 8);
+  packet->data[8] = (uint8_t)len;
+  packet->data[9] = format;
+  packet->data[10] = (uint8_t)(crc >> 8);
+  packet->data[11] = (uint8_t)crc;
+  packet->data[12] = kind;
+  packet->data[13] = (uint8_t)(rate >> 8);
+  packet->data[14] = (uint8_t)rate;
+  packet->data[15] = (uint8_t)(loopStart >> 24);
+  packet->data[16] = (uint8_t)(loopStart >> 16);
+  packet->data[17] = (uint8_t)(loopStart >> 8);
+  packet->data[18] = (uint8_t)loopStart;
+  packet->data[19] = (uint8_t)(loopEnd >> 24);
+  packet->data[20] = (uint8_t)(loopEnd >> 16);
+  packet->data[21] = (uint8_t)(loopEnd >> 8);
+  packet->data[22] = (uint8_t)loopEnd;
+  packet->len = LSMOD_TRACK_LEN;
+  send(packet->from, LSMOD_REPLY_TRACK, packet->data, packet->len);
+  release();
+}
+
+void ComportReplyStat(uint8_t axh, uint8_t axl, uint8_t ayh, uint8_t ayl, uint8_t azh, uint8_t azl, uint8_t vlt, uint8_t unh, uint8_t unl, uint8_t pgh, uint8_t pgl, uint8_t pmh, uint8_t pml, uint16_t lat, uint16_t lmx, uint16_t cmx)
+{
+  uint16_t overflows, crc_errors, framing_errors;
+
+  cli();
+  overflows = ComportOverflows;
+  crc_errors = ComportCrcErrors;
+  framing_errors = ComportFramingErrors;
+  sei();
+  packet->data[0] = axh;
+  packet->data[1] = axl;
+  packet->data[2] = ayh;
+  packet->data[3] = ayl;
+  packet->data[4] = azh;
+  packet->data[5] = azl;
+  packet->data[6] = vlt;
+  packet->data[7] = unh;
+  packet->data[8] = unl;
+  packet->data[9] = pgh;
+  packet->data[10] = pgl;
+  packet->data[11] = pmh;
+  packet->data[12] = pml;
+  packet->data[13] = (uint8_t)(lat >> 8);
+  packet->data[14] = (uint8_t)lat;
+  packet->data[15] = (uint8_t)(lmx >> 8);
+  packet->data[16] = (uint8_t)lmx;
+  // Link figures are kept here, they go last
+  packet->data[17] = (uint8_t)(overflows >> 8);
+  packet->data[18] = (uint8_t)overflows;
+  packet->data[19] = (uint8_t)(crc_errors >> 8);
+  packet->data[20] = (uint8_t)crc_errors;
+  packet->data[21] = (uint8_t)(framing_errors >> 8);
+  packet->data[22] = (uint8_t)framing_errors;
+  packet->data[23] = (uint8_t)(cmx >> 8);
+  packet->data[24] = (uint8_t)cmx;
+  packet->len = LSMOD_STAT_MAX_LEN;
+  send(packet->from, LSMOD_REPLY_STAT, packet->data, packet->len);
+  release();
 }
@@ -9,25 +9,45 @@
 
 #define BAUD LSMOD_BAUDRATE
 
-#define RX_BUFFER_SIZE  (LSMOD_SRV_LEN + LSMOD_DATA_MAX_LEN)
-#define TX_BUFFER_SIZE  (LSMOD_SRV_LEN + LSMOD_STAT_MAX_LEN)
+// Takes a whole telemetry frame even if every byte needs escaping
+#define TX_BUFFER_SIZE  (LSMOD_SRV_LEN + 2 * (LSMOD_TELEMETRY_LEN + LSMOD_CRC_LEN))
+
+// Complete packets held for the handler, every load in flight needs a slot
+#define COMPORT_QUEUE_LEN  LSMOD_LOAD_WINDOW
 
 #define COMPORT_TIMEOUT_MS  100
 
+// Receive interrupt has to keep up with a byte every 10 bit times, it frames
+// the packets as well
+#define COMPORT_BAUD_MAX  500000
+
 typedef void (*ParserHandler)(void* args);
+typedef bool (*StreamBeginHandler)(void* args);
+typedef void (*StreamByteHandler)(uint8_t b);
+typedef bool (*StreamEndHandler)(bool keep);
 
 extern volatile bool ComportIsDataToParse, ComportNeedFeedback;
+extern volatile uint16_t ComportOverflows, ComportCrcErrors, ComportFramingErrors;
 
 void ComportSetup(ParserHandler handler);
+void ComportSetupStream(StreamBeginHandler begin, StreamByteHandler byte, StreamEndHandler end);
 
 void ComportDebug(char ch);
 void ComportDebugString(char *str);
 
 void ComportParse(void);
+bool ComportBaud(uint32_t baud);
+bool ComportSend(uint8_t to, uint8_t cmd, uint8_t *data, uint8_t len);
 
 void ComportReplyError(uint8_t cmd);
 void ComportReplyAck(uint8_t cmd);
-void ComportReplyLoaded(uint8_t bytes);
-void ComportReplyStat(uint8_t axh, uint8_t axl, uint8_t ayh, uint8_t ayl, uint8_t azh, uint8_t azl, uint8_t vlt);
+void ComportReplyLoaded(uint8_t seq);
+void ComportReplyNak(uint8_t seq);
+void ComportReplyCrc(uint16_t crc);
+void ComportReplyRead(uint8_t len);
+void ComportReplyBegin(uint32_t addr);
+void ComportReplyPageCrc(uint8_t count);
+void ComportReplyTrack(uint32_t addr, uint32_t len, uint8_t format, uint16_t crc, uint8_t kind, uint16_t rate, uint32_t loopStart, uint32_t loopEnd);
+void ComportReplyStat(uint8_t axh, uint8_t axl, uint8_t ayh, uint8_t ayl, uint8_t azh, uint8_t azl, uint8_t vlt, uint8_t unh, uint8_t unl, uint8_t pgh, uint8_t pgl, uint8_t pmh, uint8_t pml, uint16_t lat, uint16_t lmx, uint16_t cmx);
 
 #endif // __COMPORT_H__
@@ -1,8 +1,10 @@
 #include "dataflash_at45db321b.h"
 #include "spi.h"
 
+#include <avr/io.h>
 #include <string.h>
-#include <util/delay.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
 #include <assert.h>
 #include <stdlib.h>
 
@@ -10,15 +12,56 @@
  * Private types/enumerations/variables                                     *
  ****************************************************************************/
 
+#define WRITE_IDLE    0
+#define WRITE_DATA    1  // Bytes on the way to a chip buffer
+#define WRITE_STATUS  2  // Status register read
+
 static uint8_t buffer[DB321_BUFFER_SIZE];
 
 static bool dataflashInitialized = false;
-static bool dataflashBusy = false;
+static volatile bool dataflashBusy = false;
+static uint8_t *readDst;
+static uint8_t readSize;
+static DataflashHandler readHandler = NULL;
+static volatile bool writeActive = false;
+static volatile bool writeDone;
+static uint8_t writeState = WRITE_IDLE;
+static uint8_t writeBuffer;  // Chip SRAM buffer being filled, the other one may be programming
+static uint16_t writePageAddress;
+static uint16_t writeByteAddress;
+static uint8_t *writeSrc;
+static uint8_t writeSize;
+static uint8_t writeCount;  // Bytes in flight to the chip buffer
+static bool writeLoad, writeFlush, writeRelease;
+static bool chipBusy;
+static int8_t chipBusyBuffer;  // Buffer taken by the running operation, -1 for none
+static bool timing;  // Page program is being timed
+static uint8_t timerLast;
+static uint16_t timerTicks;
+// Whole pages come through the stream straight into a chip buffer. Buffers
+// take them in turn and are programmed in the same order.
+static volatile uint8_t streamFilled;  // Bit per chip buffer, cleared once its page is programmed
+static uint16_t streamPage[2];
+static uint8_t streamBuffer;
+static uint8_t streamProgramBuffer;
+static bool streamProgramming;
+// Crc is run over one chunk while the chip sends the next one, the chip
+// stays selected all the way. Chunks are read into room lent by the caller.
+static bool crcActive;
+static bool crcDone;
+static uint32_t crcLeft;  // Bytes not asked for yet
+static uint16_t crcValue;
+static uint8_t *crcChunks;
+static uint8_t crcBuffer;  // Chunk on the way from the chip
+static uint8_t crcCount;
 
 /****************************************************************************
  * Public types/enumerations/variables                                      *
  ****************************************************************************/
 
+uint16_t DataflashProgramTime = 0;
+uint16_t DataflashProgramTimeMax = 0;
+
 /****************************************************************************
  * Private functions                                                        *
  ****************************************************************************/
@@ -52,12 +95,265 @@ static void DataflashCheckID(void)
   }
 }
 
+static void setCommand(uint8_t cmd, uint16_t pageAddress, uint16_t byteAddress)
+{
+  bufferInit();
+  buffer[0] = cmd;
+  buffer[1] = (uint8_t)((pageAddress >> 6) & 0x7F);
+  buffer[2] = (uint8_t)((pageAddress << 2) & 0xFC) | (uint8_t)((byteAddress >> 8) & 0x03);
+  buffer[3] = (uint8_t)(byteAddress & 0xFF);
+  buffer[4] = 0xFF;
+  buffer[5] = 0xFF;
+  buffer[6] = 0xFF;
+  buffer[7] = 0xFF;
+}
+
+// Player refills from interrupts, so taking the bus must be atomic
+static bool claim(void)
+{
+  bool claimed;
+
+  claimed = false;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if (!dataflashBusy)
+    {
+      dataflashBusy = true;
+      claimed = true;
+    }
+  }
+  return claimed;
+}
+
+static void readDone(void)
+{
+  SPI_WriteReadContiniousStop();
+  dataflashBusy = false;
+  if (readHandler)
+  {
+    readHandler();
+  }
+}
+
+static void readCommandDone(void)
+{
+  SPI_WriteReadContiniousNext(readDst, 0, readSize, readDone);
+}
+
+static void writeDataNext(void)
+{
+  SPI_WriteReadContiniousNext(writeSrc, writeCount, 0, NULL);
+}
+
+// Ticks are summed up between polls, so a poll is needed at least once per
+// timer overflow to keep the result right
+static void timerUpdate(void)
+{
+  uint8_t now;
+
+  now = TCNT0;
+  timerTicks += (uint8_t)(now - timerLast);
+  timerLast = now;
+}
+
+// Steps of the main loop leave their state as it is when a stream holds the
+// bus, the next poll tries again
+static bool chipCommand(uint8_t cmd, int8_t buf)
+{
+  setCommand(cmd, writePageAddress, 0);
+  if (!SPI_WriteRead(buffer, 4, 0))
+  {
+    return false;
+  }
+  chipBusy = true;
+  chipBusyBuffer = buf;
+  return true;
+}
+
+static void program(void)
+{
+  if (!chipCommand(writeBuffer ? DB321_BUF2_PAGE_ERASE_PGM : DB321_BUF1_PAGE_ERASE_PGM, writeBuffer))
+  {
+    return;
+  }
+  timing = true;
+  timerLast = TCNT0;
+  timerTicks = 0;
+  writeBuffer ^= 1;
+  writePageAddress++;
+  writeByteAddress = 0;
+  writeFlush = false;
+}
+
+static void statusRead(void)
+{
+  buffer[0] = DB321_GET_STATUS;
+  if (SPI_WriteRead(buffer, 1, 1))
+  {
+    writeState = WRITE_STATUS;
+  }
+}
+
+static void statusDone(void)
+{
+  timerUpdate();
+  if (buffer[1] & DB321_STATUS_READY)
+  {
+    chipBusy = false;
+    if (streamProgramming)
+    {
+      streamProgramming = false;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+        streamFilled &= ~(1 << streamProgramBuffer);
+      }
+      streamProgramBuffer ^= 1;
+    }
+    if (timing)
+    {
+      timing = false;
+      DataflashProgramTime = timerTicks;
+      if (DataflashProgramTime > DataflashProgramTimeMax)
+      {
+        DataflashProgramTimeMax = DataflashProgramTime;
+      }
+    }
+  }
+}
+
+// Page that came through the stream is programmed as soon as the chip is
+// free. Returns true while there is one waiting.
+static bool streamStep(void)
+{
+  if (streamProgramming || !(streamFilled & (1 << streamProgramBuffer)))
+  {
+    return false;
+  }
+  if (chipBusy)
+  {
+    if (TCNT0 != timerLast)
+    {
+      statusRead();
+    }
+    return true;
+  }
+  writePageAddress = streamPage[streamProgramBuffer];
+  if (!chipCommand(streamProgramBuffer ? DB321_BUF2_PAGE_ERASE_PGM : DB321_BUF1_PAGE_ERASE_PGM, streamProgramBuffer))
+  {
+    return true;
+  }
+  timing = true;
+  timerLast = TCNT0;
+  timerTicks = 0;
+  streamProgramming = true;
+  return true;
+}
+
+// Next step of the write job, called once the previous transfer is over.
+// Returns true when nothing is left to do.
+static bool writeStep(void)
+{
+  uint16_t dataBytesCount;
+  bool full;
+
+  full = (writeByteAddress == DB321_PAGE_SIZE) || (writeFlush && (writeByteAddress != 0));
+  // Chip runs one operation at a time and a buffer in use cannot take data
+  if (chipBusy && (writeLoad || full || writeRelease || ((writeSize != 0) && (chipBusyBuffer == writeBuffer))))
+  {
+    if (TCNT0 != timerLast)
+    {
+      statusRead();
+    }
+    return false;
+  }
+  if (writeLoad)
+  {
+    // Page is programmed as a whole, the data in front of the start must survive
+    if (chipCommand(DB321_PAGE_2_BUF1_TRF, 0))
+    {
+      writeLoad = false;
+    }
+    return false;
+  }
+  if (full)
+  {
+    program();
+    return false;
+  }
+  if (writeSize != 0)
+  {
+    dataBytesCount = DB321_PAGE_SIZE - writeByteAddress;
+    writeCount = (dataBytesCount > writeSize) ? writeSize : (uint8_t)dataBytesCount;
+    setCommand(writeBuffer ? DB321_BUF2_WRITE : DB321_BUF1_WRITE, 0, writeByteAddress);
+    if (SPI_WriteReadContinious(buffer, 4, writeDataNext))
+    {
+      writeState = WRITE_DATA;
+    }
+    return false;
+  }
+  if (writeRelease)
+  {
+    if (streamFilled)
+    {
+      return false;
+    }
+    // Job that ended on a page boundary had nothing left to program
+    writeFlush = false;
+    writeRelease = false;
+    writeActive = false;
+    dataflashBusy = false;
+  }
+  return true;
+}
+
+static void crcStep(void)
+{
+  uint8_t *data;
+  uint8_t count;
+  uint8_t i;
+  bool last;
+
+  if (!crcActive || crcDone || !SPI_TransferCompleted)
+  {
+    return;
+  }
+  data = &crcChunks[crcBuffer * DB321_CRC_CHUNK];
+  count = crcCount;
+  last = (crcLeft == 0);
+  if (!last)
+  {
+    crcCount = (crcLeft > DB321_CRC_CHUNK) ? DB321_CRC_CHUNK : (uint8_t)crcLeft;
+    crcLeft -= crcCount;
+    crcBuffer ^= 1;
+    SPI_WriteReadContiniousNext(&crcChunks[crcBuffer * DB321_CRC_CHUNK], 0, crcCount, NULL);
+  }
+  else
+  {
+    SPI_WriteReadContiniousStop();
+    dataflashBusy = false;
+  }
+  for (i = 0; i < count; i++)
+  {
+    crcValue = _crc_xmodem_update(crcValue, data[i]);
+  }
+  crcDone = last;
+}
+
+static void writeStart(void)
+{
+  writeDone = false;
+  DataflashPoll();
+}
+
 /****************************************************************************
  * Public functions                                                         *
  ****************************************************************************/
 
 bool DataflashInit(void)
 {
+  // Free running time base for the busy time, 1024 cycles per tick
+  TCCR0A = 0x00;
+  TCCR0B = (1 << CS02) | (0 << CS01) | (1 << CS00);
   SPI_Init();
   DataflashCheckID();
   return dataflashInitialized;
@@ -65,155 +361,226 @@ bool DataflashInit(void)
 
 bool DataflashRead(uint32_t src, uint8_t *dst, uint8_t size)
 {
-  uint8_t dataBytesCount;
-  uint32_t pageAddress;
-  uint32_t byteAddress;
-  
-  assert(dataflashInitialized);
-  if(dataflashBusy)
+  if (!DataflashReadAsync(src, dst, size, NULL))
   {
     return false;
   }
-  dataflashBusy = true;
-  pageAddress = src / DB321_PAGE_SIZE;
-  byteAddress = src % DB321_PAGE_SIZE;
-  if((byteAddress + size) > DB321_PAGE_SIZE)
+  while (dataflashBusy) {}
+  return true;
+}
+
+// Write functions only queue the job and return at once, the job is carried
+// on by DataflashPoll(). Bus stays claimed until DataflashWriteEnd() is done,
+// reads fail meanwhile.
+bool DataflashWriteBegin(uint32_t dst)
+{
+  assert(dataflashInitialized);
+  if (writeActive)
   {
-    dataBytesCount = (DB321_PAGE_SIZE - byteAddress);
+    if (!writeDone)
+    {
+      return false;
+    }
   }
   else
   {
-    dataBytesCount = size;
+    if (!claim())
+    {
+      return false;
+    }
+    writeActive = true;
+    // Whatever ran before is not known
+    chipBusy = true;
+    chipBusyBuffer = 0;
+    streamFilled = 0;
+    streamBuffer = 0;
+    streamProgramBuffer = 0;
+    streamProgramming = false;
   }
-  bufferInit();
-  buffer[0] = DB321_PAGE_READ;
-  buffer[1] = (uint8_t)((pageAddress >> 6) & 0x7F);
-  buffer[2] = (uint8_t)((pageAddress << 2) & 0xFC) | (uint8_t)((byteAddress >> 8) & 0x03);
-  buffer[3] = (uint8_t)(byteAddress & 0xFF);
-  buffer[4] = 0xFF;
-  buffer[5] = 0xFF;
-  buffer[6] = 0xFF;
-  buffer[7] = 0xFF;
-  SPI_WriteRead(buffer, 8, dataBytesCount);
-  while (!SPI_TransferCompleted) {}
-  memcpy(dst, &buffer[8], dataBytesCount);
-  if(dataBytesCount < size)
-  {
-    pageAddress++;
-    dst += dataBytesCount;
-    dataBytesCount = size - dataBytesCount;
-    bufferInit();
-    buffer[0] = DB321_PAGE_READ;
-    buffer[1] = (uint8_t)((pageAddress >> 6) & 0x7F);
-    buffer[2] = (uint8_t)((pageAddress << 2) & 0xFC);
-    buffer[3] = 0x00;
-    buffer[4] = 0xFF;
-    buffer[5] = 0xFF;
-    buffer[6] = 0xFF;
-    buffer[7] = 0xFF;
-    SPI_WriteRead(buffer, 8, dataBytesCount);
-    while (!SPI_TransferCompleted) {}
-    memcpy(dst, &buffer[8], dataBytesCount);
+  writeBuffer = 0;
+  writePageAddress = dst / DB321_PAGE_SIZE;
+  writeByteAddress = dst % DB321_PAGE_SIZE;
+  writeSize = 0;
+  writeLoad = (writeByteAddress != 0);
+  writeStart();
+  return true;
+}
+
+// Bytes collect in a chip buffer, a full one is programmed while the other
+// one takes the next page. Source must stay intact until the write is done.
+bool DataflashWriteNext(uint8_t *src, uint8_t size)
+{
+  if (!writeActive || !writeDone)
+  {
+    return false;
   }
+  writeSrc = src;
+  writeSize = size;
+  writeStart();
   return true;
 }
 
-bool DataflashWrite(uint8_t *src, uint32_t dst, uint8_t size)
+bool DataflashWriteEnd(void)
+{
+  if (!writeActive || !writeDone)
+  {
+    return false;
+  }
+  writeFlush = true;
+  writeRelease = true;
+  writeStart();
+  return true;
+}
+
+bool DataflashWriteCompleted(void)
+{
+  return !writeActive || writeDone;
+}
+
+// Runs the write and crc jobs from the main loop. While the chip is busy the
+// status is read once per timer tick, which also times the page program.
+void DataflashPoll(void)
+{
+  crcStep();
+  if (!writeActive || !SPI_TransferCompleted)
+  {
+    return;
+  }
+  if (writeState == WRITE_DATA)
+  {
+    SPI_WriteReadContiniousStop();
+    writeSrc += writeCount;
+    writeSize -= writeCount;
+    writeByteAddress += writeCount;
+  }
+  if (writeState == WRITE_STATUS)
+  {
+    statusDone();
+  }
+  writeState = WRITE_IDLE;
+  if (streamStep())
+  {
+    return;
+  }
+  if (!writeDone)
+  {
+    writeDone = writeStep();
+  }
+  else if (chipBusy && (TCNT0 != timerLast))
+  {
+    statusRead();
+  }
+}
+
+// Completes in the SPI interrupt, the handler is called from there as well
+bool DataflashReadAsync(uint32_t src, uint8_t *dst, uint8_t size, DataflashHandler hnd)
+{
+  return DataflashReadPageAsync(src / DB321_PAGE_SIZE, src % DB321_PAGE_SIZE, dst, size, hnd);
+}
+
+// Same read by page and byte, the 32-bit division is too slow for interrupts
+bool DataflashReadPageAsync(uint16_t page, uint16_t offset, uint8_t *dst, uint8_t size, DataflashHandler hnd)
 {
-  uint8_t dataBytesCount;
-  uint32_t pageAddress;
-  uint32_t byteAddress;
-  
   assert(dataflashInitialized);
-  if(dataflashBusy)
+  if(!claim())
   {
     return false;
   }
-  dataflashBusy = true;
-  pageAddress = dst / DB321_PAGE_SIZE;
-  buffer[0] = DB321_PAGE_2_BUF1_TRF;
-  buffer[1] = (uint8_t)((pageAddress >> 6) & 0x7F);
-  buffer[2] = (uint8_t)((pageAddress << 2) & 0xFC);
-  buffer[3] = 0x00;
-  SPI_WriteRead(buffer, 4, 0);
-  while (!SPI_TransferCompleted) {}
-  _delay_us(DB321_PAGE_2_BUF_TRF_T_US);
-  byteAddress = dst % DB321_PAGE_SIZE;
-  if((byteAddress + size) > DB321_PAGE_SIZE)
+  readDst = dst;
+  readSize = size;
+  readHandler = hnd;
+  // Continuous array read crosses page boundaries by itself
+  setCommand(DB321_CONTINUOUS_ARRAY_READ, page, offset);
+  if (!SPI_WriteReadContinious(buffer, 8, readCommandDone))
   {
-    dataBytesCount = (DB321_PAGE_SIZE - byteAddress);
+    dataflashBusy = false;
+    return false;
   }
-  else
+  return true;
+}
+
+// Stream functions run in interrupt context while a write job is open. The
+// page is taken only by a free buffer, the byte address always starts at 0.
+bool DataflashStreamBegin(uint16_t page)
+{
+  if (!writeActive || writeRelease || (page >= DB321_PAGE_NUM) ||
+      (streamFilled & (1 << streamBuffer)) || !SPI_StreamBegin())
   {
-    dataBytesCount = size;
+    return false;
   }
-  buffer[0] = DB321_PAGE_PGM_BUF1;
-  buffer[1] = (uint8_t)((pageAddress >> 6) & 0x7F);
-  buffer[2] = (uint8_t)((pageAddress << 2) & 0xFC) | (uint8_t)((byteAddress >> 8) & 0x03);
-  buffer[3] = (uint8_t)(byteAddress & 0xFF);
-  memcpy(&buffer[4], src, dataBytesCount);
-  SPI_WriteRead(buffer, 4 + dataBytesCount, 0);
-  while (!SPI_TransferCompleted) {}
-  _delay_ms(DB321_PAGE_ERASE_PGM_T_MS);
-  if(dataBytesCount < size)
-  {
-    pageAddress++;
-    src += dataBytesCount;
-    dataBytesCount = size - dataBytesCount;
-    buffer[0] = DB321_PAGE_2_BUF1_TRF;
-    buffer[1] = (uint8_t)((pageAddress >> 6) & 0x7F);
-    buffer[2] = (uint8_t)((pageAddress << 2) & 0xFC);
-    buffer[3] = 0x00;
-    SPI_WriteRead(buffer, 4, 0);
-    while (!SPI_TransferCompleted) {}
-    _delay_us(DB321_PAGE_2_BUF_TRF_T_US);
-    buffer[0] = DB321_PAGE_PGM_BUF1;
-    buffer[1] = (uint8_t)((pageAddress >> 6) & 0x7F);
-    buffer[2] = (uint8_t)((pageAddress << 2) & 0xFC);
-    buffer[3] = 0x00;
-    memcpy(&buffer[4], src, dataBytesCount);
-    SPI_WriteRead(buffer, 4 + dataBytesCount, 0);
-    while (!SPI_TransferCompleted) {}
-    _delay_ms(DB321_PAGE_ERASE_PGM_T_MS);
-  }  
-  dataflashBusy = false;
+  streamPage[streamBuffer] = page;
+  SPI_StreamByte(streamBuffer ? DB321_BUF2_WRITE : DB321_BUF1_WRITE);
+  SPI_StreamByte(0x00);
+  SPI_StreamByte(0x00);
+  SPI_StreamByte(0x00);
   return true;
 }
 
-bool DataflashReadContinious(uint32_t src, uint8_t *dst)
+void DataflashStreamByte(uint8_t b)
 {
-  uint32_t pageAddress;
-  uint32_t byteAddress;
-  
-  assert(dataflashInitialized);
-  if(dataflashBusy)
+  SPI_StreamByte(b);
+}
+
+// Buffer that took a broken page is simply filled again by the next one.
+// Returns true when the page is kept.
+bool DataflashStreamEnd(bool keep)
+{
+  if (!SPI_StreamEnd() || !keep)
   {
     return false;
   }
-  dataflashBusy = true;
-  pageAddress = src / DB321_PAGE_SIZE;
-  byteAddress = src % DB321_PAGE_SIZE;
-  bufferInit();
-  buffer[0] = DB321_CONTINUOUS_ARRAY_READ;
-  buffer[1] = (uint8_t)((pageAddress >> 6) & 0x7F);
-  buffer[2] = (uint8_t)((pageAddress << 2) & 0xFC) | (uint8_t)((byteAddress >> 8) & 0x03);
-  buffer[3] = (uint8_t)(byteAddress & 0xFF);
-  buffer[4] = 0xFF;
-  buffer[5] = 0xFF;
-  buffer[6] = 0xFF;
-  buffer[7] = 0xFF;
-  SPI_WriteReadContinious(buffer, 8, dst);
-  while (!SPI_TransferCompleted) {}
+  streamFilled |= (1 << streamBuffer);
+  streamBuffer ^= 1;
   return true;
 }
 
-void DataflashReadContiniousNext(void)
+bool DataflashStreamWritten(uint16_t page)
 {
-  SPI_WriteReadContiniousNext();
+  uint8_t i;
+
+  for (i = 0; i < 2; i++)
+  {
+    if ((streamFilled & (1 << i)) && (streamPage[i] == page))
+    {
+      return false;
+    }
+  }
+  return true;
 }
 
-void DataflashReadContiniousStop(void)
+// Range is read with the continuous array read and the crc is worked out in
+// DataflashPoll(). Bus stays claimed until it is done, the crc starts from
+// the given value. Chunks takes 2 * DB321_CRC_CHUNK bytes up to the end.
+bool DataflashCrcBegin(uint32_t src, uint32_t size, uint16_t crc, uint8_t *chunks)
 {
-  SPI_WriteReadContiniousStop();
-  dataflashBusy = false;
+  assert(dataflashInitialized);
+  if (crcActive || (src > DB321_SIZE) || (size > (DB321_SIZE - src)) || !claim())
+  {
+    return false;
+  }
+  setCommand(DB321_CONTINUOUS_ARRAY_READ, src / DB321_PAGE_SIZE, src % DB321_PAGE_SIZE);
+  if (!SPI_WriteReadContinious(buffer, 8, NULL))
+  {
+    dataflashBusy = false;
+    return false;
+  }
+  crcActive = true;
+  crcDone = false;
+  crcLeft = size;
+  crcValue = crc;
+  crcChunks = chunks;
+  crcBuffer = 0;
+  crcCount = 0;
+  return true;
+}
+
+bool DataflashCrcCompleted(uint16_t *crc)
+{
+  if (!crcActive || !crcDone)
+  {
+    return false;
+  }
+  crcActive = false;
+  *crc = crcValue;
+  return true;
 }
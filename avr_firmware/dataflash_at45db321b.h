@@ -2,7 +2,6 @@
 #define __DATAFLASH_AT45DB321B_H_
 
 #include "spi.h"
-#include "lsmod_protocol.h"
 
 #include <inttypes.h>
 #include <stdbool.h>
@@ -56,19 +55,36 @@
 #define DB321_BLOCK_SIZE             (DB321_PAGE_SIZE * DB321_PAGE_PER_BLOCK)  // 528 * 8 = 4224 bytes
 #define DB321_BLOCK_PER_SECTOR       64
 #define DB321_PAGE_PER_SECTOR        (DB321_PAGE_PER_BLOCK * DB321_BLOCK_PER_SECTOR)  // 8 * 64 = 512 pages
-#define DB321_SECTOR_SIZE            (DB321_BLOCK_PER_SECTOR * DB321_BLOCK_SIZE)  // 64 * 4224 = 270336 bytes
+#define DB321_SECTOR_SIZE            ((uint32_t)DB321_BLOCK_PER_SECTOR * DB321_BLOCK_SIZE)  // 64 * 4224 = 270336 bytes
 #define DB321_SECTOR_0_SIZE          (DB321_PAGE_PER_BLOCK * DB321_PAGE_SIZE)  // 8 * 528 = 4224 bytes
-#define DB321_SECTOR_1_SIZE          (DB321_BLOCK_PER_SECTOR * DB321_BLOCK_SIZE) // 64 * 4224 = 270336 bytes
+#define DB321_SECTOR_1_SIZE          ((uint32_t)DB321_BLOCK_PER_SECTOR * DB321_BLOCK_SIZE) // 64 * 4224 = 270336 bytes
 #define DB321_SECTOR_NUMBER          17
-#define DB321_SIZE                   (DB321_PAGE_NUM * DB321_PAGE_SIZE)  // 8192 * 528 = 4325376 bytes = 4224 Kbytes = 4 Mbytes + 128 Kbytes
+#define DB321_SIZE                   ((uint32_t)DB321_PAGE_NUM * DB321_PAGE_SIZE)  // 8192 * 528 = 4325376 bytes = 4224 Kbytes = 4 Mbytes + 128 Kbytes
 
-#define DB321_BUFFER_SIZE            (8 + LSMOD_DATA_MAX_LEN / 2)
+#define DB321_BUFFER_SIZE            8  // Longest command with address and don't care bytes
+#define DB321_CRC_CHUNK              16  // Read at once while the previous chunk is summed up
+
+#define DB321_TIMER_PRESCALE         1024
+
+typedef void (*DataflashHandler)(void);
+
+extern uint16_t DataflashProgramTime;  // Last and longest page program, timer ticks
+extern uint16_t DataflashProgramTimeMax;
 
 bool DataflashInit(void);
 bool DataflashRead(uint32_t src, uint8_t *dst, uint8_t size);
-bool DataflashWrite(uint8_t *src, uint32_t dst, uint8_t size);
-bool DataflashReadContinious(uint32_t src, uint8_t *dst);
-void DataflashReadContiniousNext(void);
-void DataflashReadContiniousStop(void);
+bool DataflashWriteBegin(uint32_t dst);
+bool DataflashWriteNext(uint8_t *src, uint8_t size);
+bool DataflashWriteEnd(void);
+bool DataflashWriteCompleted(void);
+void DataflashPoll(void);
+bool DataflashReadAsync(uint32_t src, uint8_t *dst, uint8_t size, DataflashHandler hnd);
+bool DataflashReadPageAsync(uint16_t page, uint16_t offset, uint8_t *dst, uint8_t size, DataflashHandler hnd);
+bool DataflashStreamBegin(uint16_t page);
+void DataflashStreamByte(uint8_t b);
+bool DataflashStreamEnd(bool keep);
+bool DataflashStreamWritten(uint16_t page);
+bool DataflashCrcBegin(uint32_t src, uint32_t size, uint16_t crc, uint8_t *chunks);
+bool DataflashCrcCompleted(uint16_t *crc);
 
 #endif // __DATAFLASH_AT45DB321B_H_
@@ -0,0 +1,271 @@
+#include "effects.h"
+#include "lsmod_config.h"
+#include "ledrgb.h"
+#include "player.h"
+
+/****************************************************************************
+ * Private types/enumerations/variables                                     *
+ ****************************************************************************/
+
+// Blade length is kept in fractions of a pixel, the tip pixel is dimmed by it
+#define SUBPIXELS     16
+#define BLADE_LENGTH  (LEDRGB_TOTAL_LEN * SUBPIXELS)
+
+#define MODE_OFF         0
+#define MODE_IGNITION    1
+#define MODE_ON          2
+#define MODE_RETRACTION  3
+
+static uint8_t mode = MODE_OFF;
+static uint32_t bladeColor = 0;
+static uint32_t step;  // Track samples per blade length fraction
+static uint16_t length = 0;
+static uint8_t brightness = 255;
+static uint8_t flashPos;
+static uint8_t flashLevel = 0;
+static bool sparkle = false;
+static bool dirty = true;  // Strip shows another state than this one
+static uint8_t seed = 1;
+
+/****************************************************************************
+ * Private functions                                                        *
+ ****************************************************************************/
+
+// 8-bit Galois LFSR, 255 values long
+static uint8_t random8(void)
+{
+  seed = (seed >> 1) ^ ((seed & 1) ? 0xB8 : 0);
+  return seed;
+}
+
+static uint8_t channel(uint8_t c, uint8_t level, uint8_t white)
+{
+  c = ((uint16_t)c * (level + 1)) >> 8;
+  return c + (((uint16_t)(255 - c) * (white + 1)) >> 8);
+}
+
+// Color scaled by the level and then pulled towards white
+static uint32_t blend(uint8_t level, uint8_t white)
+{
+  uint32_t c;
+
+  c = channel((uint8_t)(bladeColor >> 16), level, white);
+  c = (c << 8) | channel((uint8_t)(bladeColor >> 8), level, white);
+  c = (c << 8) | channel((uint8_t)bladeColor, level, white);
+  return c;
+}
+
+// Track is started on the effect voice already
+static void trackStart(void)
+{
+  step = PlayerVoiceLen(VOICE_EFFECT) / BLADE_LENGTH;
+  if (step == 0)
+  {
+    step = 1;
+  }
+  brightness = 255;
+  flashLevel = 0;
+  sparkle = false;
+}
+
+static uint16_t trackLength(void)
+{
+  uint32_t len;
+
+  len = PlayerVoicePos(VOICE_EFFECT) / step;
+  return (len > BLADE_LENGTH) ? BLADE_LENGTH : (uint16_t)len;
+}
+
+// Hum loudness sets the brightness, it rises at once and falls slowly
+static void flicker(void)
+{
+  uint8_t target;
+
+  if (PlayerVoiceActive(VOICE_HUM))
+  {
+    // Peak is 128 at most
+    target = EFFECTS_FLICKER_MIN + (((uint16_t)PlayerVoicePeak(VOICE_HUM) * (255 - EFFECTS_FLICKER_MIN)) >> 7);
+  }
+  else
+  {
+    target = 255;
+  }
+  if (target > brightness)
+  {
+    brightness = target;
+  }
+  else
+  {
+    brightness -= (brightness - target) / 4;
+  }
+}
+
+// Colors of a frame are worked out before it is sent, a pixel only looks its
+// color up in the low time after the one before it
+#define SHADE_BODY  EFFECTS_FLASH_RADIUS      // Lit pixel out of the flash
+#define SHADE_TIP   (EFFECTS_FLASH_RADIUS + 1)
+
+typedef struct {
+  uint32_t shade[EFFECTS_FLASH_RADIUS + 2];  // Lit pixel by flash distance first
+  uint8_t tip;    // Pixels beyond it are off
+  bool tipLit;
+} Frame;
+
+static Frame* frame;  // Valid while the strip is sent
+
+static uint8_t flashWhite(uint8_t d)
+{
+  return (d < EFFECTS_FLASH_RADIUS) ? ((uint16_t)flashLevel * (EFFECTS_FLASH_RADIUS - d)) / EFFECTS_FLASH_RADIUS : 0;
+}
+
+static uint8_t distance(uint8_t i)
+{
+  return (i > flashPos) ? (i - flashPos) : (flashPos - i);
+}
+
+static void shade(Frame* f)
+{
+  uint8_t d, level;
+
+  for (d = 0; d < EFFECTS_FLASH_RADIUS; d++)
+  {
+    f->shade[d] = blend(brightness, flashWhite(d));
+  }
+  f->shade[SHADE_BODY] = blend(brightness, 0);
+  f->tip = length / SUBPIXELS;
+  level = ((uint16_t)brightness * (length % SUBPIXELS)) / SUBPIXELS;
+  f->tipLit = (level != 0);
+  f->shade[SHADE_TIP] = blend(level, flashWhite(distance(f->tip)));
+}
+
+static uint32_t pixel(uint8_t i)
+{
+  uint8_t d;
+
+  if ((i > frame->tip) || ((i == frame->tip) && !frame->tipLit))
+  {
+    return 0;
+  }
+  if (sparkle && (random8() < EFFECTS_SPARKLE_RATE))
+  {
+    return 0xFFFFFF;
+  }
+  if (i == frame->tip)
+  {
+    return frame->shade[SHADE_TIP];
+  }
+  d = distance(i);
+  return frame->shade[(d < EFFECTS_FLASH_RADIUS) ? d : SHADE_BODY];
+}
+
+// Pixels follow from the state alone, so the strip is only sent when the
+// state changed. Sparkle is random and sent on every frame.
+static void render(void)
+{
+  Frame f;
+
+  if (dirty || sparkle)
+  {
+    dirty = false;
+    shade(&f);
+    frame = &f;
+    LedrgbShow(pixel);
+  }
+}
+
+/****************************************************************************
+ * Public functions                                                         *
+ ****************************************************************************/
+
+void EffectsInit(void)
+{
+  mode = MODE_OFF;
+  length = 0;
+  render();
+}
+
+void EffectsColor(uint32_t color)
+{
+  bladeColor = color;
+  dirty = true;
+}
+
+// Blade grows with the playback of the turn on track
+void EffectsIgnite(void)
+{
+  trackStart();
+  length = 0;
+  mode = MODE_IGNITION;
+  dirty = true;
+}
+
+void EffectsRetract(void)
+{
+  trackStart();
+  length = BLADE_LENGTH;
+  mode = MODE_RETRACTION;
+  dirty = true;
+}
+
+void EffectsHit(void)
+{
+  flashPos = random8() % LEDRGB_TOTAL_LEN;
+  flashLevel = 255;
+  dirty = true;
+}
+
+void EffectsClash(bool on)
+{
+  // Frame after the last sparkle clears it
+  dirty = dirty || sparkle;
+  sparkle = on;
+}
+
+bool EffectsBusy(void)
+{
+  return (mode == MODE_IGNITION) || (mode == MODE_RETRACTION);
+}
+
+// Renders the next frame, to be called EFFECTS_FPS times a second
+void EffectsUpdate(void)
+{
+  uint16_t wasLength;
+  uint8_t wasBrightness;
+
+  wasLength = length;
+  wasBrightness = brightness;
+  switch (mode) {
+    case MODE_IGNITION:
+      if (PlayerVoiceActive(VOICE_EFFECT))
+      {
+        length = trackLength();
+      }
+      else
+      {
+        length = BLADE_LENGTH;
+        mode = MODE_ON;
+      }
+      break;
+    case MODE_ON:
+      flicker();
+      break;
+    case MODE_RETRACTION:
+      if (PlayerVoiceActive(VOICE_EFFECT))
+      {
+        length = BLADE_LENGTH - trackLength();
+      }
+      else
+      {
+        length = 0;
+        mode = MODE_OFF;
+      }
+      break;
+  }
+  dirty = dirty || (length != wasLength) || (brightness != wasBrightness);
+  render();
+  if (flashLevel != 0)
+  {
+    flashLevel = (flashLevel > EFFECTS_FLASH_DECAY) ? (flashLevel - EFFECTS_FLASH_DECAY) : 0;
+    dirty = true;
+  }
+}
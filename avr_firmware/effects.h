@@ -0,0 +1,22 @@
+#ifndef __EFFECTS_H_
+#define __EFFECTS_H_
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#define EFFECTS_FPS           50
+#define EFFECTS_FLICKER_MIN   176  // Blade brightness at a silent hum, 255 is full
+#define EFFECTS_FLASH_RADIUS  6    // Pixels lit up on each side of a hit
+#define EFFECTS_FLASH_DECAY   32   // Flash fades out in 255 / 32 frames
+#define EFFECTS_SPARKLE_RATE  32   // Chance of a pixel to sparkle while clashing, of 256
+
+void EffectsInit(void);
+void EffectsColor(uint32_t color);
+void EffectsIgnite(void);
+void EffectsRetract(void);
+void EffectsHit(void);
+void EffectsClash(bool on);
+bool EffectsBusy(void);
+void EffectsUpdate(void);
+
+#endif // __EFFECTS_H_
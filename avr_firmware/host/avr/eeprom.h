@@ -0,0 +1,78 @@
+#ifndef __HOST_AVR_EEPROM_H_
+#define __HOST_AVR_EEPROM_H_
+
+// EEMEM variables are gathered in one section that is kept in a file
+
+#include "host.h"
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+#define EEMEM  __attribute__((section("eeprom")))
+
+static inline void eeprom_read_block(void* dst, const void* src, size_t n)
+{
+  memcpy(dst, src, n);
+}
+
+static inline void eeprom_write_block(const void* src, void* dst, size_t n)
+{
+  memcpy(dst, src, n);
+  HostEepromSave();
+}
+
+static inline void eeprom_update_block(const void* src, void* dst, size_t n)
+{
+  if (memcmp(dst, src, n) != 0)
+  {
+    eeprom_write_block(src, dst, n);
+  }
+}
+
+static inline uint8_t eeprom_read_byte(const uint8_t* p)
+{
+  return *p;
+}
+
+static inline void eeprom_write_byte(uint8_t* p, uint8_t value)
+{
+  eeprom_write_block(&value, p, sizeof(value));
+}
+
+static inline void eeprom_update_byte(uint8_t* p, uint8_t value)
+{
+  eeprom_update_block(&value, p, sizeof(value));
+}
+
+static inline uint16_t eeprom_read_word(const uint16_t* p)
+{
+  return *p;
+}
+
+static inline void eeprom_write_word(uint16_t* p, uint16_t value)
+{
+  eeprom_write_block(&value, p, sizeof(value));
+}
+
+static inline void eeprom_update_word(uint16_t* p, uint16_t value)
+{
+  eeprom_update_block(&value, p, sizeof(value));
+}
+
+static inline uint32_t eeprom_read_dword(const uint32_t* p)
+{
+  return *p;
+}
+
+static inline void eeprom_write_dword(uint32_t* p, uint32_t value)
+{
+  eeprom_write_block(&value, p, sizeof(value));
+}
+
+static inline void eeprom_update_dword(uint32_t* p, uint32_t value)
+{
+  eeprom_update_block(&value, p, sizeof(value));
+}
+
+#endif // __HOST_AVR_EEPROM_H_
@@ -0,0 +1,13 @@
+#ifndef __HOST_AVR_INTERRUPT_H_
+#define __HOST_AVR_INTERRUPT_H_
+
+// Handlers are plain functions, host.c calls them by vector name
+
+#include "host.h"
+
+#define ISR(vector)  void vector(void); void vector(void)
+
+#define cli()  HostCli()
+#define sei()  HostSei()
+
+#endif // __HOST_AVR_INTERRUPT_H_
@@ -0,0 +1,255 @@
+#ifndef __HOST_AVR_IO_H_
+#define __HOST_AVR_IO_H_
+
+// ATmega168 registers for the host build, every one is a plain variable
+// owned by host.c. SPDR and UDR0 are 16 bits wide: the model stores a
+// received byte with bit 8 set, so a firmware write is the value without it.
+
+#include "host.h"
+
+#include <inttypes.h>
+
+#define HOST_REG8(name)   extern volatile uint8_t name;
+#define HOST_REG16(name)  extern volatile uint16_t name;
+
+HOST_REG8(PINB) HOST_REG8(DDRB) HOST_REG8(PINC) HOST_REG8(PORTC) HOST_REG8(DDRC) HOST_REG8(PIND) HOST_REG8(DDRD)
+HOST_REG8(TIFR0) HOST_REG8(TIFR1) HOST_REG8(TIFR2) HOST_REG8(EIFR) HOST_REG8(EIMSK) HOST_REG8(GPIOR0)
+HOST_REG8(SMCR) HOST_REG8(MCUSR) HOST_REG8(EICRA)
+HOST_REG8(TCCR0A) HOST_REG8(TCCR0B) HOST_REG8(TCNT0) HOST_REG8(OCR0A) HOST_REG8(OCR0B) HOST_REG8(TIMSK0)
+HOST_REG8(TCCR1A) HOST_REG8(TCCR1B) HOST_REG16(TCNT1) HOST_REG16(OCR1A) HOST_REG16(OCR1B) HOST_REG16(ICR1) HOST_REG8(TIMSK1)
+HOST_REG8(TCCR2A) HOST_REG8(TCCR2B) HOST_REG8(TCNT2) HOST_REG8(OCR2A) HOST_REG8(OCR2B) HOST_REG8(TIMSK2)
+HOST_REG8(SPCR) HOST_REG8(SPSR) HOST_REG16(SPDR)
+HOST_REG8(UCSR0B) HOST_REG8(UCSR0C) HOST_REG8(UBRR0L) HOST_REG8(UBRR0H) HOST_REG16(UDR0)
+HOST_REG16(ADCW) HOST_REG8(ADCSRA) HOST_REG8(ADCSRB) HOST_REG8(ADMUX) HOST_REG8(DIDR0)
+HOST_REG8(TWBR) HOST_REG8(TWSR) HOST_REG8(TWAR) HOST_REG8(TWDR) HOST_REG8(TWCR)
+
+// Chip select and the LED strip line are watched for edges, the USART
+// status is brought up to date before the firmware looks at it
+#define PORTB   (*HostPortB())
+#define PORTD   (*HostPortD())
+#define UCSR0A  (*HostUcsr0a())
+
+#define OCR1AL  (*(volatile uint8_t*)&OCR1A)
+#define OCR1AH  (*((volatile uint8_t*)&OCR1A + 1))
+#define ICR1L   (*(volatile uint8_t*)&ICR1)
+#define ICR1H   (*((volatile uint8_t*)&ICR1 + 1))
+#define ADC     ADCW
+#define ADCL    (*(volatile uint8_t*)&ADCW)
+#define ADCH    (*((volatile uint8_t*)&ADCW + 1))
+
+#define PINB0 0
+#define PINB1 1
+#define PINB2 2
+#define PINB3 3
+#define PINB4 4
+#define PINB5 5
+#define PINB6 6
+#define PINB7 7
+#define DDB0 0
+#define DDB1 1
+#define DDB2 2
+#define DDB3 3
+#define DDB4 4
+#define DDB5 5
+#define DDB6 6
+#define DDB7 7
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+
+#define PINC0 0
+#define PINC1 1
+#define PINC2 2
+#define PINC3 3
+#define PINC4 4
+#define PINC5 5
+#define PINC6 6
+#define DDC0 0
+#define DDC1 1
+#define DDC2 2
+#define DDC3 3
+#define DDC4 4
+#define DDC5 5
+#define DDC6 6
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PC6 6
+
+#define PIND0 0
+#define PIND1 1
+#define PIND2 2
+#define PIND3 3
+#define PIND4 4
+#define PIND5 5
+#define PIND6 6
+#define PIND7 7
+#define DDD0 0
+#define DDD1 1
+#define DDD2 2
+#define DDD3 3
+#define DDD4 4
+#define DDD5 5
+#define DDD6 6
+#define DDD7 7
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+#define TOV0 0
+#define OCF0A 1
+#define OCF0B 2
+#define TOV1 0
+#define OCF1A 1
+#define OCF1B 2
+#define ICF1 5
+#define TOV2 0
+#define OCF2A 1
+#define OCF2B 2
+#define INTF0 0
+#define INTF1 1
+#define INT0 0
+#define INT1 1
+#define ISC00 0
+#define ISC01 1
+#define ISC10 2
+#define ISC11 3
+
+#define SE 0
+#define SM0 1
+#define SM1 2
+#define SM2 3
+#define PORF 0
+#define EXTRF 1
+#define BORF 2
+#define WDRF 3
+
+#define WGM00 0
+#define WGM01 1
+#define COM0B0 4
+#define COM0B1 5
+#define COM0A0 6
+#define COM0A1 7
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define WGM02 3
+#define FOC0B 6
+#define FOC0A 7
+#define TOIE0 0
+#define OCIE0A 1
+#define OCIE0B 2
+
+#define WGM10 0
+#define WGM11 1
+#define COM1B0 4
+#define COM1B1 5
+#define COM1A0 6
+#define COM1A1 7
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define WGM13 4
+#define ICES1 6
+#define ICNC1 7
+#define TOIE1 0
+#define OCIE1A 1
+#define OCIE1B 2
+#define ICIE1 5
+
+#define WGM20 0
+#define WGM21 1
+#define COM2B0 4
+#define COM2B1 5
+#define COM2A0 6
+#define COM2A1 7
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define WGM22 3
+#define TOIE2 0
+#define OCIE2A 1
+#define OCIE2B 2
+
+#define SPR0 0
+#define SPR1 1
+#define CPHA 2
+#define CPOL 3
+#define MSTR 4
+#define DORD 5
+#define SPE 6
+#define SPIE 7
+#define SPI2X 0
+#define WCOL 6
+#define SPIF 7
+
+#define MPCM0 0
+#define U2X0 1
+#define UPE0 2
+#define DOR0 3
+#define FE0 4
+#define UDRE0 5
+#define TXC0 6
+#define RXC0 7
+#define TXB80 0
+#define RXB80 1
+#define UCSZ02 2
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define TXCIE0 6
+#define RXCIE0 7
+#define UCPOL0 0
+#define UCSZ00 1
+#define UCSZ01 2
+#define USBS0 3
+#define UPM00 4
+#define UPM01 5
+#define UMSEL00 6
+#define UMSEL01 7
+
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE 3
+#define ADIF 4
+#define ADATE 5
+#define ADSC 6
+#define ADEN 7
+#define ADTS0 0
+#define ADTS1 1
+#define ADTS2 2
+#define ACME 6
+#define MUX0 0
+#define MUX1 1
+#define MUX2 2
+#define MUX3 3
+#define ADLAR 5
+#define REFS0 6
+#define REFS1 7
+
+#define TWPS0 0
+#define TWPS1 1
+#define TWIE 0
+#define TWEN 2
+#define TWWC 3
+#define TWSTO 4
+#define TWSTA 5
+#define TWEA 6
+#define TWINT 7
+
+#endif // __HOST_AVR_IO_H_
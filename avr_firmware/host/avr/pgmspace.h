@@ -0,0 +1,17 @@
+#ifndef __HOST_AVR_PGMSPACE_H_
+#define __HOST_AVR_PGMSPACE_H_
+
+#include <inttypes.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s)  (s)
+
+#define pgm_read_byte(addr)   (*(const uint8_t*)(addr))
+#define pgm_read_word(addr)   (*(const uint16_t*)(addr))
+#define pgm_read_dword(addr)  (*(const uint32_t*)(addr))
+
+#define memcpy_P  memcpy
+#define strlen_P  strlen
+
+#endif // __HOST_AVR_PGMSPACE_H_
@@ -0,0 +1,14 @@
+#ifndef __HOST_AVR_SLEEP_H_
+#define __HOST_AVR_SLEEP_H_
+
+#include "host.h"
+
+#define SLEEP_MODE_IDLE  0
+
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu()   HostSleep()
+#define sleep_mode()  HostSleep()
+
+#endif // __HOST_AVR_SLEEP_H_
@@ -0,0 +1,12 @@
+#ifndef __HOST_AVR_WDT_H_
+#define __HOST_AVR_WDT_H_
+
+#define WDTO_15MS  0
+#define WDTO_1S    6
+#define WDTO_2S    7
+
+#define wdt_reset()
+#define wdt_enable(timeout)
+#define wdt_disable()
+
+#endif // __HOST_AVR_WDT_H_
@@ -0,0 +1,1234 @@
+#define _GNU_SOURCE  // Pseudo terminals
+
+#include "host.h"
+#include "lsmod_config.h"
+#include "lsmod_protocol.h"
+
+#include <avr/io.h>
+#include <util/crc16.h>
+#include <signal.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+// Firmware main() runs untouched and everything stays in one thread. The
+// simulated clock is moved by the delays, by sleep and by a periodic signal
+// that keeps it in step with the wall clock. Peripheral models are updated
+// as the clock moves and pending interrupt handlers are called right there
+// while interrupts are enabled. The signal plays the part of the hardware:
+// it preempts main() anywhere, so polling loops on volatile flags keep
+// working. While host code runs the signal only leaves a note for later.
+//
+// A script run leaves the wall clock out. The firmware is built with a call
+// at the start of every basic block and each block takes HOST_BLOCK_CYCLES
+// of simulated time, polling loops move the clock by themselves. The script
+// takes the place of standard input and of the pseudo terminal: serial
+// bytes come from it, replies go to the log. The same script on the same
+// build gives the same log and the same audio every time.
+//
+// Environment:
+//   LSMOD_HOST_DATAFLASH  dataflash image file, created when missing
+//   LSMOD_HOST_EEPROM     EEPROM image file, created on the first write
+//   LSMOD_HOST_AUDIO      raw unsigned 8-bit PCM of the OC1A output
+//   LSMOD_HOST_SERIAL     symlink created to the USART pseudo terminal
+//   LSMOD_HOST_SPEED      simulated time per wall clock time, 1 by default
+//   LSMOD_HOST_SCRIPT     commands to run in simulated time instead
+//
+// Commands on standard input drive the button, the contact sensor, the
+// analogue inputs and the serial input, type "help" for the list. A script
+// has the same commands one per line, "wait <ms>" in between and "#" in
+// front of a comment. Timing figures of the firmware are printed on request
+// and at exit.
+
+/****************************************************************************
+ * Private types/enumerations/variables                                     *
+ ****************************************************************************/
+
+#define HOST_TICK_US         100
+#define HOST_CATCH_UP_CYCLES (F_CPU / 100)
+#define HOST_INPUT_CYCLES    (F_CPU / 1000)
+#define HOST_PRESS_CYCLES    (F_CPU / 5)
+#define HOST_LATCH_CYCLES    (F_CPU / 20000)  // WS2811 reset, 50 us low
+#define HOST_LED_BIT_CYCLES  15  // Between 0.4 us and 1.2 us high time
+#define HOST_ADC_CHANNELS    8
+#define HOST_LINE_LEN        256
+#define HOST_BLOCK_CYCLES    6  // Basic block of the firmware in a script run, about four instructions
+#define HOST_RX_LEN          4096  // Serial bytes given by commands, not taken yet
+#define HOST_PACKET_LEN      1024
+
+typedef struct {
+  const char* name;
+  void (*handler)(void);
+  volatile uint8_t* flags;
+  uint8_t flag;
+  volatile uint8_t* mask;
+  uint8_t enable;
+  bool clear;  // Flag is cleared by hardware when the handler starts
+  uint32_t runs;
+  uint64_t cycles;  // Code time of the handler runs, script runs only
+  uint32_t cyclesMax;
+} Vector;
+
+typedef struct {
+  volatile uint8_t* tccra;
+  volatile uint8_t* tccrb;
+  volatile uint8_t* tcnt;
+  volatile uint8_t* ocra;
+  volatile uint8_t* tifr;
+  uint8_t wgm1;
+  const uint16_t* prescale;
+  uint32_t cycles;
+} Timer8;
+
+void INT0_vect(void) __attribute__((weak));
+void TIMER2_COMPA_vect(void) __attribute__((weak));
+void TIMER2_OVF_vect(void) __attribute__((weak));
+void TIMER1_COMPA_vect(void) __attribute__((weak));
+void TIMER1_OVF_vect(void) __attribute__((weak));
+void TIMER0_COMPA_vect(void) __attribute__((weak));
+void TIMER0_OVF_vect(void) __attribute__((weak));
+void SPI_STC_vect(void) __attribute__((weak));
+void USART_RX_vect(void) __attribute__((weak));
+void USART_UDRE_vect(void) __attribute__((weak));
+void USART_TX_vect(void) __attribute__((weak));
+void ADC_vect(void) __attribute__((weak));
+
+extern uint8_t __start_eeprom[] __attribute__((weak));
+extern uint8_t __stop_eeprom[] __attribute__((weak));
+
+static volatile uint8_t portB, portD, ucsr0a;
+
+static const uint16_t prescale01[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+static const uint16_t prescale2[8] = {0, 1, 8, 32, 64, 128, 256, 1024};
+static const uint8_t spiDivider[4] = {4, 16, 64, 128};
+
+static volatile sig_atomic_t busy = 0;  // Host code nesting depth
+static volatile sig_atomic_t missed = 0;  // Tick arrived while busy
+static volatile sig_atomic_t quit = 0;
+static bool interruptsEnabled = false;  // Cleared after reset
+static bool inHandler = false;
+static uint32_t interruptsServed = 0;
+
+static Vector vectors[12];
+static uint8_t vectorsCount;
+static Timer8 timer0, timer2;
+static uint32_t timer1Cycles;
+static bool spiBusy = false;
+static uint64_t spiDone;
+static bool txBusy = false;
+static uint8_t txByte;
+static uint64_t txDone, rxNext;
+static bool adcBusy = false;
+static uint64_t adcDone;
+static uint16_t adcInput[HOST_ADC_CHANNELS] = {512, 512, 612, 760, 0, 0, 0, 0};
+static uint64_t inputNext = 0;
+static uint64_t buttonRelease = 0;
+static bool buttonHeld = false;
+static bool sensorActive = false;
+
+static double speed = 1.0;
+static FILE* script = NULL;
+static uint64_t scriptNext = 0;  // Next line is held back until then
+static uint32_t blockCycles = 0;  // Code time not taken off the clock yet
+static int serial = -1;
+static uint8_t rxQueue[HOST_RX_LEN];
+static uint16_t rxHead = 0, rxCount = 0;
+static char txText[HOST_LINE_LEN];
+static int txTextLen = 0;
+static FILE* audio = NULL;
+static const char* eepromPath = NULL;
+static struct timespec started;
+static char line[HOST_LINE_LEN];
+static uint8_t lineLen = 0;
+
+static bool chipSelectLevel = false;
+static bool ledLevel = false;
+static uint64_t delayTime = 0;  // Cycles spent in delays, times the strip bits
+static uint64_t ledRise, ledStart;
+static uint64_t ledFall;  // Code time included, the strip latches on a long low
+static uint8_t ledByte, ledBits;
+static uint16_t ledLen = 0, ledShownLen = 0;
+static uint8_t ledFrame[HOST_LED_MAX_LEN * 3];
+static uint8_t ledShown[HOST_LED_MAX_LEN * 3];
+
+// Timing of the firmware, measured in delay cycles like the strip bits
+static uint32_t frameTime = 0, frameTimeMax = 0;
+static bool locked = false;
+static uint64_t lockStart;
+static uint32_t lockTimeMax = 0;
+static uint32_t gapTimeMax = 0;  // Longest low between two bits of a frame
+static uint32_t audioLost = 0;  // Audio interrupts raised while the previous one was pending
+
+/****************************************************************************
+ * Public types/enumerations/variables                                      *
+ ****************************************************************************/
+
+volatile uint64_t HostCycles = 0;
+
+volatile uint8_t PINB, DDRB, PINC, PORTC, DDRC, PIND, DDRD;
+volatile uint8_t TIFR0, TIFR1, TIFR2, EIFR, EIMSK, GPIOR0, SMCR, MCUSR, EICRA;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B, TIMSK0;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+volatile uint16_t TCNT1, OCR1A, OCR1B, ICR1;
+volatile uint8_t TCCR2A, TCCR2B, TCNT2, OCR2A, OCR2B, TIMSK2;
+volatile uint8_t SPCR, SPSR;
+volatile uint16_t SPDR;
+volatile uint8_t UCSR0B, UCSR0C, UBRR0L, UBRR0H;
+volatile uint16_t UDR0;
+volatile uint16_t ADCW;
+volatile uint8_t ADCSRA, ADCSRB, ADMUX, DIDR0;
+volatile uint8_t TWBR, TWSR, TWAR, TWDR, TWCR;
+
+/****************************************************************************
+ * Private functions                                                        *
+ ****************************************************************************/
+
+static void catchUp(void);
+
+static void enter(void)
+{
+  busy++;
+}
+
+static void leave(void)
+{
+  if ((busy == 1) && missed)
+  {
+    missed = 0;
+    catchUp();
+  }
+  busy--;
+}
+
+static void addVector(const char* name, void (*handler)(void), volatile uint8_t* flags, uint8_t flag,
+                      volatile uint8_t* mask, uint8_t enable, bool clear)
+{
+  Vector* v;
+
+  v = &vectors[vectorsCount++];
+  v->name = name;
+  v->handler = handler;
+  v->flags = flags;
+  v->flag = flag;
+  v->mask = mask;
+  v->enable = enable;
+  v->clear = clear;
+}
+
+// Same priority as the ATmega168 vector table
+static void vectorsInit(void)
+{
+  vectorsCount = 0;
+  addVector("INT0", INT0_vect, &EIFR, (1 << INTF0), &EIMSK, (1 << INT0), true);
+  addVector("TIMER2_COMPA", TIMER2_COMPA_vect, &TIFR2, (1 << OCF2A), &TIMSK2, (1 << OCIE2A), true);
+  addVector("TIMER2_OVF", TIMER2_OVF_vect, &TIFR2, (1 << TOV2), &TIMSK2, (1 << TOIE2), true);
+  addVector("TIMER1_COMPA", TIMER1_COMPA_vect, &TIFR1, (1 << OCF1A), &TIMSK1, (1 << OCIE1A), true);
+  addVector("TIMER1_OVF", TIMER1_OVF_vect, &TIFR1, (1 << TOV1), &TIMSK1, (1 << TOIE1), true);
+  addVector("TIMER0_COMPA", TIMER0_COMPA_vect, &TIFR0, (1 << OCF0A), &TIMSK0, (1 << OCIE0A), true);
+  addVector("TIMER0_OVF", TIMER0_OVF_vect, &TIFR0, (1 << TOV0), &TIMSK0, (1 << TOIE0), true);
+  addVector("SPI_STC", SPI_STC_vect, &SPSR, (1 << SPIF), &SPCR, (1 << SPIE), true);
+  addVector("USART_RX", USART_RX_vect, &ucsr0a, (1 << RXC0), &UCSR0B, (1 << RXCIE0), true);
+  addVector("USART_UDRE", USART_UDRE_vect, &ucsr0a, (1 << UDRE0), &UCSR0B, (1 << UDRIE0), false);
+  addVector("USART_TX", USART_TX_vect, &ucsr0a, (1 << TXC0), &UCSR0B, (1 << TXCIE0), true);
+  addVector("ADC", ADC_vect, &ADCSRA, (1 << ADIF), &ADCSRA, (1 << ADIE), true);
+}
+
+// Handlers run with interrupts disabled, as on the chip
+static void dispatch(void)
+{
+  uint32_t start, cycles;
+  uint8_t i;
+  Vector* v;
+
+  if (!interruptsEnabled || inHandler)
+  {
+    return;
+  }
+  inHandler = true;
+  for (i = 0; i < vectorsCount; i++)
+  {
+    v = &vectors[i];
+    if (v->handler && (*v->flags & v->flag) && (*v->mask & v->enable))
+    {
+      if (v->clear)
+      {
+        *v->flags &= ~v->flag;
+      }
+      start = blockCycles;
+      v->handler();
+      cycles = blockCycles - start;
+      v->runs++;
+      v->cycles += cycles;
+      if (cycles > v->cyclesMax)
+      {
+        v->cyclesMax = cycles;
+      }
+      interruptsServed++;
+    }
+  }
+  inHandler = false;
+}
+
+static void timer8Step(Timer8* t, uint32_t cycles)
+{
+  uint16_t prescale;
+  bool ctc;
+
+  prescale = t->prescale[*t->tccrb & 0x07];
+  if (prescale == 0)
+  {
+    return;
+  }
+  ctc = ((*t->tccra & 0x03) == (1 << t->wgm1));
+  t->cycles += cycles;
+  while (t->cycles >= prescale)
+  {
+    t->cycles -= prescale;
+    if (*t->tcnt == *t->ocra)
+    {
+      *t->tifr |= (1 << OCF0A);
+      if (ctc)
+      {
+        *t->tcnt = 0;
+        continue;
+      }
+    }
+    if (++*t->tcnt == 0)
+    {
+      *t->tifr |= (1 << TOV0);
+    }
+  }
+}
+
+static uint16_t timer1Top(void)
+{
+  uint8_t wgm;
+
+  wgm = ((TCCR1B >> WGM12) & 0x03) << 2 | (TCCR1A & 0x03);
+  switch (wgm)
+  {
+    case 4:
+    case 9:
+    case 11:
+    case 15:
+      return OCR1A;
+    case 8:
+    case 10:
+    case 12:
+    case 14:
+      return ICR1;
+    case 1:
+    case 5:
+      return 0x00FF;
+    case 2:
+    case 6:
+      return 0x01FF;
+    case 3:
+    case 7:
+      return 0x03FF;
+    default:
+      return 0xFFFF;
+  }
+}
+
+static void timer1Step(uint32_t cycles)
+{
+  uint16_t prescale, top;
+  uint32_t duty;
+
+  prescale = prescale01[TCCR1B & 0x07];
+  if (prescale == 0)
+  {
+    return;
+  }
+  top = timer1Top();
+  timer1Cycles += cycles;
+  while (timer1Cycles >= prescale)
+  {
+    timer1Cycles -= prescale;
+    if (TCNT1 == OCR1A)
+    {
+      TIFR1 |= (1 << OCF1A);
+    }
+    if (TCNT1 >= top)
+    {
+      TCNT1 = 0;
+      if ((TIFR1 & (1 << TOV1)) && (TIMSK1 & (1 << TOIE1)))
+      {
+        audioLost++;
+      }
+      TIFR1 |= (1 << TOV1);
+      if (audio && (TCCR1A & (1 << COM1A1)))
+      {
+        duty = ((uint32_t)OCR1A << 8) / ((uint32_t)top + 1);
+        fputc((duty > 0xFF) ? 0xFF : (int)duty, audio);
+      }
+    }
+    else
+    {
+      TCNT1++;
+    }
+  }
+}
+
+static void portBSync(void)
+{
+  bool level;
+
+  level = ((portB & (1 << PB2)) != 0);
+  if (level != chipSelectLevel)
+  {
+    chipSelectLevel = level;
+    HostDataflashSelect(!level);
+  }
+}
+
+static void ledShow(uint16_t len)
+{
+  uint16_t i, run;
+  char text[HOST_LINE_LEN];
+  int used;
+
+  if ((len == ledShownLen) && (memcmp(ledFrame, ledShown, len * 3) == 0))
+  {
+    return;
+  }
+  memcpy(ledShown, ledFrame, len * 3);
+  ledShownLen = len;
+  used = 0;
+  text[0] = '\0';
+  for (i = 0; i < len; i += run)
+  {
+    for (run = 1; ((i + run) < len) && (memcmp(&ledFrame[i * 3], &ledFrame[(i + run) * 3], 3) == 0); run++);
+    // Strip takes green first
+    used += snprintf(text + used, sizeof(text) - used, " %ux%02X%02X%02X", run,
+                     ledFrame[i * 3 + 1], ledFrame[i * 3], ledFrame[i * 3 + 2]);
+    if (used >= (int)sizeof(text))
+    {
+      break;
+    }
+  }
+  HostLog("led:%s", text);
+}
+
+// Bits are told apart by how long the line stays high. Only the delays count,
+// a tick that lands between two port writes must not stretch the pulse.
+static void portDSync(void)
+{
+  bool level;
+
+  level = ((portD & (1 << PD6)) != 0);
+  if (level != ledLevel)
+  {
+    ledLevel = level;
+    if (level)
+    {
+      if ((ledLen == 0) && (ledBits == 0))
+      {
+        ledStart = delayTime;
+      }
+      else if ((HostCycles + blockCycles - ledFall) > gapTimeMax)
+      {
+        gapTimeMax = (uint32_t)(HostCycles + blockCycles - ledFall);
+      }
+      ledRise = delayTime;
+    }
+    else
+    {
+      ledFall = HostCycles + blockCycles;
+      ledByte = (ledByte << 1) | ((delayTime - ledRise) > HOST_LED_BIT_CYCLES);
+      if (++ledBits == 8)
+      {
+        ledBits = 0;
+        if (ledLen < sizeof(ledFrame))
+        {
+          ledFrame[ledLen++] = ledByte;
+        }
+        frameTime = (uint32_t)(delayTime - ledStart);
+      }
+    }
+  }
+}
+
+static void ledLatch(void)
+{
+  if (!ledLevel && (ledLen >= 3))
+  {
+    if (frameTime > frameTimeMax)
+    {
+      frameTimeMax = frameTime;
+    }
+    ledShow(ledLen / 3);
+  }
+  ledLen = 0;
+  ledBits = 0;
+}
+
+// Bytes sent in a script run are logged a packet per line
+static void txLog(uint8_t c)
+{
+  txTextLen += snprintf(txText + txTextLen, sizeof(txText) - txTextLen, " %02X", c);
+  if ((c == LSMOD_PACKET_END) || (txTextLen > ((int)sizeof(txText) - 4)))
+  {
+    HostLog("tx:%s", txText);
+    txTextLen = 0;
+  }
+}
+
+static void rxPut(uint8_t c)
+{
+  if (rxCount == HOST_RX_LEN)
+  {
+    HostLog("serial: input queue is full");
+    return;
+  }
+  rxQueue[(rxHead + rxCount) % HOST_RX_LEN] = c;
+  rxCount++;
+}
+
+// Hex bytes, a group followed by *n is repeated n times: "DA 00*4 0102*3".
+// Returns the count, -1 when the text is not understood.
+static int parseBytes(char* text, uint8_t* dst, int size)
+{
+  char* token;
+  char* end;
+  unsigned long repeat, value;
+  int len, start, i, digits;
+
+  len = 0;
+  for (token = strtok(text, " "); token; token = strtok(NULL, " "))
+  {
+    start = len;
+    for (digits = 0; isxdigit((unsigned char)token[digits]); digits++);
+    if ((digits == 0) || (digits % 2))
+    {
+      return -1;
+    }
+    for (i = 0; i < digits; i += 2)
+    {
+      if (len == size)
+      {
+        return -1;
+      }
+      sscanf(token + i, "%2lx", &value);
+      dst[len++] = (uint8_t)value;
+    }
+    repeat = 1;
+    if (token[digits] == '*')
+    {
+      repeat = strtoul(token + digits + 1, &end, 10);
+      if ((*end != '\0') || (repeat == 0) || ((len + (repeat - 1) * (len - start)) > (unsigned long)size))
+      {
+        return -1;
+      }
+    }
+    else if (token[digits] != '\0')
+    {
+      return -1;
+    }
+    while (--repeat)
+    {
+      memcpy(dst + len, dst + start, digits / 2);
+      len += digits / 2;
+    }
+  }
+  return len;
+}
+
+// Packet from the PC to the module, framed and escaped like the service does
+static void packetPut(uint8_t cmd, uint8_t* data, int len)
+{
+  uint8_t head[LSMOD_PACKET_DATA_INDEX] = {LSMOD_PACKET_HDR, LSMOD_ADDR, PC_ADDR, cmd};
+  uint8_t tail[LSMOD_CRC_LEN];
+  uint8_t c;
+  uint16_t crc;
+  int i;
+
+  crc = LSMOD_CRC_INIT;
+  for (i = 0; i < LSMOD_PACKET_DATA_INDEX; i++)
+  {
+    rxPut(head[i]);
+    crc = _crc_xmodem_update(crc, head[i]);
+  }
+  for (i = 0; i < len; i++)
+  {
+    crc = _crc_xmodem_update(crc, data[i]);
+  }
+  tail[0] = (uint8_t)(crc >> 8);
+  tail[1] = (uint8_t)crc;
+  for (i = 0; i < (len + LSMOD_CRC_LEN); i++)
+  {
+    c = (i < len) ? data[i] : tail[i - len];
+    if ((c == LSMOD_PACKET_HDR) || (c == LSMOD_PACKET_MSK) || (c == LSMOD_PACKET_END))
+    {
+      rxPut(LSMOD_PACKET_MSK);
+      c = 0xFF - c;
+    }
+    rxPut(c);
+  }
+  rxPut(LSMOD_PACKET_END);
+}
+
+static uint32_t uartByteCycles(void)
+{
+  uint32_t ubrr;
+
+  ubrr = ((uint32_t)UBRR0H << 8) | UBRR0L;
+  return 10 * 16 * (ubrr + 1) / ((ucsr0a & (1 << U2X0)) ? 2 : 1);
+}
+
+// Written data is taken at once, so the next status read sees the register busy
+static void uartSync(void)
+{
+  if ((UCSR0B & (1 << TXEN0)) && !txBusy && !(UDR0 & 0x100))
+  {
+    // No separate shift register, the data register is busy for the whole frame
+    txByte = (uint8_t)UDR0;
+    UDR0 |= 0x100;
+    txBusy = true;
+    txDone = HostCycles + uartByteCycles();
+    ucsr0a &= ~(1 << UDRE0);
+  }
+}
+
+static void uartStep(void)
+{
+  uint8_t c;
+
+  uartSync();
+  if (txBusy && (HostCycles >= txDone))
+  {
+    if (script)
+    {
+      txLog(txByte);
+    }
+    else if ((serial >= 0) && (write(serial, &txByte, 1) < 0) && (errno != EAGAIN))
+    {
+      HostLog("serial: write failed, %s", strerror(errno));
+    }
+    txBusy = false;
+    ucsr0a |= (1 << UDRE0) | (1 << TXC0);
+  }
+  if ((UCSR0B & (1 << RXEN0)) && !(ucsr0a & (1 << RXC0)) && (HostCycles >= rxNext))
+  {
+    rxNext = HostCycles + uartByteCycles();
+    if (rxCount != 0)
+    {
+      c = rxQueue[rxHead];
+      rxHead = (rxHead + 1) % HOST_RX_LEN;
+      rxCount--;
+      UDR0 = 0x100 | c;
+      ucsr0a |= (1 << RXC0);
+    }
+    else if ((serial >= 0) && (read(serial, &c, 1) == 1))
+    {
+      UDR0 = 0x100 | c;
+      ucsr0a |= (1 << RXC0);
+    }
+  }
+}
+
+static void spiStep(void)
+{
+  uint8_t divider;
+
+  if (!(SPCR & (1 << SPE)))
+  {
+    return;
+  }
+  if (!spiBusy && !(SPDR & 0x100))
+  {
+    divider = spiDivider[SPCR & 0x03] / ((SPSR & (1 << SPI2X)) ? 2 : 1);
+    spiBusy = true;
+    spiDone = HostCycles + 8 * divider;
+  }
+  if (spiBusy && (HostCycles >= spiDone))
+  {
+    portBSync();
+    SPDR = 0x100 | HostDataflashTransfer((uint8_t)SPDR);
+    SPSR |= (1 << SPIF);
+    spiBusy = false;
+  }
+}
+
+static void adcStep(void)
+{
+  uint8_t ch;
+
+  if (!(ADCSRA & (1 << ADEN)))
+  {
+    adcBusy = false;
+    return;
+  }
+  if (!adcBusy && (ADCSRA & (1 << ADSC)))
+  {
+    adcBusy = true;
+    adcDone = HostCycles + 13 * (2 << ((ADCSRA & 0x07) ? ((ADCSRA & 0x07) - 1) : 0));
+  }
+  if (adcBusy && (HostCycles >= adcDone))
+  {
+    ch = ADMUX & 0x0F;
+    ADCW = (ch < HOST_ADC_CHANNELS) ? adcInput[ch] : 0;
+    ADCSRA = (ADCSRA & ~(1 << ADSC)) | (1 << ADIF);
+    adcBusy = false;
+  }
+}
+
+static double cyclesUs(uint32_t cycles)
+{
+  return (double)cycles * 1e6 / F_CPU;
+}
+
+// Handler figures leave out the vector, the register saving and reti
+static void timingHandlers(void)
+{
+  uint8_t i;
+  Vector* v;
+
+  for (i = 0; i < vectorsCount; i++)
+  {
+    v = &vectors[i];
+    if (script && (v->runs != 0))
+    {
+      HostLog("timing: %s %u cycles at most, %u on average over %u runs", v->name, v->cyclesMax,
+              (unsigned)(v->cycles / v->runs), v->runs);
+      // A receive run takes one byte off the line
+      if (v->handler == USART_RX_vect)
+      {
+        HostLog("timing: %s %.0f bytes/s if nothing else runs", v->name, (double)F_CPU * v->runs / v->cycles);
+      }
+    }
+    v->runs = 0;
+    v->cycles = 0;
+    v->cyclesMax = 0;
+  }
+}
+
+static void timing(void)
+{
+  HostLog("timing: strip frame %.1f us, longest %.1f us", cyclesUs(frameTime), cyclesUs(frameTimeMax));
+  HostLog("timing: interrupts disabled %.1f us at most", cyclesUs(lockTimeMax));
+  HostLog("timing: strip low between bits %.1f us at most", cyclesUs(gapTimeMax));
+  HostLog("timing: audio interrupts lost %u", audioLost);
+  timingHandlers();
+}
+
+static void help(void)
+{
+  HostLog("commands:");
+  HostLog("  button [down|up]  press the button for a moment or hold it");
+  HostLog("  sensor on|off     contact sensor state");
+  HostLog("  adc <ch> <value>  analogue input, 0..1023");
+  HostLog("  serial <bytes>    raw bytes to the USART input, hex, 00*4 repeats");
+  HostLog("  packet <cmd> <bytes>  packet from the PC, framed, escaped and with crc");
+  HostLog("  timing            strip frame, interrupts off, lost audio and handler figures");
+  HostLog("  quit");
+}
+
+static void command(char* cmd)
+{
+  static uint8_t bytes[HOST_PACKET_LEN];
+  char* arg;
+  unsigned ch, value;
+  int len, i;
+
+  arg = strchr(cmd, ' ');
+  if (arg)
+  {
+    *arg++ = '\0';
+  }
+  if (strcmp(cmd, "button") == 0)
+  {
+    buttonHeld = !arg || (strcmp(arg, "up") != 0);
+    buttonRelease = arg ? 0 : (HostCycles + HOST_PRESS_CYCLES);
+  }
+  else if ((strcmp(cmd, "sensor") == 0) && arg)
+  {
+    sensorActive = (strcmp(arg, "on") == 0);
+  }
+  else if ((strcmp(cmd, "adc") == 0) && arg && (sscanf(arg, "%u %u", &ch, &value) == 2) &&
+           (ch < HOST_ADC_CHANNELS) && (value < 1024))
+  {
+    adcInput[ch] = (uint16_t)value;
+  }
+  else if ((strcmp(cmd, "serial") == 0) && arg && ((len = parseBytes(arg, bytes, sizeof(bytes))) >= 0))
+  {
+    for (i = 0; i < len; i++)
+    {
+      rxPut(bytes[i]);
+    }
+  }
+  else if ((strcmp(cmd, "packet") == 0) && arg && ((len = parseBytes(arg, bytes, sizeof(bytes))) >= 1))
+  {
+    packetPut(bytes[0], bytes + 1, len - 1);
+  }
+  else if (strcmp(cmd, "timing") == 0)
+  {
+    timing();
+    frameTimeMax = 0;
+    lockTimeMax = 0;
+    gapTimeMax = 0;
+    audioLost = 0;
+  }
+  else if (strcmp(cmd, "quit") == 0)
+  {
+    quit = 1;
+  }
+  else if (cmd[0] != '\0')
+  {
+    help();
+  }
+}
+
+// Lines are taken up to the next wait, the end of the script ends the run
+static void scriptStep(void)
+{
+  unsigned ms;
+
+  while (!quit && (HostCycles >= scriptNext))
+  {
+    if (!fgets(line, sizeof(line), script))
+    {
+      quit = 1;
+      break;
+    }
+    line[strcspn(line, "\r\n")] = '\0';
+    if ((line[0] == '#') || (line[0] == '\0'))
+    {
+      continue;
+    }
+    if (sscanf(line, "wait %u", &ms) == 1)
+    {
+      scriptNext = HostCycles + (uint64_t)ms * (F_CPU / 1000);
+      continue;
+    }
+    HostLog("> %s", line);
+    command(line);
+  }
+}
+
+static void stdinStep(void)
+{
+  struct pollfd fd;
+  char c;
+
+  fd.fd = STDIN_FILENO;
+  fd.events = POLLIN;
+  while ((poll(&fd, 1, 0) == 1) && (fd.revents & POLLIN))
+  {
+    if (read(STDIN_FILENO, &c, 1) != 1)
+    {
+      break;
+    }
+    if ((c == '\n') || (c == '\r'))
+    {
+      line[lineLen] = '\0';
+      lineLen = 0;
+      command(line);
+    }
+    else if (lineLen < (HOST_LINE_LEN - 1))
+    {
+      line[lineLen++] = c;
+    }
+  }
+}
+
+static void inputStep(void)
+{
+  if (script)
+  {
+    scriptStep();
+  }
+  else
+  {
+    stdinStep();
+  }
+  if (buttonRelease && (HostCycles >= buttonRelease))
+  {
+    buttonRelease = 0;
+    buttonHeld = false;
+  }
+  PINB = (PINB & ~(1 << PINB0)) | (buttonHeld ? 0 : (1 << PINB0));
+  PIND = (PIND & ~(1 << PIND5)) | (sensorActive ? (1 << PIND5) : 0);
+}
+
+static void advance(uint64_t cycles)
+{
+  uint32_t step;
+
+  while (cycles > 0)
+  {
+    step = (cycles > HOST_QUANTUM_CYCLES) ? HOST_QUANTUM_CYCLES : (uint32_t)cycles;
+    cycles -= step;
+    HostCycles += step;
+    timer8Step(&timer0, step);
+    timer1Step(step);
+    timer8Step(&timer2, step);
+    portBSync();
+    spiStep();
+    uartStep();
+    adcStep();
+    if (HostCycles >= inputNext)
+    {
+      inputNext = HostCycles + HOST_INPUT_CYCLES;
+      inputStep();
+    }
+    dispatch();
+  }
+  if (quit)
+  {
+    exit(EXIT_SUCCESS);
+  }
+}
+
+static uint64_t wallCycles(void)
+{
+  struct timespec now;
+  double elapsed;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = (now.tv_sec - started.tv_sec) + (now.tv_nsec - started.tv_nsec) / 1e9;
+  return (uint64_t)(elapsed * speed * F_CPU);
+}
+
+static void catchUp(void)
+{
+  uint64_t target;
+
+  target = wallCycles();
+  // Host is slower than the chip, the lag is code time and goes where the
+  // interrupts are enabled. Otherwise locked sections would last for ticks
+  // and lose interrupts the chip never loses. A polling loop with interrupts
+  // disabled still gets the clock moving after a while.
+  if (locked && (target < (HostCycles + HOST_CATCH_UP_CYCLES)))
+  {
+    missed = 1;
+    return;
+  }
+  if (target > HostCycles)
+  {
+    // A stalled process would otherwise fire a long burst of handlers
+    if ((target - HostCycles) > HOST_CATCH_UP_CYCLES)
+    {
+      target = HostCycles + HOST_CATCH_UP_CYCLES;
+    }
+    advance(target - HostCycles);
+  }
+}
+
+// Delays keep the simulated clock from running far ahead of the wall clock,
+// a script run goes as fast as it can
+static void holdBack(void)
+{
+  struct timespec wait;
+  uint64_t now, ahead;
+
+  if (script)
+  {
+    return;
+  }
+  now = wallCycles();
+  if (HostCycles > (now + HOST_INPUT_CYCLES))
+  {
+    ahead = (uint64_t)((HostCycles - now) / speed * (1000000000.0 / F_CPU));
+    wait.tv_sec = ahead / 1000000000;
+    wait.tv_nsec = ahead % 1000000000;
+    while ((nanosleep(&wait, &wait) != 0) && (errno == EINTR));
+  }
+}
+
+static void tick(int sig)
+{
+  (void)sig;
+  if (busy)
+  {
+    missed = 1;
+    return;
+  }
+  enter();
+  catchUp();
+  busy--;
+}
+
+static void serialInit(void)
+{
+  const char* link;
+  struct termios tio;
+  int slave;
+
+  serial = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if ((serial < 0) || (grantpt(serial) != 0) || (unlockpt(serial) != 0))
+  {
+    HostLog("serial: no pseudo terminal, %s", strerror(errno));
+    serial = -1;
+    return;
+  }
+  // Slave end is kept open, otherwise the master reads fail while nobody is connected
+  slave = open(ptsname(serial), O_RDWR | O_NOCTTY);
+  if ((slave >= 0) && (tcgetattr(slave, &tio) == 0))
+  {
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+  }
+  HostLog("serial: %s", ptsname(serial));
+  link = getenv("LSMOD_HOST_SERIAL");
+  if (link)
+  {
+    unlink(link);
+    if (symlink(ptsname(serial), link) == 0)
+    {
+      HostLog("serial: linked to %s", link);
+    }
+  }
+}
+
+static void eepromLoad(void)
+{
+  FILE* f;
+  size_t size;
+
+  eepromPath = getenv("LSMOD_HOST_EEPROM");
+  if (!eepromPath || !__start_eeprom)
+  {
+    return;
+  }
+  size = __stop_eeprom - __start_eeprom;
+  f = fopen(eepromPath, "rb");
+  if (f)
+  {
+    if (fread(__start_eeprom, 1, size, f) != size)
+    {
+      HostLog("eeprom: %s is shorter than %zu bytes", eepromPath, size);
+    }
+    fclose(f);
+  }
+}
+
+static void quitSignal(int sig)
+{
+  (void)sig;
+  quit = 1;
+}
+
+static void hostExit(void)
+{
+  timing();
+  if (audio)
+  {
+    fclose(audio);
+    audio = NULL;
+  }
+}
+
+__attribute__((constructor)) static void hostInit(void)
+{
+  const char* env;
+  struct sigaction sa;
+  struct itimerval timer;
+
+  setvbuf(stderr, NULL, _IOLBF, 0);
+  PINB = (1 << PINB0);
+  SPDR = 0x100;
+  UDR0 = 0x100;
+  ucsr0a = (1 << UDRE0);
+  timer0 = (Timer8){&TCCR0A, &TCCR0B, &TCNT0, &OCR0A, &TIFR0, WGM01, prescale01, 0};
+  timer2 = (Timer8){&TCCR2A, &TCCR2B, &TCNT2, &OCR2A, &TIFR2, WGM21, prescale2, 0};
+  vectorsInit();
+  env = getenv("LSMOD_HOST_SPEED");
+  if (env && (atof(env) > 0))
+  {
+    speed = atof(env);
+  }
+  env = getenv("LSMOD_HOST_SCRIPT");
+  if (env)
+  {
+    script = fopen(env, "r");
+    if (!script)
+    {
+      HostLog("script: cannot read %s, %s", env, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  HostDataflashInit(getenv("LSMOD_HOST_DATAFLASH"));
+  eepromLoad();
+  env = getenv("LSMOD_HOST_AUDIO");
+  if (env)
+  {
+    audio = fopen(env, "wb");
+    if (!audio)
+    {
+      HostLog("audio: cannot write %s, %s", env, strerror(errno));
+    }
+  }
+  atexit(hostExit);
+  signal(SIGINT, quitSignal);
+  signal(SIGTERM, quitSignal);
+  if (script)
+  {
+    return;
+  }
+  serialInit();
+  help();
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = tick;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGALRM, &sa, NULL);
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = HOST_TICK_US;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+/****************************************************************************
+ * Public functions                                                         *
+ ****************************************************************************/
+
+// Called at the start of every basic block of the firmware. Code time is
+// taken off the clock once a quantum is full and never from within host
+// code, handlers run from here get their time charged after they return.
+void __sanitizer_cov_trace_pc(void)
+{
+  uint32_t cycles;
+
+  if (!script)
+  {
+    return;
+  }
+  blockCycles += HOST_BLOCK_CYCLES;
+  if (!busy && (blockCycles >= HOST_QUANTUM_CYCLES))
+  {
+    enter();
+    cycles = blockCycles;
+    blockCycles = 0;
+    advance(cycles);
+    leave();
+  }
+}
+
+void HostCli(void)
+{
+  if (!inHandler)
+  {
+    if (interruptsEnabled)
+    {
+      locked = true;
+      lockStart = delayTime;
+    }
+    interruptsEnabled = false;
+  }
+}
+
+void HostSei(void)
+{
+  if (!inHandler)
+  {
+    enter();
+    // Longest time a handler might have waited
+    if (locked && ((delayTime - lockStart) > lockTimeMax))
+    {
+      lockTimeMax = (uint32_t)(delayTime - lockStart);
+    }
+    locked = false;
+    interruptsEnabled = true;
+    // Latched interrupts are served before the next instruction, as on the chip
+    dispatch();
+    leave();
+  }
+}
+
+uint8_t HostInterruptsEnabled(void)
+{
+  return interruptsEnabled && !inHandler;
+}
+
+void HostDelay(uint32_t cycles)
+{
+  enter();
+  portDSync();
+  if ((cycles >= HOST_LATCH_CYCLES) && (ledLen != 0))
+  {
+    ledLatch();
+  }
+  delayTime += cycles;
+  advance(cycles);
+  holdBack();
+  leave();
+}
+
+void HostSleep(void)
+{
+  uint32_t served;
+
+  enter();
+  served = interruptsServed;
+  while (served == interruptsServed)
+  {
+    advance(HOST_QUANTUM_CYCLES);
+    holdBack();
+  }
+  leave();
+}
+
+volatile uint8_t* HostPortB(void)
+{
+  enter();
+  portBSync();
+  leave();
+  return &portB;
+}
+
+volatile uint8_t* HostPortD(void)
+{
+  enter();
+  portDSync();
+  leave();
+  return &portD;
+}
+
+volatile uint8_t* HostUcsr0a(void)
+{
+  enter();
+  uartSync();
+  leave();
+  return &ucsr0a;
+}
+
+void HostEepromSave(void)
+{
+  FILE* f;
+
+  if (eepromPath && __start_eeprom)
+  {
+    enter();
+    f = fopen(eepromPath, "wb");
+    if (f)
+    {
+      fwrite(__start_eeprom, 1, __stop_eeprom - __start_eeprom, f);
+      fclose(f);
+    }
+    leave();
+  }
+}
+
+void HostLog(const char* format, ...)
+{
+  va_list args;
+
+  enter();
+  fprintf(stderr, "[%10.3f] ", (double)HostCycles * 1000 / F_CPU);
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+  leave();
+}
@@ -0,0 +1,33 @@
+#ifndef __HOST_H_
+#define __HOST_H_
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Simulated time advances in steps of a few CPU cycles, the peripherals are
+// updated and pending interrupts are dispatched after every step
+#define HOST_QUANTUM_CYCLES  32
+
+#define HOST_LED_MAX_LEN  256
+
+extern volatile uint64_t HostCycles;
+
+void HostCli(void);
+void HostSei(void);
+uint8_t HostInterruptsEnabled(void);
+void HostDelay(uint32_t cycles);
+void HostSleep(void);
+
+volatile uint8_t* HostPortB(void);
+volatile uint8_t* HostPortD(void);
+volatile uint8_t* HostUcsr0a(void);
+
+void HostEepromSave(void);
+
+void HostLog(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+void HostDataflashInit(const char* path);
+void HostDataflashSelect(bool select);
+uint8_t HostDataflashTransfer(uint8_t mosi);
+
+#endif // __HOST_H_
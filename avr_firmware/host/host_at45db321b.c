@@ -0,0 +1,316 @@
+#include "host.h"
+#include "dataflash_at45db321b.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// AT45DB321B seen from the SPI bus. Opcodes, page size and the worst case
+// timings come from the driver header, so the model and the driver can only
+// disagree about the protocol, not about numbers. Commands that the chip
+// would ignore while busy are executed anyway and reported.
+
+/****************************************************************************
+ * Private types/enumerations/variables                                     *
+ ****************************************************************************/
+
+#define STATUS_DENSITY  (0x0D << 2)  // 32 Mbit
+
+#define CYCLES_MS(ms)  ((uint64_t)(ms) * (F_CPU / 1000))
+#define CYCLES_US(us)  ((uint64_t)(us) * (F_CPU / 1000000))
+
+static const uint8_t id[4] = {0x1F, 0x27, 0x01, 0x00};
+
+static uint8_t* memory = NULL;
+static uint8_t buffers[2][DB321_PAGE_SIZE];
+static bool selected = false;
+static uint8_t opcode;
+static uint32_t count;  // Bytes clocked since the chip was selected
+static uint32_t address;
+static uint16_t page, offset;
+static uint64_t busyUntil = 0;
+static int8_t busyBuffer = -1;  // Buffer taken by the running operation
+static bool mismatch = false;
+
+/****************************************************************************
+ * Private functions                                                        *
+ ****************************************************************************/
+
+static uint8_t status(void)
+{
+  return ((HostCycles >= busyUntil) ? DB321_STATUS_READY : 0) |
+         (mismatch ? DB321_STATUS_COMPARE : 0) | STATUS_DENSITY;
+}
+
+static uint8_t* pageMemory(void)
+{
+  return &memory[(uint32_t)page * DB321_PAGE_SIZE];
+}
+
+// Number of don't care bytes between the address and the data
+static uint8_t dummyBytes(void)
+{
+  switch (opcode)
+  {
+    case DB321_CONTINUOUS_ARRAY_READ:
+    case DB321_PAGE_READ:
+      return 4;
+    case DB321_BUF1_READ:
+    case DB321_BUF2_READ:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static uint8_t bufferIndex(void)
+{
+  switch (opcode)
+  {
+    case DB321_BUF2_READ:
+    case DB321_BUF2_WRITE:
+    case DB321_BUF2_PAGE_ERASE_PGM:
+    case DB321_BUF2_PAGE_PGM:
+    case DB321_PAGE_PGM_BUF2:
+    case DB321_PAGE_2_BUF2_TRF:
+    case DB321_PAGE_2_BUF2_CMP:
+    case DB321_AUTO_PAGE_PGM_BUF2:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static void busy(uint64_t cycles, int8_t buf)
+{
+  busyUntil = HostCycles + cycles;
+  busyBuffer = buf;
+}
+
+// Buffer not taken by the running operation stays accessible
+static bool allowedWhileBusy(void)
+{
+  switch (opcode)
+  {
+    case DB321_GET_STATUS:
+      return true;
+    case DB321_BUF1_READ:
+    case DB321_BUF2_READ:
+    case DB321_BUF1_WRITE:
+    case DB321_BUF2_WRITE:
+      return (bufferIndex() != busyBuffer);
+    default:
+      return false;
+  }
+}
+
+static void program(bool erase)
+{
+  uint16_t i;
+  uint8_t* dst;
+  uint8_t* src;
+
+  dst = pageMemory();
+  src = buffers[bufferIndex()];
+  for (i = 0; i < DB321_PAGE_SIZE; i++)
+  {
+    // Programming can only clear bits
+    dst[i] = erase ? src[i] : (dst[i] & src[i]);
+  }
+}
+
+// Program and transfer operations start when the chip is deselected
+static void execute(void)
+{
+  uint8_t b;
+
+  if (count < 4)
+  {
+    return;
+  }
+  b = bufferIndex();
+  switch (opcode)
+  {
+    case DB321_BUF1_PAGE_ERASE_PGM:
+    case DB321_BUF2_PAGE_ERASE_PGM:
+    case DB321_PAGE_PGM_BUF1:
+    case DB321_PAGE_PGM_BUF2:
+      program(true);
+      busy(CYCLES_MS(DB321_PAGE_ERASE_PGM_T_MS), b);
+      break;
+    case DB321_BUF1_PAGE_PGM:
+    case DB321_BUF2_PAGE_PGM:
+      program(false);
+      busy(CYCLES_MS(DB321_PAGE_PGM_T_MS), b);
+      break;
+    case DB321_PAGE_ERASE:
+      memset(pageMemory(), 0xFF, DB321_PAGE_SIZE);
+      busy(CYCLES_MS(DB321_PAGE_ERASE_T_MS), -1);
+      break;
+    case DB321_BLOCK_ERASE:
+      page &= ~(DB321_PAGE_PER_BLOCK - 1);
+      memset(pageMemory(), 0xFF, DB321_BLOCK_SIZE);
+      busy(CYCLES_MS(DB321_BLOCK_ERASE_T_MS), -1);
+      break;
+    case DB321_PAGE_2_BUF1_TRF:
+    case DB321_PAGE_2_BUF2_TRF:
+      memcpy(buffers[b], pageMemory(), DB321_PAGE_SIZE);
+      busy(CYCLES_US(DB321_PAGE_2_BUF_TRF_T_US), b);
+      break;
+    case DB321_PAGE_2_BUF1_CMP:
+    case DB321_PAGE_2_BUF2_CMP:
+      mismatch = (memcmp(buffers[b], pageMemory(), DB321_PAGE_SIZE) != 0);
+      busy(CYCLES_US(DB321_PAGE_2_BUF_TRF_T_US), b);
+      break;
+    case DB321_AUTO_PAGE_PGM_BUF1:
+    case DB321_AUTO_PAGE_PGM_BUF2:
+      memcpy(buffers[b], pageMemory(), DB321_PAGE_SIZE);
+      busy(CYCLES_MS(DB321_PAGE_ERASE_PGM_T_MS), b);
+      break;
+    default:
+      break;
+  }
+}
+
+static uint8_t data(uint8_t mosi)
+{
+  uint8_t miso;
+
+  miso = 0xFF;
+  switch (opcode)
+  {
+    case DB321_CONTINUOUS_ARRAY_READ:
+      miso = pageMemory()[offset];
+      if (++offset == DB321_PAGE_SIZE)
+      {
+        offset = 0;
+        page = (page + 1) % DB321_PAGE_NUM;
+      }
+      break;
+    case DB321_PAGE_READ:
+      miso = pageMemory()[offset];
+      offset = (offset + 1) % DB321_PAGE_SIZE;
+      break;
+    case DB321_BUF1_READ:
+    case DB321_BUF2_READ:
+      miso = buffers[bufferIndex()][offset];
+      offset = (offset + 1) % DB321_PAGE_SIZE;
+      break;
+    case DB321_BUF1_WRITE:
+    case DB321_BUF2_WRITE:
+    case DB321_PAGE_PGM_BUF1:
+    case DB321_PAGE_PGM_BUF2:
+      buffers[bufferIndex()][offset] = mosi;
+      offset = (offset + 1) % DB321_PAGE_SIZE;
+      break;
+    default:
+      break;
+  }
+  return miso;
+}
+
+/****************************************************************************
+ * Public functions                                                         *
+ ****************************************************************************/
+
+void HostDataflashInit(const char* path)
+{
+  struct stat st;
+  int fd;
+
+  if (path)
+  {
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if ((fd >= 0) && (fstat(fd, &st) == 0))
+    {
+      if (st.st_size < DB321_SIZE)
+      {
+        if (ftruncate(fd, DB321_SIZE) != 0)
+        {
+          HostLog("dataflash: cannot resize %s, %s", path, strerror(errno));
+        }
+      }
+      memory = mmap(NULL, DB321_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (memory == MAP_FAILED)
+      {
+        memory = NULL;
+      }
+      else if (st.st_size < DB321_SIZE)
+      {
+        // Fresh chip comes erased
+        memset(memory + st.st_size, 0xFF, DB321_SIZE - st.st_size);
+      }
+      close(fd);
+    }
+    if (!memory)
+    {
+      HostLog("dataflash: cannot map %s, %s", path, strerror(errno));
+    }
+  }
+  if (!memory)
+  {
+    memory = malloc(DB321_SIZE);
+    memset(memory, 0xFF, DB321_SIZE);
+  }
+  memset(buffers, 0xFF, sizeof(buffers));
+}
+
+void HostDataflashSelect(bool select)
+{
+  if (select && !selected)
+  {
+    count = 0;
+    address = 0;
+  }
+  if (!select && selected)
+  {
+    execute();
+  }
+  selected = select;
+}
+
+uint8_t HostDataflashTransfer(uint8_t mosi)
+{
+  uint8_t miso;
+  uint32_t n;
+
+  miso = 0xFF;
+  if (selected)
+  {
+    n = count++;
+    if (n == 0)
+    {
+      opcode = mosi;
+      if ((HostCycles < busyUntil) && !allowedWhileBusy())
+      {
+        HostLog("dataflash: command 0x%02X while busy", opcode);
+      }
+    }
+    else if (opcode == DB321_GET_STATUS)
+    {
+      miso = status();
+    }
+    else if (opcode == DB321_GET_ID)
+    {
+      miso = id[(n - 1) % sizeof(id)];
+    }
+    else if (n <= 3)
+    {
+      address = (address << 8) | mosi;
+      if (n == 3)
+      {
+        page = (address >> 10) & (DB321_PAGE_NUM - 1);
+        offset = (address & 0x03FF) % DB321_PAGE_SIZE;
+      }
+    }
+    else if (n >= (4u + dummyBytes()))
+    {
+      miso = data(mosi);
+    }
+  }
+  return miso;
+}
@@ -0,0 +1,381 @@
+#!/usr/bin/env python3
+#
+# Link benchmark for the host build of the firmware.
+#
+# A pseudo terminal pair is put between the uploader and the serial port of
+# the simulator. Bytes crossing it get random bit flips in both directions.
+# Random tracks are loaded page by page the same way the service does it.
+# Time, resent packets and link errors are printed. At the end the module is
+# asked for the crc of every track and a few bytes are read back, and the
+# dataflash image is compared with the tracks. Then one track gets a few bytes
+# changed and another one grows, and all of them are loaded again sending
+# only the pages that differ.
+#
+#   make host
+#   LSMOD_HOST_SERIAL=/tmp/lsmod LSMOD_HOST_DATAFLASH=/tmp/lsmod.df build/host/lsmod
+#   host/linkbench.py /tmp/lsmod --ber 1e-5 --dataflash /tmp/lsmod.df
+#
+# With --proxy only the faulty pair is set up. Point the service at the
+# printed port to see how it copes.
+
+import os, sys, tty, time, select, random, struct, binascii, argparse, threading
+
+LSMOD_ADDR = 0x21
+PC_ADDR    = 0xA1
+
+LSMOD_PACKET_HDR = 0xDA
+LSMOD_PACKET_MSK = 0xB0
+LSMOD_PACKET_END = 0xBA
+
+LSMOD_CRC_INIT = 0xFFFF
+LSMOD_LOAD_WINDOW = 2
+
+LSMOD_CONTROL_PING       = 0x00
+LSMOD_CONTROL_STAT       = 0x01
+LSMOD_CONTROL_BAUD       = 0x04
+LSMOD_CONTROL_CRC        = 0x05
+LSMOD_CONTROL_READ       = 0x06
+LSMOD_CONTROL_PAGE_CRC   = 0x07
+LSMOD_CONTROL_TRACK      = 0x08
+LSMOD_CONTROL_FONT       = 0x09
+LSMOD_CONTROL_VOLUME     = 0x0A
+LSMOD_CONTROL_LOAD_BEGIN = 0x10
+LSMOD_CONTROL_LOAD_END   = 0x12
+LSMOD_CONTROL_LOAD_PAGE  = 0x13
+
+LSMOD_REPLY_ERROR  = 0x00
+LSMOD_REPLY_ACK    = 0x01
+LSMOD_REPLY_LOADED = 0x02
+LSMOD_REPLY_STAT   = 0x03
+LSMOD_REPLY_NAK    = 0x05
+LSMOD_REPLY_CRC    = 0x06
+LSMOD_REPLY_READ   = 0x07
+LSMOD_REPLY_PAGE_CRC = 0x08
+LSMOD_REPLY_TRACK  = 0x09
+
+LSMOD_READ_MAX_LEN = 64
+LSMOD_PAGE_CRC_MAX = 16
+
+DB321_PAGE_SIZE = 528
+DB321_PAGE_ERASE_PGM_T_MS = 20
+
+MAX_TRACKS = 6
+
+class Faults:
+    def __init__(self, ber):
+        # Chance for a byte to get at least one bit flipped
+        self.byteRate = 1 - (1 - ber) ** 8
+        self.bytes = 0
+        self.flipped = 0
+
+    def apply(self, data):
+        data = bytearray(data)
+        for i in range(len(data)):
+            if random.random() < self.byteRate:
+                data[i] ^= 1 << random.randrange(8)
+                self.flipped = self.flipped + 1
+        self.bytes = self.bytes + len(data)
+        return bytes(data)
+
+def openRaw(path):
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+    tty.setraw(fd)
+    return fd
+
+def proxy(port, master, faults, stop):
+    while not stop.is_set():
+        ready, _, _ = select.select([port, master], [], [], 0.1)
+        for fd in ready:
+            data = os.read(fd, 4096)
+            os.write(master if fd == port else port, faults.apply(data))
+
+def packPacket(cmd, data):
+    packet = bytearray([LSMOD_PACKET_HDR, LSMOD_ADDR, PC_ADDR, cmd])
+    crc = binascii.crc_hqx(bytes(packet), LSMOD_CRC_INIT)
+    crc = binascii.crc_hqx(bytes(data), crc)
+    for byte in list(data) + [crc >> 8, crc & 0xFF]:
+        if byte in (LSMOD_PACKET_HDR, LSMOD_PACKET_MSK, LSMOD_PACKET_END):
+            packet.extend([LSMOD_PACKET_MSK, 0xFF - byte])
+        else:
+            packet.append(byte)
+    packet.append(LSMOD_PACKET_END)
+    return bytes(packet)
+
+class Uploader:
+    def __init__(self, fd, baud, nak):
+        self.fd = fd
+        self.baud = baud
+        self.nak = nak
+        self.rxBuffer = bytearray()
+        self.sent = 0
+        self.resentNak = 0
+        self.resentTimeout = 0
+        self.badReplies = 0
+        self.lastPages = 0
+
+    def send(self, cmd, data = []):
+        os.write(self.fd, packPacket(cmd, data))
+
+    # Good replies only, a broken one is counted and dropped
+    def replies(self, timeout):
+        ready, _, _ = select.select([self.fd], [], [], timeout)
+        if ready:
+            self.rxBuffer.extend(os.read(self.fd, 4096))
+        result = []
+        while LSMOD_PACKET_END in self.rxBuffer:
+            end = self.rxBuffer.index(LSMOD_PACKET_END) + 1
+            raw = self.rxBuffer[:end]
+            del self.rxBuffer[:end]
+            if LSMOD_PACKET_HDR not in raw:
+                self.badReplies = self.badReplies + 1
+                continue
+            raw = raw[raw.rindex(LSMOD_PACKET_HDR):]
+            packet = bytearray()
+            escape = False
+            for byte in raw:
+                if escape:
+                    packet.append(0xFF - byte)
+                    escape = False
+                elif byte == LSMOD_PACKET_MSK:
+                    escape = True
+                else:
+                    packet.append(byte)
+            if (len(packet) < 7) or (binascii.crc_hqx(bytes(packet[:-1]), LSMOD_CRC_INIT) != 0) or \
+               (packet[1] != PC_ADDR) or (packet[2] != LSMOD_ADDR):
+                self.badReplies = self.badReplies + 1
+                continue
+            result.append((packet[3], list(packet[4:-3])))
+        return result
+
+    # Command is repeated until its acknowledge comes
+    def command(self, cmd, data, reply, timeout = 0.5, attempts = 20):
+        for _ in range(attempts):
+            self.send(cmd, data)
+            deadline = time.time() + timeout
+            while time.time() < deadline:
+                for (code, payload) in self.replies(deadline - time.time()):
+                    if (code == reply) and (reply != LSMOD_REPLY_ACK or payload[:1] == [cmd]):
+                        return payload
+                    if code == LSMOD_REPLY_ERROR and payload[:1] == [cmd]:
+                        raise RuntimeError('command 0x%02X refused' % cmd)
+        raise RuntimeError('no answer to command 0x%02X' % cmd)
+
+    def switchBaud(self, baud):
+        # Pseudo terminal has no rate, the simulated USART keeps the time
+        self.command(LSMOD_CONTROL_BAUD, list(struct.pack('>I', baud)), LSMOD_REPLY_ACK)
+        time.sleep(0.01)
+        self.command(LSMOD_CONTROL_PING, [], LSMOD_REPLY_ACK, 0.2)
+        self.baud = baud
+
+    def sendPage(self, seq, page, track):
+        self.sent = self.sent + 1
+        data = track[(page * DB321_PAGE_SIZE):((page + 1) * DB321_PAGE_SIZE)]
+        self.send(LSMOD_CONTROL_LOAD_PAGE, [seq] + list(struct.pack('>HH', page, len(data))) + list(data))
+
+    # Pages that differ from the old track are given with its address, they
+    # are sent alone when the track stays there. Kind is left as it is when
+    # not given, the rate goes with a kind only and the loop with a rate.
+    # Returns the address the track is placed at.
+    def load(self, idx, track, old = None, kind = None, rate = None, loop = None):
+        repeatS = (100 + LSMOD_LOAD_WINDOW * (DB321_PAGE_ERASE_PGM_T_MS + (12 + 2 * DB321_PAGE_SIZE) * 10 * 1000 // self.baud)) / 1000
+        begin = [idx, 0] + list(struct.pack('>I', len(track)))
+        if kind is not None:
+            begin = begin + [kind] + ([] if rate is None else list(struct.pack('>H', rate)))
+            if (rate is not None) and (loop is not None):
+                begin = begin + list(struct.pack('>II', *loop))
+        data = self.command(LSMOD_CONTROL_LOAD_BEGIN, begin, LSMOD_REPLY_ACK)
+        addr = struct.unpack('>I', bytes(data[1:5]))[0]
+        if (old is not None) and (old[0] == addr):
+            toSend = list(old[1])
+        else:
+            toSend = list(range((len(track) + DB321_PAGE_SIZE - 1) // DB321_PAGE_SIZE))
+        self.lastPages = len(toSend)
+        seq = 0
+        inFlight = []
+        repeatAt = 0
+        while toSend or inFlight:
+            while (len(inFlight) < LSMOD_LOAD_WINDOW) and toSend:
+                inFlight.append((seq, toSend.pop(0)))
+                self.sendPage(*inFlight[-1], track)
+                seq = (seq + 1) & 0xFF
+                repeatAt = time.time() + repeatS
+            for (code, payload) in self.replies(0.01):
+                acked = [packet[0] for packet in inFlight]
+                if (code == LSMOD_REPLY_LOADED) and (payload[0] in acked):
+                    inFlight = inFlight[(acked.index(payload[0]) + 1):]
+                    repeatAt = time.time() + repeatS
+                elif (code == LSMOD_REPLY_NAK) and self.nak and (payload[0] in acked):
+                    self.resentNak = self.resentNak + 1
+                    self.sendPage(*inFlight[acked.index(payload[0])], track)
+                    repeatAt = time.time() + repeatS
+                elif code == LSMOD_REPLY_ERROR:
+                    raise RuntimeError('load refused')
+            if inFlight and (time.time() > repeatAt):
+                for packet in inFlight:
+                    self.resentTimeout = self.resentTimeout + 1
+                    self.sendPage(*packet, track)
+                repeatAt = time.time() + repeatS
+        self.command(LSMOD_CONTROL_LOAD_END, [idx] + list(struct.pack('>H', binascii.crc_hqx(track, LSMOD_CRC_INIT))), LSMOD_REPLY_ACK, 2)
+        return addr
+
+    # Address, size, format, crc, kind, rate, loop start and loop end of the
+    # track in the module
+    def track(self, idx):
+        data = self.command(LSMOD_CONTROL_TRACK, [idx], LSMOD_REPLY_TRACK)
+        return struct.unpack('>IIBHBHII', bytes(data[1:23]))
+
+    def font(self, font):
+        self.command(LSMOD_CONTROL_FONT, [font], LSMOD_REPLY_ACK)
+
+    def volume(self, volume):
+        self.command(LSMOD_CONTROL_VOLUME, [volume], LSMOD_REPLY_ACK)
+
+    def pageCrcs(self, addr, count):
+        result = []
+        while count > 0:
+            n = min(count, LSMOD_PAGE_CRC_MAX)
+            data = self.command(LSMOD_CONTROL_PAGE_CRC, list(struct.pack('>IB', addr, n)), LSMOD_REPLY_PAGE_CRC, 1)
+            result.extend(struct.unpack('>%dH' % n, bytes(data[5:(5 + 2 * n)])))
+            addr = addr + n * DB321_PAGE_SIZE
+            count = count - n
+        return result
+
+    # Track is loaded only when it differs from the one in the module, then
+    # only the pages that differ. Kind, rate and loop stay. Returns the count of
+    # pages sent, None when the track was the same.
+    def update(self, idx, track):
+        (addr, size, fmt, crc, kind, rate, loopStart, loopEnd) = self.track(idx)
+        # Crc kept in the directory is checked against the flash as well
+        if (size == len(track)) and (fmt == 0) and (crc == binascii.crc_hqx(track, LSMOD_CRC_INIT)) and \
+           (self.crc(addr, size) == crc):
+            return None
+        pages = (len(track) + DB321_PAGE_SIZE - 1) // DB321_PAGE_SIZE
+        full = min(len(track), size) // DB321_PAGE_SIZE
+        old = self.pageCrcs(addr, full) if (size != 0) and (fmt == 0) else []
+        changed = [page for page in range(pages)
+                   if (page >= len(old)) or
+                      (old[page] != binascii.crc_hqx(track[(page * DB321_PAGE_SIZE):((page + 1) * DB321_PAGE_SIZE)], LSMOD_CRC_INIT))]
+        self.load(idx, track, (addr, changed), kind, rate, (loopStart, loopEnd))
+        return self.lastPages
+
+    # Module reads the range through, a second per 50000 bytes is plenty
+    def crc(self, addr, size):
+        data = self.command(LSMOD_CONTROL_CRC, list(struct.pack('>II', addr, size)), LSMOD_REPLY_CRC, 1 + size / 50000)
+        return (data[4] << 8) | data[5]
+
+    def read(self, addr, size):
+        return bytes(self.command(LSMOD_CONTROL_READ, list(struct.pack('>IB', addr, size)), LSMOD_REPLY_READ)[4:])
+
+    def stat(self):
+        data = self.command(LSMOD_CONTROL_STAT, [], LSMOD_REPLY_STAT)
+        if len(data) < 23:
+            return None
+        return ((data[17] << 8) | data[18], (data[19] << 8) | data[20], (data[21] << 8) | data[22])
+
+def verify(path, tracks, addrs):
+    with open(path, 'rb') as f:
+        image = f.read()
+    bad = 0
+    for addr, track in zip(addrs, tracks):
+        bad = bad + sum(1 for i in range(len(track)) if image[addr + i] != track[i])
+    return bad
+
+def verifyModule(uploader, tracks, addrs):
+    start = time.time()
+    good = 0
+    for addr, track in zip(addrs, tracks):
+        if uploader.crc(addr, len(track)) == binascii.crc_hqx(track, LSMOD_CRC_INIT):
+            good = good + 1
+    spent = time.time() - start
+    # Read back across the first page boundary of the first track
+    offset = DB321_PAGE_SIZE - LSMOD_READ_MAX_LEN // 2
+    same = uploader.read(addrs[0] + offset, LSMOD_READ_MAX_LEN) == tracks[0][offset:(offset + LSMOD_READ_MAX_LEN)]
+    return (good, spent, same)
+
+def main():
+    parser = argparse.ArgumentParser(description = 'Upload random tracks over a faulty link to the host build')
+    parser.add_argument('port', help = 'serial pseudo terminal of the simulator')
+    parser.add_argument('--ber', type = float, default = 0.0, help = 'bit error rate on the link, both directions')
+    parser.add_argument('--baud', type = int, default = 115200, help = 'rate asked for before the upload')
+    parser.add_argument('--size', type = int, default = 20000, help = 'bytes per track')
+    parser.add_argument('--seed', type = int, default = 1)
+    parser.add_argument('--dataflash', help = 'dataflash image of the simulator, compared at the end')
+    parser.add_argument('--no-nak', action = 'store_true', help = 'wait for the timeout instead of answering NAKs')
+    parser.add_argument('--proxy', action = 'store_true', help = 'only run the faulty link')
+    args = parser.parse_args()
+    random.seed(args.seed)
+    port = openRaw(args.port)
+    master, slave = os.openpty()
+    tty.setraw(slave)
+    faults = Faults(args.ber)
+    stop = threading.Event()
+    link = threading.Thread(target = proxy, args = (port, master, faults, stop), daemon = True)
+    link.start()
+    if args.proxy:
+        print('faulty link at %s, bit error rate %g' % (os.ttyname(slave), args.ber))
+        try:
+            link.join()
+        except KeyboardInterrupt:
+            pass
+        return
+    uploader = Uploader(slave, 115200, not args.no_nak)
+    if args.baud != 115200:
+        uploader.switchBaud(args.baud)
+    base = uploader.stat()
+    tracks = [bytes(random.randrange(256) for _ in range(args.size)) for _ in range(MAX_TRACKS)]
+    # Every track is a sound of its own in font 1, every other one at half rate
+    kinds = [0x10 | idx for idx in range(MAX_TRACKS)]
+    rates = [44100 // (1 + idx % 2) for idx in range(MAX_TRACKS)]
+    loops = [(0, 0)] * MAX_TRACKS
+    loops[4] = (1000, args.size - 7)
+    start = time.time()
+    addrs = []
+    for idx, track in enumerate(tracks):
+        begin = time.time()
+        addrs.append(uploader.load(idx, track, kind = kinds[idx], rate = rates[idx], loop = loops[idx]))
+        print('track %d: %.2f s' % (idx, time.time() - begin))
+    total = time.time() - start
+    errors = uploader.stat()
+    (good, spent, same) = verifyModule(uploader, tracks, addrs)
+    # Few bytes change in one track, another one grows past its neighbour
+    changed = bytearray(tracks[2])
+    for pos in (len(changed) // 3, len(changed) // 3 + 1, len(changed) // 2):
+        changed[pos] ^= 0x5A
+    tracks[2] = bytes(changed)
+    tracks[4] = tracks[4] + bytes(random.randrange(256) for _ in range(DB321_PAGE_SIZE * 2))
+    sentBefore = uploader.sent
+    start = time.time()
+    updated = []
+    for idx, track in enumerate(tracks):
+        pages = uploader.update(idx, track)
+        if pages is not None:
+            updated.append('%d (%d pages)' % (idx, pages))
+    again = time.time() - start
+    entries = [uploader.track(idx) for idx in range(MAX_TRACKS)]
+    addrs = [entry[0] for entry in entries]
+    (goodAgain, _, sameAgain) = verifyModule(uploader, tracks, addrs)
+    uploader.font(1)
+    kindsKept = ([entry[4] for entry in entries] == kinds) and ([entry[5] for entry in entries] == rates) and \
+                ([entry[6:8] for entry in entries] == loops)
+    stop.set()
+    print('baud %d, bit error rate %g' % (uploader.baud, args.ber))
+    print('throughput %.0f bytes/s, %.2f s per track' % (MAX_TRACKS * args.size / total, total / MAX_TRACKS))
+    print('bytes on the link %d, corrupted %d' % (faults.bytes, faults.flipped))
+    print('pages sent %d, again on NAK %d, again on timeout %d, broken replies %d' %
+          (uploader.sent, uploader.resentNak, uploader.resentTimeout, uploader.badReplies))
+    if base and errors:
+        print('module: %d packets dropped, %d crc, %d framing' % tuple(e - b for (e, b) in zip(errors, base)))
+    print('module crc: %d of %d tracks match, %.2f s, read back %s' % (good, MAX_TRACKS, spent, 'matches' if same else 'differs'))
+    print('update: tracks %s loaded again, %d pages sent, %.2f s, %d of %d tracks match' %
+          (', '.join(updated) or 'none', uploader.sent - sentBefore, again, goodAgain, MAX_TRACKS))
+    print('kinds, rates and loops: %s' % ('kept' if kindsKept else 'lost'))
+    ok = (good == MAX_TRACKS) and same and (goodAgain == MAX_TRACKS) and sameAgain and kindsKept
+    if args.dataflash:
+        # Image is shared with the simulator, the last program is over by now
+        bad = verify(args.dataflash, tracks, addrs)
+        print('dataflash: %s' % ('matches' if bad == 0 else '%d bytes differ' % bad))
+        ok = ok and (bad == 0)
+    sys.exit(0 if ok else 1)
+
+if __name__ == '__main__':
+    main()
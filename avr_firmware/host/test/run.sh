@@ -0,0 +1,38 @@
+#!/bin/sh
+# run.sh <simulator> <test dir> <output dir> [update]
+#
+# Runs every <name>.script of the test dir in simulated time on a fresh
+# flash and EEPROM. The log has to match <name>.log and the OC1A audio has
+# to match <name>.raw.gz byte for byte. With "update" the results are taken
+# as the expected ones instead.
+
+BIN=$1
+DIR=$2
+OUT=$3
+UPDATE=$4
+
+mkdir -p "$OUT" || exit 1
+failed=0
+count=0
+for script in "$DIR"/*.script; do
+  name=$(basename "$script" .script)
+  count=$((count + 1))
+  env -u LSMOD_HOST_DATAFLASH -u LSMOD_HOST_EEPROM -u LSMOD_HOST_SERIAL \
+    LSMOD_HOST_SCRIPT="$script" LSMOD_HOST_AUDIO="$OUT/$name.raw" \
+    "$BIN" < /dev/null > /dev/null 2> "$OUT/$name.log"
+  if [ "$UPDATE" = "update" ]; then
+    cp "$OUT/$name.log" "$DIR/$name.log"
+    gzip -n -9 -c "$OUT/$name.raw" > "$DIR/$name.raw.gz"
+    echo "$name: updated"
+  elif ! diff -u "$DIR/$name.log" "$OUT/$name.log"; then
+    echo "$name: log differs"
+    failed=$((failed + 1))
+  elif ! gzip -d -c "$DIR/$name.raw.gz" | cmp -s - "$OUT/$name.raw"; then
+    echo "$name: audio differs"
+    failed=$((failed + 1))
+  else
+    echo "$name: ok"
+  fi
+done
+echo "$((count - failed)) of $count passed"
+[ "$failed" -eq 0 ]
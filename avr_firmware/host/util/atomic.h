@@ -0,0 +1,32 @@
+#ifndef __HOST_UTIL_ATOMIC_H_
+#define __HOST_UTIL_ATOMIC_H_
+
+#include "host.h"
+
+#include <inttypes.h>
+
+static inline uint8_t __iCliRetVal(void)
+{
+  HostCli();
+  return 1;
+}
+
+static inline void __iRestore(const uint8_t* state)
+{
+  if (*state)
+  {
+    HostSei();
+  }
+}
+
+static inline void __iSeiParam(const uint8_t* state)
+{
+  (void)state;
+  HostSei();
+}
+
+#define ATOMIC_BLOCK(type)   for (type, __ToDo = __iCliRetVal(); __ToDo; __ToDo = 0)
+#define ATOMIC_RESTORESTATE  uint8_t sreg_save __attribute__((__cleanup__(__iRestore))) = HostInterruptsEnabled()
+#define ATOMIC_FORCEON       uint8_t sreg_save __attribute__((__cleanup__(__iSeiParam))) = 0
+
+#endif // __HOST_UTIL_ATOMIC_H_
@@ -0,0 +1,32 @@
+#ifndef __HOST_UTIL_DELAY_H_
+#define __HOST_UTIL_DELAY_H_
+
+// Delays are counted in CPU cycles of the simulated clock
+
+#include "host.h"
+
+#include <inttypes.h>
+
+#define __HAS_DELAY_CYCLES  0
+
+static inline void _delay_loop_1(uint8_t count)
+{
+  HostDelay(3 * (count ? count : 256));
+}
+
+static inline void _delay_loop_2(uint16_t count)
+{
+  HostDelay(4 * (count ? count : 65536));
+}
+
+static inline void _delay_us(double us)
+{
+  HostDelay((uint32_t)(us * (F_CPU / 1e6)));
+}
+
+static inline void _delay_ms(double ms)
+{
+  HostDelay((uint32_t)(ms * (F_CPU / 1e3)));
+}
+
+#endif // __HOST_UTIL_DELAY_H_
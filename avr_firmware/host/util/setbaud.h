@@ -0,0 +1,13 @@
+#ifndef __HOST_UTIL_SETBAUD_H_
+#define __HOST_UTIL_SETBAUD_H_
+
+#ifndef BAUD
+  #error "BAUD must be defined before util/setbaud.h"
+#endif
+
+#define UBRR_VALUE   (((F_CPU) + 8UL * (BAUD)) / (16UL * (BAUD)) - 1UL)
+#define UBRRL_VALUE  (UBRR_VALUE & 0xFF)
+#define UBRRH_VALUE  (UBRR_VALUE >> 8)
+#define USE_2X       0
+
+#endif // __HOST_UTIL_SETBAUD_H_
@@ -60,42 +60,41 @@ static inline void _delay_ns(double __ns)
 #endif
 }
 
+// Bit value is in the high time, so only the pulse itself keeps interrupts
+// off. A handler in the low time just makes the bit longer, the strip does not
+// latch before the line is low for 50 us.
 static void bit0(void)
 {
+  cli();
   PORTD |= (1 << PD6);
   _delay_ns(400);
   PORTD &= ~(1 << PD6);
+  sei();
   _delay_ns(1600);
 }
 static void bit1(void)
 {
+  cli();
   PORTD |= (1 << PD6);
   _delay_ns(1200);
   PORTD &= ~(1 << PD6);
+  sei();
   _delay_ns(800);
 }
 
-static void setColor(uint32_t color)
+static void sendByte(uint8_t data)
 {
-  int8_t i, j;
-  uint8_t grb[3];
-  
-  grb[0] = (uint8_t)(color >> 8);
-  grb[1] = (uint8_t)(color >> 16);
-  grb[2] = (uint8_t)color;
-  
-  for (i = 0; i < 3; i++)
+  int8_t j;
+
+  for (j = 7; j >= 0; j--)
   {
-    for (j = 7; j >= 0; j--)
+    if (data & (1 << j))
+    {
+      bit1();
+    }
+    else
     {
-      if (grb[i] & (1 << j))
-      {
-        bit1();
-      }
-      else
-      {
-        bit0();
-      }
+      bit0();
     }
   }
 }
@@ -118,71 +117,30 @@ void LedrgbInit(void)
 
 void LedrgbLoadColor(void)
 {
-  cli();
   LedrgbColor = eeprom_read_dword(&colorMem);
-  sei();
 }
 
+// Four bytes take up to 13.6 ms, the interrupts are left on so the sound does
+// not stop. Bytes that hold the color already are not written.
 void LedrgbSaveColor(void)
 {
-  cli();
-  eeprom_write_dword(&colorMem, LedrgbColor);
-  sei();
+  eeprom_update_dword(&colorMem, LedrgbColor);
 }
 
-void LedrgbOn(uint32_t color)
+// There is no frame in RAM, each pixel is asked for in the low time after the
+// one before it. The handler must take well below the 50 us latch time.
+void LedrgbShow(LedrgbHandler hnd)
 {
   uint8_t i;
-  
-  cli();
-  for (i = 0; i < LEDRGB_TOTAL_LEN; ++i)
-  {
-    setColor(color);
-  }
-  sei();
-  bitStop();
-}
+  uint32_t color;
 
-void LedrgbOff(void)
-{
-  uint8_t i;
-  
-  cli();
-  for (i = 0; i < LEDRGB_TOTAL_LEN; ++i)
+  for (i = 0; i < LEDRGB_TOTAL_LEN; i++)
   {
-    setColor(0);
+    color = hnd(i);
+    // Strip takes green first
+    sendByte((uint8_t)(color >> 8));
+    sendByte((uint8_t)(color >> 16));
+    sendByte((uint8_t)color);
   }
-  sei();
   bitStop();
 }
-
-void LedrgbSet(uint32_t color, uint8_t len)
-{
-  uint8_t i;
-  
-  if (len > LEDRGB_TOTAL_LEN)
-  {
-    len = LEDRGB_TOTAL_LEN;
-  }
-  if (len > 0)
-  {
-    cli();
-    for (i = 1; i <= len; ++i)
-    {
-      setColor(color);
-    }
-    if (len < LEDRGB_TOTAL_LEN)
-    {
-      for (i = len + 1; i <= LEDRGB_TOTAL_LEN; ++i)
-      {
-        setColor(0);
-      }
-    }
-    sei();
-    bitStop();
-  }
-  else
-  {
-    LedrgbOff();
-  }
-}
@@ -4,15 +4,15 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
-#define LEDRGB_TOTAL_LEN  58
+#define LEDRGB_TOTAL_LEN   58
+
+typedef uint32_t (*LedrgbHandler)(uint8_t idx);  // Color of a pixel, 0xRRGGBB
 
 extern uint32_t LedrgbColor;
 
 void LedrgbInit(void);
 void LedrgbLoadColor(void);
 void LedrgbSaveColor(void);
-void LedrgbOn(uint32_t color);
-void LedrgbOff(void);
-void LedrgbSet(uint32_t color, uint8_t len);
+void LedrgbShow(LedrgbHandler hnd);
 
 #endif // __LEDRGB_H_
@@ -5,20 +5,27 @@
 #define ADXL330_USED
 
 //#define CLASH_DISABLE
-#define SENSOR_DELAY_TICKS  10000
+#define SENSOR_DELAY_MS  100
 
-#define VOLTAGE_DELAY_TICKS  100000
+#define BUTTON_PERIOD_MS  10
+#define BUTTON_FONT_MS    1500  // Held that long through the retraction, the next font is taken
+
+#define VOLTAGE_DELAY_MS  1000
 #define VOLTAGE_CHAN      3
 #define VOLTAGE_ACCUMUL   100
 #define VOLTAGE_MUL       125
 #define VOLTAGE_MAX       90
 #define VOLTAGE_HIGH      86
 #define REDUCE_HIGH       2
+#define SOUND_HIGH        255  // Volume limit out of 255
 #define VOLTAGE_AVERAGE   76
 #define REDUCE_AVERAGE    4
+#define SOUND_AVERAGE     192
 #define VOLTAGE_LOW       70
 #define REDUCE_LOW        16    
+#define SOUND_LOW         128
 #define VOLTAGE_CRITICAL  68
+#define SOUND_CRITICAL    64
 
 #ifndef F_CPU
   #define F_CPU  20000000
@@ -33,5 +40,11 @@
 #define TRACK_HIT      3
 #define TRACK_CLASH    4
 #define TRACK_TURNOFF  5
+#define TRACK_SOUNDS   6
+
+#define VOICE_HUM     0
+#define VOICE_EFFECT  1
+
+#define GAIN_HUM_DUCKED  128
 
 #endif // __LSMOD_CONFIG_H__
@@ -1,28 +1,118 @@
 #ifndef __LSMOD_PROTOCOL_H__
 #define __LSMOD_PROTOCOL_H__
 
-#define LSMOD_BAUDRATE  115200
+#define LSMOD_BAUDRATE       115200
+#define LSMOD_BAUD_TIMEOUT_MS   500  // Switched rate is dropped unless a packet comes at it in time
 
 #define LSMOD_PACKET_HDR  0xDA
 #define LSMOD_PACKET_MSK  0xB0
 #define LSMOD_PACKET_END  0xBA
 
-#define LSMOD_SRV_LEN         6
+#define LSMOD_SRV_LEN         7
+#define LSMOD_CRC_LEN         2
+#define LSMOD_DATA_SEQ_LEN    1
 #define LSMOD_DATA_IDX_LEN    4
-#define LSMOD_DATA_MAX_LEN  262
-#define LSMOD_STAT_MAX_LEN    6
+#define LSMOD_DATA_MAX_LEN  134  // Escaped, the load packets are sized by it
+#define LSMOD_STAT_MAX_LEN   25
+#define LSMOD_TELEMETRY_LEN  11
+
+// Samples are counted as if each one needed escaping, the packet keeps the
+// data un-escaped
+#define LSMOD_LOAD_SAMPLES  ((LSMOD_DATA_MAX_LEN - LSMOD_DATA_SEQ_LEN - LSMOD_DATA_IDX_LEN) / 2)
+#define LSMOD_DATA_RAW_LEN  (LSMOD_DATA_SEQ_LEN + LSMOD_DATA_IDX_LEN + LSMOD_LOAD_SAMPLES)
+
+// Load packets sent ahead of the acknowledge, the packet queue holds one
+// more packet while the previous one is being programmed
+#define LSMOD_LOAD_WINDOW  2
+
+// Load begins with the track, the format and the size as a double word. The
+// format is PCM8 or ADPCM as in player.h, any other one is refused. It is
+// optionally followed by the kind: font in the high nibble and sound in the
+// low one, 0xFF for none. Without it the track keeps its kind. The sample
+// rate may follow the kind as a word, 44100 when it is not given, and then
+// the loop start and end in samples as double words. Playback goes back to
+// the loop start at the loop end without a gap, no loop when the end is
+// zero. Tracks go in any order, each one keeps its place in the flash when
+// the new size fits there. Acknowledge brings the flash address the track
+// starts at, pages in the flash already may be skipped when it is the old
+// one.
+#define LSMOD_BEGIN_LEN       6
+#define LSMOD_BEGIN_KIND_LEN  7
+#define LSMOD_BEGIN_RATE_LEN  9
+#define LSMOD_BEGIN_LOOP_LEN  17
+
+// Page load carries the sequence, the page within the track and the payload
+// size as words, then up to a whole flash page of data. The payload is
+// written to the flash as it comes and never held in the packet. Pages may
+// be sent sparse, only the last one of the track is short.
+#define LSMOD_PAGE_HDR_LEN       5
+#define LSMOD_PAGE_PAGE_INDEX    1
+#define LSMOD_PAGE_SIZE_INDEX    3
 
 #define LSMOD_CONTROL_PING        0x00
 #define LSMOD_CONTROL_STAT        0x01
 #define LSMOD_CONTROL_COLOR       0x02
+#define LSMOD_CONTROL_TELEMETRY   0x03
+#define LSMOD_CONTROL_BAUD        0x04
+#define LSMOD_CONTROL_CRC         0x05
+#define LSMOD_CONTROL_READ        0x06
+#define LSMOD_CONTROL_PAGE_CRC    0x07
+#define LSMOD_CONTROL_TRACK       0x08
+#define LSMOD_CONTROL_FONT        0x09
+#define LSMOD_CONTROL_VOLUME      0x0A
 #define LSMOD_CONTROL_LOAD_BEGIN  0x10
 #define LSMOD_CONTROL_LOAD        0x11
 #define LSMOD_CONTROL_LOAD_END    0x12
+#define LSMOD_CONTROL_LOAD_PAGE   0x13
 
 #define LSMOD_REPLY_ERROR   0x00
 #define LSMOD_REPLY_ACK     0x01
 #define LSMOD_REPLY_LOADED  0x02
 #define LSMOD_REPLY_STAT    0x03
+#define LSMOD_REPLY_TELEMETRY  0x04
+#define LSMOD_REPLY_NAK     0x05
+#define LSMOD_REPLY_CRC     0x06
+#define LSMOD_REPLY_READ    0x07
+#define LSMOD_REPLY_PAGE_CRC  0x08
+#define LSMOD_REPLY_TRACK   0x09
+
+// CRC-16 with polynomial 0x1021 (CCITT) over everything from the header to
+// the last data byte, un-escaped. It goes high byte first and is escaped
+// like the data. Run over the crc bytes as well, a good packet gives zero.
+#define LSMOD_CRC_INIT  0xFFFF
+
+// Page loads behind a lost or broken one are kept, the module asks for the
+// missing one alone with the sequence number in a NAK. A NAK comes unasked
+// as well when a broken packet is seen during a load.
+
+// Flash range is checked with CRC asking for the address and the size as
+// double words. Reply brings back the address and the crc over the range,
+// worked out the same way as the packet crc. READ asks for the address and
+// up to LSMOD_READ_MAX_LEN bytes, the reply brings back the address and the
+// bytes. Both are refused while the blade is lit or a track is loading.
+#define LSMOD_READ_MAX_LEN  64
+
+// PAGE_CRC asks for the address and a count of flash pages, the reply brings
+// back both and a crc per page. TRACK asks for a track, the reply brings back
+// the track, its address and size as double words, its format, the crc
+// given with LOAD_END, its kind, its sample rate as a word and the loop start
+// and end as double words. LOAD_END carries the track and the crc of its
+// data. FONT takes the font to play from, it is kept over power off.
+// VOLUME takes the master volume, 255 drives the whole PWM range. It is kept
+// over power off too, a low battery holds the sound lower still.
+#define LSMOD_PAGE_CRC_MAX  16
+#define LSMOD_TRACK_LEN     23
+
+// Telemetry frames are pushed with the period asked for in ms, zero stops
+// them. Frame holds the time stamp in 1.024 ms ticks, X/Y/Z as signed words,
+// voltage, one bit per playing voice and the event bits below.
+#define LSMOD_TELEMETRY_MIN_MS  10
+
+#define LSMOD_EVENT_ACTIVATED  (1 << 0)
+#define LSMOD_EVENT_HIT        (1 << 1)
+#define LSMOD_EVENT_SWING      (1 << 2)
+#define LSMOD_EVENT_CLASH      (1 << 3)
+#define LSMOD_EVENT_SENSOR     (1 << 4)
 
 typedef struct {
   unsigned char header;
@@ -30,8 +120,8 @@ typedef struct {
   unsigned char from;
   unsigned char cmd;
   unsigned char len;  // This byte is not transmitted
-  unsigned char data[LSMOD_DATA_MAX_LEN];
-  unsigned char crc;
+  unsigned char data[LSMOD_DATA_RAW_LEN + LSMOD_CRC_LEN];  // Crc lands behind the data on the way in
+  unsigned short crc;
   unsigned char end;
 } LsmodPacket;
 
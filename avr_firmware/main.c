@@ -18,23 +18,54 @@
 #endif
 #include "player.h"
 #include "ledrgb.h"
+#include "effects.h"
+#include "scheduler.h"
 
 #include "debug.h"
 
 bool activated = false;
 bool updateColor = false;
 bool hit = false;
-uint32_t sensorTimeCount = 0;
+bool sensorActive = false;
+uint16_t sensorSince;
 bool sensorTimeReach = false;
 bool clash = false;
 bool swing = false;
+uint8_t effectStarts[TRACK_CLASH - TRACK_SWING + 1];  // Swing, hit and clash starts while lit
 bool loadTrackActive = false;
 uint8_t loadTrackIdx = 0;
 uint32_t loadTrackPos = 0;
+uint32_t loadTrackNext = 0;
 uint8_t loadTrackLen = 0;
-uint32_t deltaTrackPos = 0;
-uint32_t nexTrackPos = 0;
-int8_t lsmodLen = 0;
+uint8_t loadTrackSeq = 0;
+bool loadTrackWait = false;  // Reply goes once the flash has taken the data
+uint8_t loadTrackCmd;
+uint32_t loadTrackSize;
+uint16_t loadTrackCrc;
+uint16_t loadTrackPage = 0;  // First flash page of the track
+uint16_t loadTrackPages = 0;  // Read by the receive interrupt
+uint16_t loadPage;
+bool loadAhead = false;  // Page behind a missing one came and is written
+uint16_t loadAheadPage;
+uint8_t loadTrackTo;
+uint8_t loadTrackLast = PLAYER_MAX_TRACKS;  // Finished last, for a repeated LOAD_END
+uint16_t loadCrcErrors;
+bool flashCrcWait = false;  // Reply goes once the range is read through
+uint8_t flashCrcPages = 0;  // Left to do for a PAGE_CRC, zero for a plain CRC
+uint8_t flashCrcCount;
+uint32_t flashCrcAddr;
+uint8_t* flashCrcDst;  // Crcs are collected in the packet
+uint8_t* flashCrcChunks;  // Flash is read into the packet behind the crcs
+
+#define FLASH_CRC_CHUNKS_INDEX  (LSMOD_DATA_IDX_LEN + 1 + 2 * LSMOD_PAGE_CRC_MAX)
+#if (FLASH_CRC_CHUNKS_INDEX + 2 * DB321_CRC_CHUNK) > (LSMOD_DATA_RAW_LEN + LSMOD_CRC_LEN)
+  #error "Packet has no room for the crc reads"
+#endif
+bool buttonHeld = false;
+bool buttonFont = false;  // Held since the retraction began
+uint16_t buttonSince;
+bool igniting = false;
+bool retracting = false;
 uint32_t trueColor = 0;
 uint16_t* rawVoltage = NULL;
 uint8_t vcount = 0;
@@ -42,7 +73,9 @@ uint32_t voltageAccum = 0;
 bool voltageMeasured = false;
 uint8_t voltage = 0;
 uint8_t voltageLevel = VOLTAGE_MAX;
-uint32_t voltageTimeCount = 0;
+uint16_t telemetryPeriod = 0;  // Ticks, zero when the host does not listen
+uint16_t telemetryLast;
+uint8_t telemetryTo;
 
 void initBoard(void)
 {
@@ -91,9 +124,61 @@ void led2Toggle(void)
   led2(PORTD & (1 << PD7));
 }
 
+// Page of the track with the size it has to come with
+bool loadPageValid(uint16_t page, uint16_t size)
+{
+  if (page >= loadTrackPages)
+  {
+    return false;
+  }
+  if (page == (loadTrackPages - 1))
+  {
+    return size == (loadTrackSize - (uint32_t)page * DB321_PAGE_SIZE);
+  }
+  return size == DB321_PAGE_SIZE;
+}
+
+// Write job left by a load that did not finish is run to the end, the flash
+// bus is free afterwards
+void loadClose(void)
+{
+  if (loadTrackActive)
+  {
+    loadTrackActive = false;
+    while (!DataflashWriteCompleted())
+    {
+      DataflashPoll();
+    }
+    DataflashWriteEnd();
+  }
+  while (!DataflashWriteCompleted())
+  {
+    DataflashPoll();
+  }
+}
+
+// Page program time in 0.1 ms
+uint16_t programTime(uint16_t ticks)
+{
+  return (uint32_t)ticks * DB321_TIMER_PRESCALE / (F_CPU / 10000);
+}
+
+// Sound start time in us
+uint16_t latencyTime(uint8_t ticks)
+{
+  return (uint32_t)ticks * DB321_TIMER_PRESCALE * 1000 / (F_CPU / 1000);
+}
+
 void commandHandler(void* args)
 {
   LsmodPacket* packet = (LsmodPacket*)args;
+  uint16_t period;
+  uint32_t baud;
+  uint16_t page, size, rate;
+  uint32_t addr, len;
+  PlayerTrack track;
+  uint8_t kind;
+
   if (packet->to == LSMOD_ADDR)
   {
     switch (packet->cmd) {
@@ -108,10 +193,22 @@ void commandHandler(void* args)
                          abs(Adxl330_AccelReal.y),
                          (abs(Adxl330_AccelReal.z) >> 8) | ((Adxl330_AccelReal.z < 0) ? (1 << 7) : 0),
                          abs(Adxl330_AccelReal.z),
-                         voltage);
+                         voltage,
+                         (uint8_t)(PlayerUnderruns >> 8),
+                         (uint8_t)PlayerUnderruns,
+                         (uint8_t)(programTime(DataflashProgramTime) >> 8),
+                         (uint8_t)programTime(DataflashProgramTime),
+                         (uint8_t)(programTime(DataflashProgramTimeMax) >> 8),
+                         (uint8_t)programTime(DataflashProgramTimeMax),
+                         latencyTime(PlayerLatency),
+                         latencyTime(PlayerLatencyMax),
+                         PlayerCyclesMax);
       #endif
       #if (!defined(ADXL330_USED) && !defined(MMA7455L_USED))
-        ComportReplyStat(0, 0, 0, 0, 0, 0);
+        ComportReplyStat(0, 0, 0, 0, 0, 0, voltage, (uint8_t)(PlayerUnderruns >> 8), (uint8_t)PlayerUnderruns,
+                         (uint8_t)(programTime(DataflashProgramTime) >> 8), (uint8_t)programTime(DataflashProgramTime),
+                         (uint8_t)(programTime(DataflashProgramTimeMax) >> 8), (uint8_t)programTime(DataflashProgramTimeMax),
+                         latencyTime(PlayerLatency), latencyTime(PlayerLatencyMax), PlayerCyclesMax);
       #endif
         break;
       case LSMOD_CONTROL_COLOR:
@@ -120,25 +217,191 @@ void commandHandler(void* args)
         LedrgbColor += packet->data[1];
         LedrgbColor = LedrgbColor << 8;
         LedrgbColor += packet->data[2];
+        // Battery level is looked at again for the new color, the sound
+        // limit with it
+        trueColor = LedrgbColor;
+        voltageLevel = VOLTAGE_MAX;
+        PlayerSetLimit(PLAYER_GAIN_MAX);
         updateColor = true;
         LedrgbSaveColor();
         ComportReplyAck(LSMOD_CONTROL_COLOR);
         break;
+      case LSMOD_CONTROL_TELEMETRY:
+        period = ((uint16_t)packet->data[0] << 8) | packet->data[1];
+        if ((packet->len < 2) || ((period != 0) && (period < LSMOD_TELEMETRY_MIN_MS)))
+        {
+          ComportReplyError(LSMOD_CONTROL_TELEMETRY);
+          break;
+        }
+        telemetryPeriod = SCHEDULER_MS(period);
+        telemetryLast = SchedulerTicks() - telemetryPeriod;
+        telemetryTo = packet->from;
+        ComportReplyAck(LSMOD_CONTROL_TELEMETRY);
+        break;
+      case LSMOD_CONTROL_BAUD:
+        baud = packet->data[0];
+        baud = baud << 8;
+        baud += packet->data[1];
+        baud = baud << 8;
+        baud += packet->data[2];
+        baud = baud << 8;
+        baud += packet->data[3];
+        if ((packet->len == 4) && ComportBaud(baud))
+        {
+          ComportReplyAck(LSMOD_CONTROL_BAUD);
+        }
+        else
+        {
+          ComportReplyError(LSMOD_CONTROL_BAUD);
+        }
+        break;
+      case LSMOD_CONTROL_CRC:
+        addr = ((uint32_t)packet->data[0] << 24) | ((uint32_t)packet->data[1] << 16) |
+               ((uint32_t)packet->data[2] << 8) | packet->data[3];
+        len = ((uint32_t)packet->data[4] << 24) | ((uint32_t)packet->data[5] << 16) |
+              ((uint32_t)packet->data[6] << 8) | packet->data[7];
+        if ((packet->len == (2 * LSMOD_DATA_IDX_LEN)) && !activated && !EffectsBusy() && !loadTrackActive &&
+            DataflashCrcBegin(addr, len, LSMOD_CRC_INIT, &packet->data[FLASH_CRC_CHUNKS_INDEX]))
+        {
+          flashCrcWait = true;
+        }
+        else
+        {
+          ComportReplyError(LSMOD_CONTROL_CRC);
+        }
+        break;
+      case LSMOD_CONTROL_READ:
+        addr = ((uint32_t)packet->data[0] << 24) | ((uint32_t)packet->data[1] << 16) |
+               ((uint32_t)packet->data[2] << 8) | packet->data[3];
+        len = packet->data[LSMOD_DATA_IDX_LEN];
+        // Bytes take the place of the size in the packet
+        if ((packet->len == (LSMOD_DATA_IDX_LEN + 1)) && (len <= LSMOD_READ_MAX_LEN) && (addr <= (DB321_SIZE - len)) &&
+            !activated && !EffectsBusy() && !loadTrackActive &&
+            DataflashRead(addr, &packet->data[LSMOD_DATA_IDX_LEN], (uint8_t)len))
+        {
+          ComportReplyRead((uint8_t)len);
+        }
+        else
+        {
+          ComportReplyError(LSMOD_CONTROL_READ);
+        }
+        break;
+      case LSMOD_CONTROL_PAGE_CRC:
+        addr = ((uint32_t)packet->data[0] << 24) | ((uint32_t)packet->data[1] << 16) |
+               ((uint32_t)packet->data[2] << 8) | packet->data[3];
+        len = packet->data[LSMOD_DATA_IDX_LEN];
+        // One crc job per page, the next one starts once the previous is done
+        if ((packet->len == (LSMOD_DATA_IDX_LEN + 1)) && (len != 0) && (len <= LSMOD_PAGE_CRC_MAX) &&
+            (addr <= DB321_SIZE) && ((len * DB321_PAGE_SIZE) <= (DB321_SIZE - addr)) &&
+            !activated && !EffectsBusy() && !loadTrackActive &&
+            DataflashCrcBegin(addr, DB321_PAGE_SIZE, LSMOD_CRC_INIT, &packet->data[FLASH_CRC_CHUNKS_INDEX]))
+        {
+          flashCrcWait = true;
+          flashCrcPages = (uint8_t)len;
+          flashCrcCount = (uint8_t)len;
+          flashCrcAddr = addr;
+          flashCrcDst = &packet->data[LSMOD_DATA_IDX_LEN + 1];
+          flashCrcChunks = &packet->data[FLASH_CRC_CHUNKS_INDEX];
+        }
+        else
+        {
+          ComportReplyError(LSMOD_CONTROL_PAGE_CRC);
+        }
+        break;
+      case LSMOD_CONTROL_TRACK:
+        if ((packet->len == 1) && (packet->data[0] < PLAYER_MAX_TRACKS) &&
+            PlayerReadTrack(packet->data[0], &track) && PlayerReadKind(packet->data[0], &kind))
+        {
+          ComportReplyTrack((uint32_t)track.page * DB321_PAGE_SIZE, track.len, track.format, track.crc, kind, track.rate,
+                            track.loopStart, track.loopEnd);
+        }
+        else
+        {
+          ComportReplyError(LSMOD_CONTROL_TRACK);
+        }
+        break;
+      case LSMOD_CONTROL_FONT:
+        if ((packet->len == 1) && (packet->data[0] < PLAYER_MAX_FONTS))
+        {
+          PlayerSetFont(packet->data[0]);
+          ComportReplyAck(LSMOD_CONTROL_FONT);
+        }
+        else
+        {
+          ComportReplyError(LSMOD_CONTROL_FONT);
+        }
+        break;
+      case LSMOD_CONTROL_VOLUME:
+        if (packet->len == 1)
+        {
+          PlayerSetVolume(packet->data[0]);
+          ComportReplyAck(LSMOD_CONTROL_VOLUME);
+        }
+        else
+        {
+          ComportReplyError(LSMOD_CONTROL_VOLUME);
+        }
+        break;
       case LSMOD_CONTROL_LOAD_BEGIN:
-        if (packet->data[0] == loadTrackIdx)
+        // Flash bus belongs to the player while the blade is lit
+        len = ((uint32_t)packet->data[2] << 24) | ((uint32_t)packet->data[3] << 16) |
+              ((uint32_t)packet->data[4] << 8) | packet->data[5];
+        kind = packet->data[LSMOD_BEGIN_LEN];
+        rate = (packet->len >= LSMOD_BEGIN_RATE_LEN) ? (((uint16_t)packet->data[7] << 8) | packet->data[8]) : PLAYER_FREQ_HZ;
+        if (((packet->len == LSMOD_BEGIN_LEN) || (packet->len == LSMOD_BEGIN_KIND_LEN) ||
+             (packet->len == LSMOD_BEGIN_RATE_LEN) || (packet->len == LSMOD_BEGIN_LOOP_LEN)) &&
+            ((packet->len == LSMOD_BEGIN_LEN) || (kind == PLAYER_KIND_NONE) || (PLAYER_KIND_SOUND(kind) < TRACK_SOUNDS)) &&
+            (rate >= PLAYER_RATE_MIN) && (rate <= PLAYER_FREQ_HZ) &&
+            ((packet->data[1] == PLAYER_FORMAT_PCM8) || (packet->data[1] == PLAYER_FORMAT_ADPCM)) &&
+            (packet->data[0] < PLAYER_MAX_TRACKS) && !activated && !EffectsBusy() && !flashCrcWait)
         {
-          if (loadTrackIdx == 0)
+          loadClose();
+          loadTrackIdx = packet->data[0];
+          // Tracks start on a page, so the page loads fill whole pages. The
+          // entry is written right away, a broken load leaves the track empty.
+          if (!PlayerPlaceTrack(loadTrackIdx, len, &track))
           {
-            PlayerTracksAddr[loadTrackIdx] = 0;
+            ComportReplyError(LSMOD_CONTROL_LOAD_BEGIN);
+            break;
           }
-          else
+          track.format = packet->data[1];
+          track.rate = rate;
+          if (packet->len == LSMOD_BEGIN_LOOP_LEN)
+          {
+            track.loopStart = ((uint32_t)packet->data[9] << 24) | ((uint32_t)packet->data[10] << 16) |
+                              ((uint32_t)packet->data[11] << 8) | packet->data[12];
+            track.loopEnd = ((uint32_t)packet->data[13] << 24) | ((uint32_t)packet->data[14] << 16) |
+                            ((uint32_t)packet->data[15] << 8) | packet->data[16];
+          }
+          // Loop is counted in samples, a compressed track holds two per byte
+          if ((track.loopStart > track.loopEnd) ||
+              (track.loopEnd > ((track.format == PLAYER_FORMAT_ADPCM) ? (len * 2) : len)) ||
+              !PlayerWriteTrack(loadTrackIdx, &track) ||
+              ((packet->len > LSMOD_BEGIN_LEN) && !PlayerWriteKind(loadTrackIdx, kind)))
           {
-            PlayerTracksAddr[loadTrackIdx] = PlayerTracksAddr[loadTrackIdx - 1] + PlayerTracksLen[loadTrackIdx - 1];
+            ComportReplyError(LSMOD_CONTROL_LOAD_BEGIN);
+            break;
           }
-          PlayerTracksLen[loadTrackIdx] = 0;
+          loadTrackPage = track.page;
+          loadTrackSize = len;
           loadTrackPos = 0;
-          loadTrackActive = true;
-          ComportReplyAck(LSMOD_CONTROL_LOAD_BEGIN);
+          loadTrackNext = 0;
+          loadTrackSeq = 0;
+          loadAhead = false;
+          loadTrackTo = packet->from;
+          cli();
+          loadTrackPages = (len + DB321_PAGE_SIZE - 1) / DB321_PAGE_SIZE;
+          sei();
+          loadTrackActive = DataflashWriteBegin((uint32_t)loadTrackPage * DB321_PAGE_SIZE);
+          if (loadTrackActive)
+          {
+            loadTrackWait = true;
+            loadTrackCmd = LSMOD_CONTROL_LOAD_BEGIN;
+          }
+          else
+          {
+            ComportReplyError(LSMOD_CONTROL_LOAD_BEGIN);
+          }
         }
         else
         {
@@ -148,22 +411,31 @@ void commandHandler(void* args)
       case LSMOD_CONTROL_LOAD:
         if (loadTrackActive)
         {
-          loadTrackPos = packet->data[0];
+          // Sender keeps a few packets in flight. Anything but the next one in
+          // order is dropped and the last one written is acknowledged again.
+          if (packet->data[0] != loadTrackSeq)
+          {
+            ComportReplyLoaded(loadTrackSeq - 1);
+            break;
+          }
+          loadTrackPos = packet->data[LSMOD_DATA_SEQ_LEN];
           loadTrackPos = loadTrackPos << 8;
-          loadTrackPos += packet->data[1];
+          loadTrackPos += packet->data[LSMOD_DATA_SEQ_LEN + 1];
           loadTrackPos = loadTrackPos << 8;
-          loadTrackPos += packet->data[2];
+          loadTrackPos += packet->data[LSMOD_DATA_SEQ_LEN + 2];
           loadTrackPos = loadTrackPos << 8;
-          loadTrackPos += packet->data[3];
-          loadTrackLen = packet->len - LSMOD_DATA_IDX_LEN;
-          if (DataflashWrite(&packet->data[LSMOD_DATA_IDX_LEN], (PlayerTracksAddr[loadTrackIdx] + loadTrackPos), loadTrackLen))
+          loadTrackPos += packet->data[LSMOD_DATA_SEQ_LEN + 3];
+          loadTrackLen = packet->len - LSMOD_DATA_SEQ_LEN - LSMOD_DATA_IDX_LEN;
+          // Flash is written sequentially, there is no going back
+          if ((loadTrackPos == loadTrackNext) && (loadTrackLen <= (loadTrackSize - loadTrackNext)) &&
+              DataflashWriteNext(&packet->data[LSMOD_DATA_SEQ_LEN + LSMOD_DATA_IDX_LEN], loadTrackLen))
           {
-            led2Toggle();
-            ComportReplyLoaded(loadTrackLen);
+            loadTrackWait = true;
+            loadTrackCmd = LSMOD_CONTROL_LOAD;
           }
           else
           {
-            loadTrackActive = false;
+            loadClose();
             ComportReplyError(LSMOD_CONTROL_LOAD);
           }
         }
@@ -172,26 +444,61 @@ void commandHandler(void* args)
           ComportReplyError(LSMOD_CONTROL_LOAD);
         }
         break;
-      case LSMOD_CONTROL_LOAD_END:
-        if ((packet->data[0] == loadTrackIdx) && loadTrackActive)
+      case LSMOD_CONTROL_LOAD_PAGE:
+        if (loadTrackActive && (packet->len == LSMOD_PAGE_HDR_LEN))
         {
-          PlayerTracksLen[loadTrackIdx] = loadTrackPos + loadTrackLen;
-          loadTrackActive = false;
-          ComportReplyAck(LSMOD_CONTROL_LOAD_END);
-          loadTrackIdx++;
-          if (loadTrackIdx == PLAYER_MAX_TRACKS)
+          page = ((uint16_t)packet->data[LSMOD_PAGE_PAGE_INDEX] << 8) | packet->data[LSMOD_PAGE_PAGE_INDEX + 1];
+          size = ((uint16_t)packet->data[LSMOD_PAGE_SIZE_INDEX] << 8) | packet->data[LSMOD_PAGE_SIZE_INDEX + 1];
+          // Page is in the flash already. The one right behind a missing page
+          // is kept and only the missing one is asked for, anything else out
+          // of order is acknowledged up to the last one in order.
+          if (packet->data[0] != loadTrackSeq)
+          {
+            if ((packet->data[0] == (uint8_t)(loadTrackSeq + 1)) && loadPageValid(page, size))
+            {
+              loadAhead = true;
+              loadAheadPage = page;
+              ComportReplyNak(loadTrackSeq);
+            }
+            else
+            {
+              ComportReplyLoaded(loadTrackSeq - 1);
+            }
+            break;
+          }
+          loadPage = page;
+          if (loadPageValid(page, size))
           {
-            loadTrackIdx = 0;
-            _delay_ms(COMPORT_TIMEOUT_MS);
-            PlayerSaveMem();
-            led2(false);
+            loadTrackWait = true;
+            loadTrackCmd = LSMOD_CONTROL_LOAD_PAGE;
           }
           else
           {
-            led2(true);
+            loadClose();
+            ComportReplyError(LSMOD_CONTROL_LOAD_PAGE);
           }
         }
         else
+        {
+          ComportReplyError(LSMOD_CONTROL_LOAD_PAGE);
+        }
+        break;
+      case LSMOD_CONTROL_LOAD_END:
+        // Crc of the data goes to the directory entry, it is optional
+        if ((packet->data[0] == loadTrackIdx) && loadTrackActive)
+        {
+          loadTrackCrc = (packet->len > 2) ? (((uint16_t)packet->data[1] << 8) | packet->data[2]) : 0;
+          DataflashWriteEnd();
+          loadTrackActive = false;
+          loadTrackWait = true;
+          loadTrackCmd = LSMOD_CONTROL_LOAD_END;
+        }
+        else if ((packet->data[0] == loadTrackLast) && !loadTrackActive && !loadTrackWait)
+        {
+          // Acknowledge got lost on the way
+          ComportReplyAck(LSMOD_CONTROL_LOAD_END);
+        }
+        else
         {
           ComportReplyError(LSMOD_CONTROL_LOAD_END);
         }
@@ -206,6 +513,79 @@ void commandHandler(void* args)
   }
 }
 
+// Packet buffer is free again, the data is in the flash
+void loadCompleted(void)
+{
+  PlayerTrack track;
+
+  loadTrackWait = false;
+  switch (loadTrackCmd) {
+    case LSMOD_CONTROL_LOAD_BEGIN:
+      led2(true);
+      ComportReplyBegin((uint32_t)loadTrackPage * DB321_PAGE_SIZE);
+      break;
+    case LSMOD_CONTROL_LOAD:
+      led2Toggle();
+      loadTrackNext += loadTrackLen;
+      ComportReplyLoaded(loadTrackSeq++);
+      break;
+    case LSMOD_CONTROL_LOAD_PAGE:
+      led2Toggle();
+      // Page kept ahead is covered by the same acknowledge
+      if (loadAhead)
+      {
+        loadAhead = false;
+        loadTrackSeq++;
+      }
+      ComportReplyLoaded(loadTrackSeq++);
+      break;
+    case LSMOD_CONTROL_LOAD_END:
+      // Entry gets the length last, the track is played from then on
+      if (PlayerReadTrack(loadTrackIdx, &track) && (track.page == loadTrackPage))
+      {
+        track.len = loadTrackSize;
+        track.crc = loadTrackCrc;
+        if (PlayerWriteTrack(loadTrackIdx, &track))
+        {
+          ComportReplyAck(LSMOD_CONTROL_LOAD_END);
+          loadTrackLast = loadTrackIdx;
+          led2(false);
+          break;
+        }
+      }
+      ComportReplyError(LSMOD_CONTROL_LOAD_END);
+      led2(false);
+      break;
+  }
+}
+
+// Runs in the receive interrupt once the page header is in. Any page of the
+// track is taken, one acknowledged already comes again when the acknowledge
+// was lost and simply writes the same data.
+bool loadPageBegin(void* args)
+{
+  LsmodPacket* packet = (LsmodPacket*)args;
+  uint16_t page, size;
+
+  page = ((uint16_t)packet->data[LSMOD_PAGE_PAGE_INDEX] << 8) | packet->data[LSMOD_PAGE_PAGE_INDEX + 1];
+  size = ((uint16_t)packet->data[LSMOD_PAGE_SIZE_INDEX] << 8) | packet->data[LSMOD_PAGE_SIZE_INDEX + 1];
+  if (!loadTrackActive || (size == 0) || (size > DB321_PAGE_SIZE) || (page >= loadTrackPages))
+  {
+    return false;
+  }
+  return DataflashStreamBegin(loadTrackPage + page);
+}
+
+bool loadCompletedReady(void)
+{
+  if (loadTrackCmd == LSMOD_CONTROL_LOAD_PAGE)
+  {
+    return DataflashStreamWritten(loadTrackPage + loadPage) &&
+           (!loadAhead || DataflashStreamWritten(loadTrackPage + loadAheadPage));
+  }
+  return DataflashWriteCompleted();
+}
+
 uint32_t reduce(uint32_t val, uint8_t rdc)
 {
   uint8_t bytes[3];
@@ -253,7 +633,7 @@ void readyVoltage(void)
 void adjustBrightness(void)
 {
   bool rduce;
-  uint8_t rdc;
+  uint8_t rdc, limit;
   bool update;
  
   update = false;
@@ -262,6 +642,7 @@ void adjustBrightness(void)
   {
     voltageLevel = VOLTAGE_HIGH;
     rdc = REDUCE_HIGH;
+    limit = SOUND_HIGH;
     rduce = true;
     update = true;
   }
@@ -269,6 +650,7 @@ void adjustBrightness(void)
   {
     voltageLevel = VOLTAGE_AVERAGE;
     rdc = REDUCE_AVERAGE;
+    limit = SOUND_AVERAGE;
     rduce = true;
     update = true;
   }
@@ -276,6 +658,7 @@ void adjustBrightness(void)
   {
     voltageLevel = VOLTAGE_LOW;
     rdc = REDUCE_LOW;
+    limit = SOUND_LOW;
     rduce = true;
     update = true;
   }
@@ -283,6 +666,7 @@ void adjustBrightness(void)
   {
     voltageLevel = VOLTAGE_CRITICAL;
     trueColor = 0;
+    limit = SOUND_CRITICAL;
     rduce = false;
     update = true;
   }
@@ -293,177 +677,395 @@ void adjustBrightness(void)
   if (update)
   {
     updateColor = true;
+    PlayerSetLimit(limit);
   }
 }
 
-int main(void)
+// Broken packet during a load is most likely a page, the first one missing
+// is asked for at once instead of waiting for the sender to time out
+void loadCheckBroken(void)
 {
+  uint16_t errors;
+  uint8_t seq;
+
   cli();
-  initBoard();
-  ComportSetup(commandHandler);
-  PlayerInit();
-  ADC_Init();
+  errors = ComportCrcErrors;
   sei();
-  PlayerLoadMem();
-  if (DataflashInit())
+  if (errors == loadCrcErrors)
   {
-    deblink(1);
+    return;
   }
-#ifdef MMA7455L_USED
-  if (Mma7455l_Init())
+  if (loadTrackActive)
   {
-    deblink(2);
+    seq = loadTrackSeq;
+    if (loadTrackWait && (loadTrackCmd == LSMOD_CONTROL_LOAD_PAGE))
+    {
+      seq += loadAhead ? 2 : 1;
+    }
+    if (!ComportSend(loadTrackTo, LSMOD_REPLY_NAK, &seq, 1))
+    {
+      return;
+    }
   }
-#endif
-#ifdef ADXL330_USED
-  Adxl330_Init();
-#endif
-  LedrgbInit();
-  LedrgbLoadColor();
-  trueColor = LedrgbColor;
-  rawVoltage = ADC_ChannelSetup(VOLTAGE_CHAN, readyVoltage);
-  while(1)
+  loadCrcErrors = errors;
+}
+
+// Packets come framed from the receive interrupt, they are taken while the
+// blade is lit as well. Replies to the loads go once the flash has taken the
+// data, the one to a crc once the range is read.
+void comportTask(void)
+{
+  uint16_t crc;
+
+  ComportParse();
+  DataflashPoll();
+  if (loadTrackWait && loadCompletedReady())
   {
-    if (ComportIsDataToParse && !ComportNeedFeedback && !activated && !PlayerActive)
+    loadCompleted();
+  }
+  if (flashCrcWait && DataflashCrcCompleted(&crc))
+  {
+    if (flashCrcPages == 0)
     {
-      ComportParse();
+      flashCrcWait = false;
+      ComportReplyCrc(crc);
     }
-    voltageTimeCount++;
-    if (voltageTimeCount > VOLTAGE_DELAY_TICKS)
+    else
     {
-      voltageTimeCount = 0;
-      if (voltageMeasured)
+      *flashCrcDst++ = (uint8_t)(crc >> 8);
+      *flashCrcDst++ = (uint8_t)crc;
+      flashCrcAddr += DB321_PAGE_SIZE;
+      if (--flashCrcPages == 0)
       {
-        adjustBrightness();
-        voltageMeasured = false;
-      }    
+        flashCrcWait = false;
+        ComportReplyPageCrc(flashCrcCount);
+      }
+      else if (!DataflashCrcBegin(flashCrcAddr, DB321_PAGE_SIZE, LSMOD_CRC_INIT, flashCrcChunks))
+      {
+        flashCrcWait = false;
+        flashCrcPages = 0;
+        ComportReplyError(LSMOD_CONTROL_PAGE_CRC);
+      }
     }
-    if (BUTTON_PRESSED)
+  }
+  loadCheckBroken();
+}
+
+// Button is sampled slow enough to skip the bounce. It acts on the press only
+// and not before the blade is fully out or in. Held on through the retraction
+// for BUTTON_FONT_MS it takes the next font, which plays its turn on sound.
+void buttonTask(void)
+{
+  if (BUTTON_PRESSED)
+  {
+    if (!buttonHeld && !EffectsBusy())
     {
       if (!activated)
       {
         led2(true);
-        deltaTrackPos = PlayerTracksLen[TRACK_TURNON] / LEDRGB_TOTAL_LEN;
-        nexTrackPos = deltaTrackPos;
-        lsmodLen = 1;
-        PlayerStart(TRACK_TURNON);
-        while (PlayerActive)
-        {
-          while ((PlayerTrackPos < nexTrackPos) && PlayerActive);
-          LedrgbSet(trueColor, lsmodLen);
-          lsmodLen++;
-          nexTrackPos += deltaTrackPos;
-        }
-        LedrgbOn(trueColor);
-      #ifdef MMA7455L_USED
-        Mma7455l_MotionDetected = false;
-      #endif
-      #ifdef ADXL330_USED
-        Adxl330_HitDetected = false;
-        Adxl330_MotionDetected = false;
-      #endif
-        activated = true;
+        PlayerStartSound(VOICE_EFFECT, TRACK_TURNON, TCNT0);
+        EffectsIgnite();
+        igniting = true;
       }
       else
       {
         activated = false;
-        deltaTrackPos = PlayerTracksLen[TRACK_TURNOFF] / LEDRGB_TOTAL_LEN;
-        nexTrackPos = deltaTrackPos;
-        lsmodLen = LEDRGB_TOTAL_LEN;
-        PlayerStart(TRACK_TURNOFF);
-        while (PlayerActive)
-        {
-          while ((PlayerTrackPos < nexTrackPos) && PlayerActive);
-          LedrgbSet(trueColor, lsmodLen);
-          lsmodLen--;
-          nexTrackPos += deltaTrackPos;
-        }      
-        LedrgbOff();
-        led2(false);
+        PlayerStopAll();
+        PlayerStartSound(VOICE_EFFECT, TRACK_TURNOFF, TCNT0);
+        EffectsRetract();
+        retracting = true;
+        buttonFont = true;
+        buttonSince = SchedulerTicks();
       }
     }
-    if (activated)
+    if (buttonFont && !retracting && ((uint16_t)(SchedulerTicks() - buttonSince) >= SCHEDULER_MS(BUTTON_FONT_MS)))
     {
-      if (updateColor)
-      {
-        updateColor = false;
-        LedrgbOn(trueColor);
-      }
-      if (hit && !PlayerActive)
-      {
-        hit = false;
-      }
-      if (swing && !PlayerActive)
-      {
-        swing = false;
-      }
-    #ifndef CLASH_DISABLE
-      if (SENSOR_ACTIVE && !sensorTimeReach)
-      {
-        sensorTimeCount++;
-        if (sensorTimeCount > SENSOR_DELAY_TICKS)
-        {
-          sensorTimeReach = true;
-          sensorTimeCount = 0;
-        }
-      }
-      if (!SENSOR_ACTIVE)
-      {
-        sensorTimeReach = false;
-        sensorTimeCount = 0;
-      }
-      if (!hit)
-      {
-        if (sensorTimeReach && !clash)
-        {
-          clash = true;
-          led1(true);
-          PlayerStart(TRACK_CLASH);
-        }
-        if (clash && sensorTimeReach && !PlayerActive)
-        {
-          PlayerStart(TRACK_CLASH);
-        }
-        if (clash && !sensorTimeReach)
-        {
-          clash = false;
-          led1(false);
-          PlayerStop();        
-        }
-      }
-    #endif
-    #ifdef MMA7455L_USED
-      if (Mma7455l_MotionDetected)
-      {
-        Mma7455l_MotionDetected = false;
-        // TODO: Play music
-      }
-    #endif
-    #ifdef ADXL330_USED
-      if (Adxl330_HitDetected)
-      {
-        Adxl330_HitDetected = false;
-        if (!hit)
-        {
-          hit = true;
-          PlayerStart(TRACK_HIT);
-        }
-      }
-      if (Adxl330_MotionDetected)
-      {
-        Adxl330_MotionDetected = false;
-        if (!swing && !hit && !clash)
-        {
-          swing = true;
-          PlayerStart(TRACK_SWING);
-        }
-      }
-    #endif
-      if (!PlayerActive && !hit && !clash)
-      {
-        PlayerStart(TRACK_HUM);
-      }
+      buttonFont = false;
+      PlayerNextFont();
+      PlayerStartSound(VOICE_EFFECT, TRACK_TURNON, TCNT0);
+    }
+    buttonHeld = true;
+  }
+  else
+  {
+    buttonHeld = false;
+    buttonFont = false;
+  }
+}
+
+void effectsTask(void)
+{
+  if (updateColor)
+  {
+    updateColor = false;
+    EffectsColor(trueColor);
+  }
+  EffectsUpdate();
+  if (igniting && !EffectsBusy())
+  {
+    igniting = false;
+  #ifdef MMA7455L_USED
+    Mma7455l_MotionDetected = false;
+  #endif
+  #ifdef ADXL330_USED
+    Adxl330_HitDetected = false;
+    Adxl330_MotionDetected = false;
+  #endif
+    activated = true;
+  }
+  if (retracting && !EffectsBusy())
+  {
+    retracting = false;
+    led2(false);
+  }
+}
+
+// Frame that does not fit the transmit buffer waits for the next pass, the
+// time stamp tells when it was taken
+void telemetryTask(void)
+{
+  uint8_t frame[LSMOD_TELEMETRY_LEN];
+  uint16_t now;
+  uint8_t i;
+
+  now = SchedulerTicks();
+  if ((telemetryPeriod == 0) || ((uint16_t)(now - telemetryLast) < telemetryPeriod))
+  {
+    return;
+  }
+  frame[0] = (uint8_t)(now >> 8);
+  frame[1] = (uint8_t)now;
+#ifdef ADXL330_USED
+  frame[2] = (uint8_t)(Adxl330_AccelReal.x >> 8);
+  frame[3] = (uint8_t)Adxl330_AccelReal.x;
+  frame[4] = (uint8_t)(Adxl330_AccelReal.y >> 8);
+  frame[5] = (uint8_t)Adxl330_AccelReal.y;
+  frame[6] = (uint8_t)(Adxl330_AccelReal.z >> 8);
+  frame[7] = (uint8_t)Adxl330_AccelReal.z;
+#else
+  for (i = 2; i < 8; i++)
+  {
+    frame[i] = 0;
+  }
+#endif
+  frame[8] = voltage;
+  frame[9] = 0;
+  for (i = 0; i < PLAYER_VOICES; i++)
+  {
+    if (PlayerVoiceActive(i))
+    {
+      frame[9] |= (1 << i);
+    }
+  }
+  frame[10] = (activated ? LSMOD_EVENT_ACTIVATED : 0) |
+              (hit ? LSMOD_EVENT_HIT : 0) |
+              (swing ? LSMOD_EVENT_SWING : 0) |
+              (clash ? LSMOD_EVENT_CLASH : 0) |
+              (SENSOR_ACTIVE ? LSMOD_EVENT_SENSOR : 0);
+  if (ComportSend(telemetryTo, LSMOD_REPLY_TELEMETRY, frame, LSMOD_TELEMETRY_LEN))
+  {
+    telemetryLast = now;
+  }
+}
+
+void voltageTask(void)
+{
+  if (voltageMeasured)
+  {
+    adjustBrightness();
+    voltageMeasured = false;
+  }
+}
+
+// Counts are halved before one runs over, so they follow the recent play
+void effectStart(uint8_t sound, uint8_t since)
+{
+  uint8_t i;
+
+  if (effectStarts[sound - TRACK_SWING] == UINT8_MAX)
+  {
+    for (i = 0; i < sizeof(effectStarts); i++)
+    {
+      effectStarts[i] /= 2;
+    }
+  }
+  effectStarts[sound - TRACK_SWING]++;
+  PlayerStartSound(VOICE_EFFECT, sound, since);
+}
+
+// Effect that started most often is the likely next one, a hit until any
+// other has come more often
+uint8_t effectLikely(void)
+{
+  uint8_t sound, i;
+
+  sound = TRACK_HIT;
+  for (i = TRACK_SWING; i <= TRACK_CLASH; i++)
+  {
+    if (effectStarts[i - TRACK_SWING] > effectStarts[sound - TRACK_SWING])
+    {
+      sound = i;
     }
   }
+  return sound;
+}
+
+// Runs on every pass, so the sounds answer the sensors within a tick. The
+// sensor is polled here, so a clash is timed from this pass, while the
+// accelerometer flags carry the Timer0 count they were raised at.
+void bladeTask(void)
+{
+#ifdef ADXL330_USED
+  uint8_t since;
+#endif
+
+  if (!activated)
+  {
+    // Blade that is off can only be lit next
+    if (!igniting && !retracting && !PlayerVoiceActive(VOICE_EFFECT) && !loadTrackActive && !flashCrcWait)
+    {
+      PlayerPrime(VOICE_EFFECT, TRACK_TURNON);
+    }
+    return;
+  }
+  if (hit && !PlayerVoiceActive(VOICE_EFFECT))
+  {
+    hit = false;
+  }
+  if (swing && !PlayerVoiceActive(VOICE_EFFECT))
+  {
+    swing = false;
+  }
+#ifndef CLASH_DISABLE
+  // Contact has to last for SENSOR_DELAY_MS
+  if (SENSOR_ACTIVE)
+  {
+    if (!sensorActive)
+    {
+      sensorActive = true;
+      sensorSince = SchedulerTicks();
+    }
+    if ((SchedulerTicks() - sensorSince) > SCHEDULER_MS(SENSOR_DELAY_MS))
+    {
+      sensorTimeReach = true;
+    }
+  }
+  else
+  {
+    sensorActive = false;
+    sensorTimeReach = false;
+  }
+  if (!hit)
+  {
+    if (sensorTimeReach && !clash)
+    {
+      clash = true;
+      led1(true);
+      effectStart(TRACK_CLASH, TCNT0);
+      EffectsClash(true);
+    }
+    if (clash && sensorTimeReach && !PlayerVoiceActive(VOICE_EFFECT))
+    {
+      effectStart(TRACK_CLASH, TCNT0);
+    }
+    if (clash && !sensorTimeReach)
+    {
+      clash = false;
+      led1(false);
+      PlayerStop(VOICE_EFFECT);
+      EffectsClash(false);
+    }
+  }
+#endif
+#ifdef MMA7455L_USED
+  if (Mma7455l_MotionDetected)
+  {
+    Mma7455l_MotionDetected = false;
+    // TODO: Play music
+  }
+#endif
+#ifdef ADXL330_USED
+  if (Adxl330_HitDetected)
+  {
+    // Count is taken before the flag goes, a new one may come right after
+    since = Adxl330_HitTime;
+    Adxl330_HitDetected = false;
+    if (!hit)
+    {
+      hit = true;
+      effectStart(TRACK_HIT, since);
+      EffectsHit();
+    }
+  }
+  if (Adxl330_MotionDetected)
+  {
+    since = Adxl330_MotionTime;
+    Adxl330_MotionDetected = false;
+    if (!swing && !hit && !clash)
+    {
+      swing = true;
+      effectStart(TRACK_SWING, since);
+    }
+  }
+#endif
+  if (PlayerVoiceActive(VOICE_EFFECT))
+  {
+    PlayerSetGain(VOICE_HUM, GAIN_HUM_DUCKED);
+  }
+  else
+  {
+    PlayerSetGain(VOICE_HUM, PLAYER_GAIN_MAX);
+  }
+  // Hum with a loop goes on by itself, one without is started again
+  if (!PlayerVoiceActive(VOICE_HUM))
+  {
+    PlayerStartSound(VOICE_HUM, TRACK_HUM, TCNT0);
+  }
+  // Idle effect voice holds the start of the likely next effect, so that one
+  // needs no flash read when it comes. A load or CRC job holds the flash until
+  // it ends, priming waits for that.
+  if (!PlayerVoiceActive(VOICE_EFFECT) && !loadTrackActive && !flashCrcWait)
+  {
+    PlayerPrime(VOICE_EFFECT, effectLikely());
+  }
+}
+
+int main(void)
+{
+  cli();
+  initBoard();
+  ComportSetup(commandHandler);
+  ComportSetupStream(loadPageBegin, DataflashStreamByte, DataflashStreamEnd);
+  PlayerInit();
+  ADC_Init();
+  sei();
+  if (DataflashInit())
+  {
+    deblink(1);
+  }
+  PlayerLoadDir();
+#ifdef MMA7455L_USED
+  if (Mma7455l_Init())
+  {
+    deblink(2);
+  }
+#endif
+#ifdef ADXL330_USED
+  Adxl330_Init();
+#endif
+  LedrgbInit();
+  LedrgbLoadColor();
+  trueColor = LedrgbColor;
+  EffectsInit();
+  EffectsColor(trueColor);
+  rawVoltage = ADC_ChannelSetup(VOLTAGE_CHAN, readyVoltage);
+  SchedulerInit();
+  SchedulerAdd(comportTask, 0);
+  SchedulerAdd(bladeTask, 0);
+  SchedulerAdd(buttonTask, SCHEDULER_MS(BUTTON_PERIOD_MS));
+  SchedulerAdd(effectsTask, SCHEDULER_MS(1000 / EFFECTS_FPS));
+  SchedulerAdd(voltageTask, SCHEDULER_MS(VOLTAGE_DELAY_MS));
+  SchedulerAdd(telemetryTask, 0);
+  SchedulerRun();
   return 0;
 }
@@ -3,6 +3,7 @@
 
 #include <avr/io.h>
 #include <avr/eeprom.h>
+#include <avr/pgmspace.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
 #include <math.h>
@@ -13,46 +14,808 @@
  * Private types/enumerations/variables                                     *
  ****************************************************************************/
 
-static const uint16_t prescale1[6] = {0, 1, 8, 64, 256, 1024};
+static const uint16_t prescale1[6] PROGMEM = {0, 1, 8, 64, 256, 1024};
 static uint8_t div1;
 
-static uint32_t EEMEM tracksAddrMem[PLAYER_MAX_TRACKS];
-static uint32_t EEMEM tracksLenMem[PLAYER_MAX_TRACKS];
+#define BIAS_STEP_US  100  // Output is brought up to the midpoint that slowly
 
-static uint8_t sound;
-static uint32_t trackLen = 0;
+// Mix is scaled to half the PWM range in 1/128 steps, a byte has to hold it
+#if (F_CPU / PLAYER_FREQ_HZ) > 512
+  #error "PWM range is too wide for the output scale"
+#endif
+
+// Gains are ramped in 8.8 fixed point, a full swing takes PLAYER_FADE_SAMPLES
+#define FADE_FULL  ((uint16_t)PLAYER_GAIN_MAX << 8)
+#define FADE_STEP  (FADE_FULL / PLAYER_FADE_SAMPLES)
+
+#if (PLAYER_FADE_SAMPLES < 1) || (PLAYER_FADE_SAMPLES > 0xFF00)
+  #error "PLAYER_FADE_SAMPLES is out of range"
+#endif
+
+// Directory takes the last flash page, a header, an entry per track and then
+// the kind of every track. An entry is valid when it names its own track,
+// anything else is empty.
+#define DIR_PAGE     (DB321_PAGE_NUM - 1)
+#define DIR_MAGIC    0x4C44
+#define DIR_VERSION  2
+#define DIR_READ_TRIES     100  // 10 us apart, a refill holds the bus for less
+#define DIR_EMPTY_PAGE  0xFFFF
+
+typedef struct {
+  uint16_t magic;
+  uint8_t version;
+  uint8_t tracks;
+} DirHeader;
+
+#define DIR_ENTRY_ADDR(track)  ((uint32_t)DIR_PAGE * DB321_PAGE_SIZE + sizeof(DirHeader) + (uint16_t)(track) * sizeof(PlayerTrack))
+#define DIR_KIND_ADDR(track)   (DIR_ENTRY_ADDR(PLAYER_MAX_TRACKS) + (track))
+
+static uint8_t tracksUsed[(PLAYER_MAX_TRACKS + 7) / 8];  // Bit per track that has data
+// Sound a pick takes the track for, a nibble per track and 0x0F for none. The
+// tracks of font 0 stand in for a sound the font lacks. Built from the
+// directory kinds on the first pick after a change.
+static uint8_t trackSounds[(PLAYER_MAX_TRACKS + 1) / 2];
+static bool trackSoundsStale = true;
+static uint8_t EEMEM fontMem;
+static uint8_t EEMEM volumeMem;
+static uint8_t volume = PLAYER_GAIN_MAX;
+static uint8_t limit = PLAYER_GAIN_MAX;
+static uint16_t outMid;  // PWM midpoint, silence
+static uint8_t outScale;  // Mix to PWM counts times 128, on its way to the target
+static uint8_t outTarget;  // Taken from the volume and the limit
+static uint16_t seed = 1;
+static uint8_t lastPick[TRACK_SOUNDS];  // Not picked again while the sound has others
+
+static const uint16_t adpcmStep[89] PROGMEM = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+  253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+  1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+  3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+  11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+  32767
+};
+static const int8_t adpcmIndex[8] PROGMEM = {-1, -1, -1, -1, 2, 4, 6, 8};
+
+typedef struct {
+  bool active;
+  bool stopping;  // Fades out and stops
+  uint8_t gain;
+  uint16_t amp;  // Gain the output is at, on its way to the gain or to zero
+  int8_t tail;  // Output left by the track before, faded out with fade
+  uint16_t fade;
+  uint16_t page;  // Dataflash page and byte of the next refill, kept apart so
+  uint16_t offset;  // the interrupt needs no 32-bit division
+  uint32_t len;
+  uint32_t pos;
+  uint16_t step;  // Track rate to output rate as a 16-bit fraction, zero when equal
+  uint16_t phase;  // Way from the previous track sample to the current one
+  int8_t prev;
+  int8_t cur;
+  int16_t level;  // Last contribution to the mix
+  uint8_t peak;  // Loudest sample since the last PlayerVoicePeak(), before the gain
+  uint8_t format;
+  int16_t predictor;
+  uint8_t index;
+  bool nibble;
+  bool loops;  // Track goes on from loopStart when it reaches len
+  uint32_t loopStart;
+  uint16_t loopPage;  // Dataflash page and byte of the loop start
+  uint16_t loopOffset;
+  uint32_t loopLeft;  // Bytes to read up to the loop end
+  int16_t loopPredictor;  // Decoder state at the loop start
+  uint8_t loopIndex;
+  uint8_t primed;  // Sound set up and buffered while idle, TRACK_SOUNDS for none
+  bool timing;  // Start is timed up to the first sample
+  uint8_t since;  // Timer0 count the start was asked at
+  uint8_t bufferPos;
+  uint8_t fillHalf;
+  bool ready[2];
+  // Ping-pong buffer, one half is played while the other one is refilled
+  uint8_t buffer[PLAYER_BUFFER_SIZE];
+} Voice;
+
+static Voice voices[PLAYER_VOICES];
+static volatile bool filling = false;
+static bool fillDue = false;  // Refill is tried on the next sample, the bus was taken or a voice started
+static volatile uint8_t fillVoice;
+static uint8_t fillDone;  // Bytes of the half read so far, kept when the bus was taken
+static uint8_t fillLen;  // Bytes of the read running
 
 /****************************************************************************
  * Public types/enumerations/variables                                      *
  ****************************************************************************/
 
 volatile bool PlayerActive = false;
-uint32_t PlayerTracksAddr[PLAYER_MAX_TRACKS];
-uint32_t PlayerTracksLen[PLAYER_MAX_TRACKS];
-volatile uint32_t PlayerTrackPos = 0;
 uint16_t PlayerMaxValue;
+volatile uint16_t PlayerUnderruns = 0;
+volatile uint8_t PlayerLatency = 0;
+volatile uint8_t PlayerLatencyMax = 0;
+volatile uint16_t PlayerCyclesMax = 0;
+uint8_t PlayerFont = 0;
 
 /****************************************************************************
  * Private functions                                                        *
  ****************************************************************************/
 
+static void filled(void);
+
+static int8_t adpcmDecode(Voice* v, uint8_t code)
+{
+  uint16_t step;
+  uint16_t diff;
+  int32_t predictor;
+  int8_t index;
+
+  step = pgm_read_word(&adpcmStep[v->index]);
+  diff = step >> 3;
+  if (code & 4)
+  {
+    diff += step;
+  }
+  if (code & 2)
+  {
+    diff += step >> 1;
+  }
+  if (code & 1)
+  {
+    diff += step >> 2;
+  }
+  predictor = v->predictor;
+  if (code & 8)
+  {
+    predictor -= diff;
+  }
+  else
+  {
+    predictor += diff;
+  }
+  if (predictor > INT16_MAX)
+  {
+    predictor = INT16_MAX;
+  }
+  if (predictor < INT16_MIN)
+  {
+    predictor = INT16_MIN;
+  }
+  v->predictor = (int16_t)predictor;
+  index = (int8_t)v->index + (int8_t)pgm_read_byte(&adpcmIndex[code & 7]);
+  if (index < 0)
+  {
+    index = 0;
+  }
+  if (index > 88)
+  {
+    index = 88;
+  }
+  v->index = (uint8_t)index;
+  return (int8_t)(v->predictor >> 8);
+}
+
+// Bytes the samples take, compressed tracks hold two samples per byte
+static uint32_t trackBytes(Voice* v, uint32_t samples)
+{
+  return (v->format == PLAYER_FORMAT_ADPCM) ? (samples / 2) : samples;
+}
+
+// Refill position moves on by the bytes read, back to the loop start once
+// the loop end is reached
+static void voiceAdvance(Voice* v, uint8_t len)
+{
+  v->offset += len;
+  if (v->offset >= DB321_PAGE_SIZE)
+  {
+    v->offset -= DB321_PAGE_SIZE;
+    v->page++;
+  }
+  if (v->loops)
+  {
+    v->loopLeft -= len;
+    if (v->loopLeft == 0)
+    {
+      v->page = v->loopPage;
+      v->offset = v->loopOffset;
+      v->loopLeft = trackBytes(v, v->len) - trackBytes(v, v->loopStart);
+    }
+  }
+}
+
+// Half that runs over the loop end is read in parts
+static void fillPart(void)
+{
+  Voice* v;
+
+  v = &voices[fillVoice];
+  fillLen = PLAYER_BUFFER_HALF - fillDone;
+  if (v->loops && (v->loopLeft < fillLen))
+  {
+    fillLen = (uint8_t)v->loopLeft;
+  }
+  filling = DataflashReadPageAsync(v->page, v->offset, &v->buffer[v->fillHalf * PLAYER_BUFFER_HALF + fillDone],
+                                   fillLen, filled);
+  fillDue = !filling;
+}
+
+// Only one dataflash read at a time, voices are served in order. Half that
+// was left part way goes on first.
+static void refill(void)
+{
+  uint8_t i;
+
+  fillDue = false;
+  if (!filling && (fillDone != 0))
+  {
+    fillPart();
+  }
+  else if (!filling)
+  {
+    for (i = 0; i < PLAYER_VOICES; i++)
+    {
+      if (voices[i].active && !voices[i].ready[voices[i].fillHalf])
+      {
+        fillVoice = i;
+        fillDone = 0;
+        fillPart();
+        break;
+      }
+    }
+  }
+}
+
+static void filled(void)
+{
+  Voice* v;
+
+  filling = false;
+  // Voice could be stopped or restarted while the read was running
+  if (fillVoice < PLAYER_VOICES)
+  {
+    v = &voices[fillVoice];
+    voiceAdvance(v, fillLen);
+    fillDone += fillLen;
+    if (fillDone < PLAYER_BUFFER_HALF)
+    {
+      // Bus was just let go, the rest of the half is read at once
+      fillPart();
+      return;
+    }
+    v->ready[v->fillHalf] = true;
+    v->fillHalf ^= 1;
+  }
+  fillDone = 0;
+  refill();
+}
+
+// PWM keeps running from the start, it rests at the midpoint between tracks
+static void timerStart(void)
+{
+  TCCR1A |= (1 << COM1A1) | (0 << COM1A0);
+  TCCR1B |= (((div1 >> 2) & 1) << CS12) | (((div1 >> 1) & 1) << CS11) | (((div1 >> 0) & 1) << CS10);
+  TCNT1 = 0;
+}
+
+static void voiceStop(uint8_t voice)
+{
+  voices[voice].active = false;
+  voices[voice].level = 0;
+  if (fillVoice == voice)
+  {
+    fillDone = 0;
+    if (filling)
+    {
+      fillVoice = PLAYER_VOICES;
+    }
+  }
+}
+
+// Output the voice is at is held and faded out, together with what is left
+// of the tail before
+static void voiceFade(Voice* v)
+{
+  int16_t level;
+
+  level = v->level + (((int16_t)v->tail * (uint8_t)(v->fade >> 8)) >> 8);
+  if (level > INT8_MAX)
+  {
+    level = INT8_MAX;
+  }
+  if (level < INT8_MIN)
+  {
+    level = INT8_MIN;
+  }
+  v->tail = (int8_t)level;
+  v->fade = FADE_FULL;
+}
+
+static bool trackUsed(uint8_t track)
+{
+  return (tracksUsed[track / 8] & (1 << (track % 8))) != 0;
+}
+
+static uint8_t trackSound(uint8_t track)
+{
+  return (trackSounds[track / 2] >> ((track % 2) * 4)) & 0x0F;
+}
+
+// Bus may be taken by a refill of the other voice, it is free again shortly
+static bool dirRead(uint32_t addr, uint8_t* dst, uint8_t size)
+{
+  uint8_t tries;
+
+  for (tries = 0; !DataflashRead(addr, dst, size); tries++)
+  {
+    if (tries == DIR_READ_TRIES)
+    {
+      return false;
+    }
+    _delay_us(10);
+  }
+  return true;
+}
+
+static bool entryRead(uint8_t track, PlayerTrack* t)
+{
+  return dirRead(DIR_ENTRY_ADDR(track), (uint8_t*)t, sizeof(PlayerTrack));
+}
+
+// Write job is run to the end from here, the source has to stay intact
+static bool dirFlush(void)
+{
+  while (!DataflashWriteCompleted())
+  {
+    DataflashPoll();
+  }
+  return true;
+}
+
+static bool dirWrite(uint32_t addr, uint8_t* src, uint8_t size)
+{
+  return DataflashWriteBegin(addr) && dirFlush() &&
+         DataflashWriteNext(src, size) && dirFlush() &&
+         DataflashWriteEnd() && dirFlush();
+}
+
+// Header goes first and all the entries are empty. The first tracks make up
+// font 0, one per sound.
+static bool dirFormat(void)
+{
+  DirHeader h;
+  PlayerTrack t;
+  uint8_t i, kind;
+
+  h.magic = DIR_MAGIC;
+  h.version = DIR_VERSION;
+  h.tracks = PLAYER_MAX_TRACKS;
+  if (!DataflashWriteBegin((uint32_t)DIR_PAGE * DB321_PAGE_SIZE) || !dirFlush() ||
+      !DataflashWriteNext((uint8_t*)&h, sizeof(h)) || !dirFlush())
+  {
+    return false;
+  }
+  for (i = 0; i < PLAYER_MAX_TRACKS; i++)
+  {
+    t.len = 0;
+    t.loopStart = 0;
+    t.loopEnd = 0;
+    t.page = DIR_EMPTY_PAGE;
+    t.rate = PLAYER_FREQ_HZ;
+    t.crc = 0;
+    t.format = PLAYER_FORMAT_PCM8;
+    t.id = i;
+    if (!DataflashWriteNext((uint8_t*)&t, sizeof(t)) || !dirFlush())
+    {
+      return false;
+    }
+  }
+  for (i = 0; i < PLAYER_MAX_TRACKS; i++)
+  {
+    kind = (i < TRACK_SOUNDS) ? PLAYER_KIND(0, i) : PLAYER_KIND_NONE;
+    if (!DataflashWriteNext(&kind, 1) || !dirFlush())
+    {
+      return false;
+    }
+  }
+  return DataflashWriteEnd() && dirFlush();
+}
+
+// Entry holds data when it is the track's own and lies below the directory
+static bool entryValid(uint8_t track, PlayerTrack* t)
+{
+  return (t->id == track) && (t->len != 0) && (t->page < DIR_PAGE) &&
+         (t->len <= ((uint32_t)(DIR_PAGE - t->page) * DB321_PAGE_SIZE)) &&
+         (t->rate >= PLAYER_RATE_MIN) && (t->rate <= PLAYER_FREQ_HZ);
+}
+
+// Pages from the first one up to one past the last one
+static uint16_t trackPages(uint32_t len)
+{
+  return (len + DB321_PAGE_SIZE - 1) / DB321_PAGE_SIZE;
+}
+
+// Other entries are read into the scratch one by one
+// 16-bit Galois LFSR, stirred with the timer that runs while a track plays
+static uint16_t random16(void)
+{
+  seed ^= TCNT1;
+  if (seed == 0)
+  {
+    seed = 1;
+  }
+  seed = (seed >> 1) ^ ((seed & 1) ? 0xB400 : 0);
+  return seed;
+}
+
+// Tracks of the font are taken for their sounds, sounds that have tracks
+// already are passed over. Returns a bit per sound that got some.
+static uint8_t trackSoundsAdd(uint8_t* kinds, uint8_t font, uint8_t filled)
+{
+  uint8_t i, sound, found;
+
+  found = 0;
+  for (i = 0; i < PLAYER_MAX_TRACKS; i++)
+  {
+    sound = PLAYER_KIND_SOUND(kinds[i]);
+    if (trackUsed(i) && (PLAYER_KIND_FONT(kinds[i]) == font) && (sound < TRACK_SOUNDS) &&
+        !(filled & (1 << sound)))
+    {
+      trackSounds[i / 2] &= ~(0x0F << ((i % 2) * 4));
+      trackSounds[i / 2] |= sound << ((i % 2) * 4);
+      found |= (1 << sound);
+    }
+  }
+  return found;
+}
+
+// Kinds are read in one go. A failed read leaves the sounds for the next pick
+// to work out.
+static bool trackSoundsBuild(void)
+{
+  uint8_t kinds[PLAYER_MAX_TRACKS];
+  uint8_t i, filled;
+
+  if (!dirRead(DIR_KIND_ADDR(0), kinds, PLAYER_MAX_TRACKS))
+  {
+    return false;
+  }
+  for (i = 0; i < sizeof(trackSounds); i++)
+  {
+    trackSounds[i] = 0xFF;
+  }
+  filled = trackSoundsAdd(kinds, PlayerFont, 0);
+  if (PlayerFont != 0)
+  {
+    trackSoundsAdd(kinds, 0, filled);
+  }
+  trackSoundsStale = false;
+  return true;
+}
+
+// Track of the sound picked at random, the last one picked is left out when
+// there is another one. PLAYER_MAX_TRACKS when there is none.
+static uint8_t pickSound(uint8_t sound)
+{
+  uint8_t i, count, n, last;
+  bool skip;
+
+  if (trackSoundsStale && !trackSoundsBuild())
+  {
+    return PLAYER_MAX_TRACKS;
+  }
+  count = 0;
+  for (i = 0; i < PLAYER_MAX_TRACKS; i++)
+  {
+    if (trackSound(i) == sound)
+    {
+      count++;
+    }
+  }
+  last = lastPick[sound];
+  skip = (count > 1) && (last < PLAYER_MAX_TRACKS) && (trackSound(last) == sound);
+  if (skip)
+  {
+    count--;
+  }
+  if (count == 0)
+  {
+    return PLAYER_MAX_TRACKS;
+  }
+  n = random16() % count;
+  for (i = 0; i < PLAYER_MAX_TRACKS; i++)
+  {
+    if ((trackSound(i) == sound) && !(skip && (i == last)) && (n-- == 0))
+    {
+      break;
+    }
+  }
+  lastPick[sound] = i;
+  return i;
+}
+
+// Entry is read from the directory first, an empty track is not set up. Loop
+// points of a compressed track are taken down to a whole byte, a loop that
+// does not fit the track is left out. Everything is worked out before the
+// interrupts go off. Voice is left idle with nothing read, what it played
+// before fades out.
+static bool voiceSetup(uint8_t voice, uint8_t track)
+{
+  PlayerTrack t;
+  Voice* v;
+  uint32_t loop;
+  uint16_t loopPage, loopOffset;
+  bool loops;
+
+  if (!trackUsed(track) || !entryRead(track, &t))
+  {
+    return false;
+  }
+  // Length is kept in samples, compressed tracks hold two per byte
+  if (t.format == PLAYER_FORMAT_ADPCM)
+  {
+    t.len *= 2;
+    t.loopStart &= ~1UL;
+    t.loopEnd &= ~1UL;
+  }
+  loops = (t.loopEnd != 0) && (t.loopEnd <= t.len) && (t.loopStart < t.loopEnd);
+  loopPage = 0;
+  loopOffset = 0;
+  if (loops)
+  {
+    t.len = t.loopEnd;
+    loop = (t.format == PLAYER_FORMAT_ADPCM) ? (t.loopStart / 2) : t.loopStart;
+    loopPage = t.page + loop / DB321_PAGE_SIZE;
+    loopOffset = loop % DB321_PAGE_SIZE;
+    t.loopEnd = (t.format == PLAYER_FORMAT_ADPCM) ? (t.loopEnd / 2) : t.loopEnd;
+  }
+  else
+  {
+    t.loopStart = 0;
+    t.loopEnd = 0;
+  }
+  t.rate = (t.rate == PLAYER_FREQ_HZ) ? 0 : (uint16_t)(((uint32_t)t.rate << 16) / PLAYER_FREQ_HZ);
+  v = &voices[voice];
+  cli();
+  voiceFade(v);
+  voiceStop(voice);
+  v->page = t.page;
+  v->offset = 0;
+  v->format = t.format;
+  v->len = t.len;
+  v->loops = loops;
+  v->loopStart = t.loopStart;
+  v->loopPage = loopPage;
+  v->loopOffset = loopOffset;
+  v->loopLeft = t.loopEnd;
+  v->pos = 0;
+  v->step = t.rate;
+  v->phase = 0;
+  v->prev = 0;
+  v->cur = 0;
+  v->predictor = 0;
+  v->index = 0;
+  v->nibble = false;
+  v->peak = 0;
+  v->bufferPos = 0;
+  v->fillHalf = 0;
+  v->ready[0] = false;
+  v->ready[1] = false;
+  v->primed = TRACK_SOUNDS;
+  v->timing = false;
+  sei();
+  return true;
+}
+
+// Voice that is set up goes, called with the interrupts off
+static void voiceGo(uint8_t voice)
+{
+  Voice* v;
+
+  v = &voices[voice];
+  v->amp = 0;
+  v->stopping = false;
+  v->primed = TRACK_SOUNDS;
+  v->active = true;
+  if (!PlayerActive)
+  {
+    PlayerActive = true;
+    TIMSK1 |= (1 << TOIE1);
+  }
+  // First read is started by the next sample, the read setup would keep the
+  // interrupts off for longer than a sample when one is pending already
+  fillDue = true;
+}
+
+// Buffered starts and the sounds of the tracks may be out of date once the
+// directory or the font changes
+static void unprime(void)
+{
+  uint8_t i;
+
+  trackSoundsStale = true;
+  for (i = 0; i < PLAYER_VOICES; i++)
+  {
+    voices[i].primed = TRACK_SOUNDS;
+  }
+}
+
 /****************************************************************************
  * Interrupt handler functions                                              *
  ****************************************************************************/
 
+// Has to fit F_CPU / PLAYER_FREQ_HZ = 453 cycles per sample together with
+// the SPI refills, so the mix is plain 8x8 multiplications and no division.
+// A track at a lower rate takes its next sample when the phase wraps and is
+// interpolated between the last two on the way. Gain moves a step a sample,
+// a voice that is stopped or ends leaves its output to fade out as the tail.
+// With nothing left to play the interrupt goes off at the midpoint.
 ISR(TIMER1_OVF_vect)
 {
-  if (++PlayerTrackPos < trackLen)
+  uint8_t i, half, code, mag;
+  uint16_t phase, target, cycles;
+  bool drained, consumed, busy;
+  int8_t sample;
+  int16_t mix;
+  Voice* v;
+
+  drained = false;
+  busy = false;
+  mix = 0;
+  for (i = 0; i < PLAYER_VOICES; i++)
+  {
+    v = &voices[i];
+    if (v->active)
+    {
+      // Gain stays put until the first sample is there
+      target = v->stopping ? 0 : ((uint16_t)v->gain << 8);
+      if ((v->pos != 0) && (v->amp < target))
+      {
+        v->amp = ((target - v->amp) > FADE_STEP) ? (v->amp + FADE_STEP) : target;
+      }
+      else if ((v->pos != 0) && (v->amp > target))
+      {
+        v->amp = ((v->amp - target) > FADE_STEP) ? (v->amp - FADE_STEP) : target;
+      }
+      phase = v->phase + v->step;
+      half = v->bufferPos / PLAYER_BUFFER_HALF;
+      if (v->stopping && (v->amp == 0))
+      {
+        voiceStop(i);
+      }
+      else if ((v->step != 0) && (phase >= v->phase))
+      {
+        v->phase = phase;
+      }
+      else if (!v->ready[half])
+      {
+        // Refill is late, the sample is taken on the next pass
+        if (v->pos != 0)
+        {
+          PlayerUnderruns++;
+        }
+      }
+      else if (v->pos < v->len)
+      {
+        if (v->pos == v->loopStart)
+        {
+          v->loopPredictor = v->predictor;
+          v->loopIndex = v->index;
+        }
+        if (v->timing)
+        {
+          v->timing = false;
+          PlayerLatency = TCNT0 - v->since;
+          if (PlayerLatency > PlayerLatencyMax)
+          {
+            PlayerLatencyMax = PlayerLatency;
+          }
+        }
+        v->phase = phase;
+        v->pos++;
+        code = v->buffer[v->bufferPos];
+        if (v->format == PLAYER_FORMAT_ADPCM)
+        {
+          // Two samples per byte, the byte is consumed with the high nibble
+          consumed = v->nibble;
+          if (v->nibble)
+          {
+            code >>= 4;
+          }
+          v->nibble = !v->nibble;
+          sample = adpcmDecode(v, code & 0x0F);
+        }
+        else
+        {
+          consumed = true;
+          sample = (int8_t)(code - 0x80);
+        }
+        v->prev = v->cur;
+        v->cur = sample;
+        // Data of the loop start is in the buffer already, it is read ahead
+        if (v->loops && (v->pos == v->len))
+        {
+          v->pos = v->loopStart;
+          v->predictor = v->loopPredictor;
+          v->index = v->loopIndex;
+        }
+        mag = (sample < 0) ? (uint8_t)-sample : (uint8_t)sample;
+        if (mag > v->peak)
+        {
+          v->peak = mag;
+        }
+        if (consumed && ((++v->bufferPos % PLAYER_BUFFER_HALF) == 0))
+        {
+          if (v->bufferPos == PLAYER_BUFFER_SIZE)
+          {
+            v->bufferPos = 0;
+          }
+          v->ready[half] = false;
+          drained = true;
+        }
+      }
+      else
+      {
+        voiceFade(v);
+        voiceStop(i);
+      }
+      if (v->active)
+      {
+        sample = v->prev + (((int16_t)(v->cur - v->prev) * (uint8_t)(v->phase >> 9)) >> 7);
+        v->level = ((int16_t)sample * (uint8_t)(v->amp >> 8)) >> 8;
+        mix += v->level;
+        busy = true;
+      }
+    }
+    if (v->fade != 0)
+    {
+      mix += ((int16_t)v->tail * (uint8_t)(v->fade >> 8)) >> 8;
+      v->fade = (v->fade > FADE_STEP) ? (v->fade - FADE_STEP) : 0;
+      busy = true;
+    }
+  }
+  if (drained || fillDue)
   {
-    OCR1AL = sound;
-    DataflashReadContiniousNext();
+    refill();
   }
-  else
+  if (!busy)
+  {
+    TIMSK1 &= ~(1 << TOIE1);
+    PlayerActive = false;
+  }
+  if (mix > INT8_MAX)
+  {
+    mix = INT8_MAX;
+  }
+  if (mix < INT8_MIN)
   {
-    PlayerStop();
+    mix = INT8_MIN;
+  }
+  // Volume and limit changes are ramped like the gains, a count a sample
+  if (outScale < outTarget)
+  {
+    outScale++;
+  }
+  else if (outScale > outTarget)
+  {
+    outScale--;
+  }
+  OCR1A = outMid + (((int16_t)(int8_t)mix * outScale) >> 7);
+  // The counter starts over with the sample, an overflow flagged again
+  // means the interrupt took longer than the whole period
+  cycles = TCNT1;
+  if (TIFR1 & (1 << TOV1))
+  {
+    cycles += PlayerMaxValue + 1;
+  }
+  if (cycles > PlayerCyclesMax)
+  {
+    PlayerCyclesMax = cycles;
   }
 }
 
+// Full volume takes the mix over the whole PWM range
+static void setScale(void)
+{
+  outTarget = (uint8_t)((uint32_t)outMid * volume * limit / ((uint16_t)PLAYER_GAIN_MAX * PLAYER_GAIN_MAX));
+}
+
 /****************************************************************************
  * Public functions                                                         *
  ****************************************************************************/
@@ -60,67 +823,395 @@ ISR(TIMER1_OVF_vect)
 void PlayerInit(void)
 {
   uint32_t icr;
-  uint8_t div;
+  uint16_t out;
+  uint8_t div, i;
   
   TCCR1A = 0x00;
   TCCR1B = 0x00;
   OCR1A = 0x00;
   div = 0;
   do {
-    icr = F_CPU / (PLAYER_FREQ_HZ * prescale1[++div]) - 1;
+    icr = F_CPU / (PLAYER_FREQ_HZ * pgm_read_word(&prescale1[++div])) - 1;
   } while (icr > UINT16_MAX);
   div1 = div;
   ICR1 = (uint16_t)icr;
   PlayerMaxValue = ICR1;
+  outMid = (PlayerMaxValue + 1) / 2;
+  volume = eeprom_read_byte(&volumeMem);
+  setScale();
+  outScale = outTarget;
   TCCR1A = (1 << WGM11) | (0 << WGM10);
   TCCR1B = (1 << WGM13) | (1 << WGM12);
   DDRB |= (1 << DDB1);
+  for (i = 0; i < PLAYER_VOICES; i++)
+  {
+    voices[i].active = false;
+    voices[i].gain = PLAYER_GAIN_MAX;
+    voices[i].fade = 0;
+    voices[i].primed = TRACK_SOUNDS;
+  }
+  // Step up to the midpoint would thump through the amplifier
+  timerStart();
+  for (out = 0; out < outMid; out++)
+  {
+    OCR1A = out;
+    _delay_us(BIAS_STEP_US);
+  }
+  OCR1A = outMid;
 }
 
-void PlayerLoadMem(void)
+// Only the bits of the tracks with data are kept, an entry is read from the
+// flash when it is needed. A chip without the directory gets an empty one.
+// Font chosen last comes back from the EEPROM.
+void PlayerLoadDir(void)
 {
-  cli();
-  eeprom_read_block(PlayerTracksAddr, tracksAddrMem, sizeof(uint32_t) * PLAYER_MAX_TRACKS);
-  eeprom_read_block(PlayerTracksLen, tracksLenMem, sizeof(uint32_t) * PLAYER_MAX_TRACKS);
-  sei();
+  DirHeader h;
+  PlayerTrack t;
+  uint8_t i;
+
+  PlayerFont = eeprom_read_byte(&fontMem);
+  if (PlayerFont >= PLAYER_MAX_FONTS)
+  {
+    PlayerFont = 0;
+  }
+  for (i = 0; i < TRACK_SOUNDS; i++)
+  {
+    lastPick[i] = PLAYER_MAX_TRACKS;
+  }
+  unprime();
+  for (i = 0; i < sizeof(tracksUsed); i++)
+  {
+    tracksUsed[i] = 0;
+  }
+  if (!DataflashRead((uint32_t)DIR_PAGE * DB321_PAGE_SIZE, (uint8_t*)&h, sizeof(h)))
+  {
+    return;
+  }
+  if ((h.magic != DIR_MAGIC) || (h.version != DIR_VERSION) || (h.tracks != PLAYER_MAX_TRACKS))
+  {
+    dirFormat();
+    return;
+  }
+  for (i = 0; i < PLAYER_MAX_TRACKS; i++)
+  {
+    if (entryRead(i, &t) && entryValid(i, &t))
+    {
+      tracksUsed[i / 8] |= (1 << (i % 8));
+    }
+  }
+}
+
+// Empty track comes back with no length
+bool PlayerReadTrack(uint8_t track, PlayerTrack* t)
+{
+  assert(track < PLAYER_MAX_TRACKS);
+  if (!entryRead(track, t))
+  {
+    return false;
+  }
+  if (!trackUsed(track) || !entryValid(track, t))
+  {
+    t->len = 0;
+  }
+  return true;
+}
+
+// Entry is programmed at once, the page around it is kept
+bool PlayerWriteTrack(uint8_t track, PlayerTrack* t)
+{
+  assert(track < PLAYER_MAX_TRACKS);
+  t->id = track;
+  unprime();
+  if (!dirWrite(DIR_ENTRY_ADDR(track), (uint8_t*)t, sizeof(PlayerTrack)))
+  {
+    return false;
+  }
+  if (entryValid(track, t))
+  {
+    tracksUsed[track / 8] |= (1 << (track % 8));
+  }
+  else
+  {
+    tracksUsed[track / 8] &= ~(1 << (track % 8));
+  }
+  return true;
+}
+
+// Track keeps its place when the new length fits there, otherwise it goes to
+// the start of the flash or behind another track, wherever there is room.
+// Entry comes back with the page and no length, it is not written. The other
+// entries are read into it on the way. Returns false when the flash has no gap
+// big enough.
+bool PlayerPlaceTrack(uint8_t track, uint32_t len, PlayerTrack* t)
+{
+  uint16_t pages, page;
+  uint8_t c, i;
+  bool found;
+
+  assert(track < PLAYER_MAX_TRACKS);
+  if ((len > DB321_SIZE) || !entryRead(track, t))
+  {
+    return false;
+  }
+  pages = trackPages(len);
+  page = ((t->id == track) && (t->page < DIR_PAGE)) ? t->page : 0;
+  found = false;
+  // Places tried: its own, the start of the flash, then behind each track
+  for (c = 0; !found && (c < (PLAYER_MAX_TRACKS + 2)); c++)
+  {
+    if (c == 1)
+    {
+      page = 0;
+    }
+    else if (c > 1)
+    {
+      if (((c - 2) == track) || !trackUsed(c - 2) || !entryRead(c - 2, t))
+      {
+        continue;
+      }
+      page = t->page + trackPages(t->len);
+    }
+    // Entry that cannot be read is taken as in the way
+    found = (((uint32_t)page + pages) <= DIR_PAGE);
+    for (i = 0; found && (i < PLAYER_MAX_TRACKS); i++)
+    {
+      found = (i == track) || !trackUsed(i) ||
+              (entryRead(i, t) && ((page >= (t->page + trackPages(t->len))) || ((page + pages) <= t->page)));
+    }
+  }
+  if (!found)
+  {
+    return false;
+  }
+  t->len = 0;
+  t->loopStart = 0;
+  t->loopEnd = 0;
+  t->page = page;
+  t->rate = PLAYER_FREQ_HZ;
+  t->crc = 0;
+  return true;
+}
+
+bool PlayerReadKind(uint8_t track, uint8_t* kind)
+{
+  assert(track < PLAYER_MAX_TRACKS);
+  return dirRead(DIR_KIND_ADDR(track), kind, 1);
+}
+
+bool PlayerWriteKind(uint8_t track, uint8_t kind)
+{
+  assert(track < PLAYER_MAX_TRACKS);
+  unprime();
+  return dirWrite(DIR_KIND_ADDR(track), &kind, 1);
+}
+
+// Switching is only a new kind to look for, the choice is kept in the EEPROM.
+// A byte that changes takes 3.4 ms to write, the interrupts stay on meanwhile
+// as the library keeps the write sequence atomic itself.
+void PlayerSetFont(uint8_t font)
+{
+  assert(font < PLAYER_MAX_FONTS);
+  PlayerFont = font;
+  unprime();
+  eeprom_update_byte(&fontMem, font);
+}
+
+// Volume is kept in the EEPROM, an erased one gives the full volume. Only a
+// new value is written, the sound goes on during the write.
+void PlayerSetVolume(uint8_t vol)
+{
+  volume = vol;
+  setScale();
+  eeprom_update_byte(&volumeMem, vol);
+}
+
+// Battery holds the volume down to limit out of PLAYER_GAIN_MAX
+void PlayerSetLimit(uint8_t lim)
+{
+  limit = lim;
+  setScale();
+}
+
+// Fonts without tracks are passed over, the last one wraps to the first
+void PlayerNextFont(void)
+{
+  uint8_t kinds[PLAYER_MAX_TRACKS];
+  uint8_t i, font, first, next;
+
+  if (!dirRead(DIR_KIND_ADDR(0), kinds, PLAYER_MAX_TRACKS))
+  {
+    return;
+  }
+  first = PLAYER_MAX_FONTS;
+  next = PLAYER_MAX_FONTS;
+  for (i = 0; i < PLAYER_MAX_TRACKS; i++)
+  {
+    if (trackUsed(i) && (kinds[i] != PLAYER_KIND_NONE))
+    {
+      font = PLAYER_KIND_FONT(kinds[i]);
+      if (font < first)
+      {
+        first = font;
+      }
+      if ((font > PlayerFont) && (font < next))
+      {
+        next = font;
+      }
+    }
+  }
+  if (next == PLAYER_MAX_FONTS)
+  {
+    next = first;
+  }
+  if ((next != PLAYER_MAX_FONTS) && (next != PlayerFont))
+  {
+    PlayerSetFont(next);
+  }
+}
+
+// Track fades in, what the voice played before fades out at the same time
+void PlayerStart(uint8_t voice, uint8_t track)
+{
+  assert(voice < PLAYER_VOICES);
+  assert(track < PLAYER_MAX_TRACKS);
+  if (voiceSetup(voice, track))
+  {
+    cli();
+    voiceGo(voice);
+    sei();
+  }
 }
 
-void PlayerSaveMem(void)
+// Sound primed on the voice starts from its buffer at once, any other one is
+// picked and read from the flash first. Time from the Timer0 count the event
+// was seen at up to the first sample is kept in PlayerLatency.
+void PlayerStartSound(uint8_t voice, uint8_t sound, uint8_t since)
 {
+  Voice* v;
+  uint8_t track;
+
+  assert(voice < PLAYER_VOICES);
+  assert(sound < TRACK_SOUNDS);
+  v = &voices[voice];
+  if ((v->primed != sound) || !v->ready[0])
+  {
+    track = pickSound(sound);
+    if ((track == PLAYER_MAX_TRACKS) || !voiceSetup(voice, track))
+    {
+      return;
+    }
+  }
   cli();
-  eeprom_update_block(PlayerTracksAddr, tracksAddrMem, sizeof(uint32_t) * PLAYER_MAX_TRACKS);
-  eeprom_update_block(PlayerTracksLen, tracksLenMem, sizeof(uint32_t) * PLAYER_MAX_TRACKS);
+  v->since = since;
+  v->timing = true;
+  voiceGo(voice);
   sei();
 }
 
-void PlayerStart(uint8_t track)
-{ 
-  assert(track < PLAYER_MAX_TRACKS);
-  if (PlayerTracksLen[track] != 0)
+// Next track of the sound is picked and its first buffer read while the voice
+// is idle. A sound that can not be primed is not tried again before the
+// directory or the font changes, a read that found the bus taken is tried
+// again on the next call.
+void PlayerPrime(uint8_t voice, uint8_t sound)
+{
+  Voice* v;
+  uint8_t track, i;
+  bool ok;
+
+  assert(voice < PLAYER_VOICES);
+  assert(sound < TRACK_SOUNDS);
+  v = &voices[voice];
+  if (v->active || (v->primed == sound))
+  {
+    return;
+  }
+  track = pickSound(sound);
+  // Loop that ends within the buffer is left to the refills
+  ok = (track < PLAYER_MAX_TRACKS) && voiceSetup(voice, track) &&
+       (!v->loops || (v->loopLeft >= PLAYER_BUFFER_SIZE));
+  v->primed = sound;
+  v->ready[0] = false;
+  // Halves are read one by one, a refill of the other voice fits in between.
+  // Bus that stays taken leaves the voice to be primed again.
+  for (i = 0; ok && (i < 2); i++)
   {
-    if (PlayerActive)
+    if (!dirRead((uint32_t)v->page * DB321_PAGE_SIZE + v->offset, &v->buffer[i * PLAYER_BUFFER_HALF],
+                 PLAYER_BUFFER_HALF))
     {
-      PlayerStop();
+      v->primed = TRACK_SOUNDS;
+      return;
     }
-    PlayerActive = true;
-    DataflashReadContinious(PlayerTracksAddr[track], &sound);
-    trackLen = PlayerTracksLen[track];
-    PlayerTrackPos = 0;
-    OCR1AL = sound;
-    DataflashReadContiniousNext();
-    TCCR1A |= (1 << COM1A1) | (0 << COM1A0);
-    TCCR1B |= (((div1 >> 2) & 1) << CS12) | (((div1 >> 1) & 1) << CS11) | (((div1 >> 0) & 1) << CS10);
-    TCNT1 = 0;
-    TIMSK1 |= (1 << TOIE1);
+    voiceAdvance(v, PLAYER_BUFFER_HALF);
   }
+  v->ready[0] = ok;
+  v->ready[1] = ok;
 }
 
-void PlayerStop(void)
+// Voice fades out first, it is active until it is silent
+void PlayerStop(uint8_t voice)
 {
-  TIMSK1 &= ~(1 << TOIE1);
-  TCCR1A &= ~((1 << COM1A1) | (1 << COM1A0));
-  TCCR1B &= ~((1 << CS12) | (1 << CS11) | (1 << CS10));
-  PORTB &= ~(1 << PB1);
-  DataflashReadContiniousStop();
-  PlayerActive = false;
+  assert(voice < PLAYER_VOICES);
+  voices[voice].stopping = true;
+}
+
+void PlayerStopAll(void)
+{
+  uint8_t i;
+
+  for (i = 0; i < PLAYER_VOICES; i++)
+  {
+    PlayerStop(i);
+  }
+}
+
+void PlayerSetGain(uint8_t voice, uint8_t gain)
+{
+  assert(voice < PLAYER_VOICES);
+  voices[voice].gain = gain;
+}
+
+bool PlayerVoiceActive(uint8_t voice)
+{
+  bool active;
+
+  assert(voice < PLAYER_VOICES);
+  cli();
+  active = voices[voice].active;
+  sei();
+  return active;
+}
+
+uint32_t PlayerVoiceLen(uint8_t voice)
+{
+  uint32_t len;
+
+  assert(voice < PLAYER_VOICES);
+  cli();
+  len = voices[voice].len;
+  sei();
+  return len;
+}
+
+uint32_t PlayerVoicePos(uint8_t voice)
+{
+  uint32_t pos;
+
+  assert(voice < PLAYER_VOICES);
+  cli();
+  pos = voices[voice].pos;
+  sei();
+  return pos;
+}
+
+// Reading starts the next measurement, 128 is full scale
+uint8_t PlayerVoicePeak(uint8_t voice)
+{
+  uint8_t peak;
+
+  assert(voice < PLAYER_VOICES);
+  cli();
+  peak = voices[voice].peak;
+  voices[voice].peak = 0;
+  sei();
+  return peak;
 }
@@ -6,19 +6,68 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
-#define PLAYER_MAX_TRACKS  6
-#define PLAYER_FREQ_HZ     44100
+#define PLAYER_MAX_TRACKS  24
+#define PLAYER_FREQ_HZ     44100  // Output rate, tracks may have a lower one
+#define PLAYER_RATE_MIN    4000
+
+#define PLAYER_FORMAT_PCM8  0  // Unsigned 8-bit samples
+#define PLAYER_FORMAT_ADPCM 1  // 4-bit IMA ADPCM, low nibble first
+
+// Track is one of the TRACK_* sounds of a font, a sound may have several
+// tracks in the same font to pick from
+#define PLAYER_MAX_FONTS  16
+#define PLAYER_KIND(font, sound)  (((font) << 4) | (sound))
+#define PLAYER_KIND_FONT(kind)    ((kind) >> 4)
+#define PLAYER_KIND_SOUND(kind)   ((kind) & 0x0F)
+#define PLAYER_KIND_NONE  0xFF  // Track is in no font
+
+#define PLAYER_VOICES    2
+#define PLAYER_GAIN_MAX  255
+#define PLAYER_FADE_SAMPLES  128  // Starts, stops and gain changes are ramped over this
+
+#define PLAYER_BUFFER_SIZE  64
+#define PLAYER_BUFFER_HALF  (PLAYER_BUFFER_SIZE / 2)
+
+// Track directory entry as it is kept in the flash
+typedef struct {
+  uint32_t len;  // Bytes, zero for an empty track
+  uint32_t loopStart;  // Samples
+  uint32_t loopEnd;  // Samples, zero when the track does not loop
+  uint16_t page;  // First flash page, tracks start on a page
+  uint16_t rate;  // Sample rate, Hz
+  uint16_t crc;  // Over the data, worked out like the packet crc
+  uint8_t format;
+  uint8_t id;  // Track the entry belongs to
+} PlayerTrack;
 
 extern volatile bool PlayerActive;
-extern uint32_t PlayerTracksAddr[PLAYER_MAX_TRACKS];
-extern uint32_t PlayerTracksLen[PLAYER_MAX_TRACKS];
-extern volatile uint32_t PlayerTrackPos;
 extern uint16_t PlayerMaxValue;
+extern volatile uint16_t PlayerUnderruns;
+extern volatile uint8_t PlayerLatency;  // Timer0 counts from the event to the first sample, wraps at 13 ms
+extern volatile uint8_t PlayerLatencyMax;
+extern volatile uint16_t PlayerCyclesMax;  // Longest sample interrupt, timer1 ticks from the overflow
+extern uint8_t PlayerFont;
 
 void PlayerInit(void);
-void PlayerLoadMem(void);
-void PlayerSaveMem(void);
-void PlayerStart(uint8_t track);
-void PlayerStop(void);
+void PlayerLoadDir(void);
+bool PlayerReadTrack(uint8_t track, PlayerTrack* t);
+bool PlayerWriteTrack(uint8_t track, PlayerTrack* t);
+bool PlayerPlaceTrack(uint8_t track, uint32_t len, PlayerTrack* t);
+bool PlayerReadKind(uint8_t track, uint8_t* kind);
+bool PlayerWriteKind(uint8_t track, uint8_t kind);
+void PlayerSetFont(uint8_t font);
+void PlayerNextFont(void);
+void PlayerSetVolume(uint8_t vol);
+void PlayerSetLimit(uint8_t lim);
+void PlayerStart(uint8_t voice, uint8_t track);
+void PlayerStartSound(uint8_t voice, uint8_t sound, uint8_t since);
+void PlayerPrime(uint8_t voice, uint8_t sound);
+void PlayerStop(uint8_t voice);
+void PlayerStopAll(void);
+void PlayerSetGain(uint8_t voice, uint8_t gain);
+bool PlayerVoiceActive(uint8_t voice);
+uint32_t PlayerVoiceLen(uint8_t voice);
+uint32_t PlayerVoicePos(uint8_t voice);
+uint8_t PlayerVoicePeak(uint8_t voice);
 
 #endif // __PLAYER_H_
@@ -0,0 +1,102 @@
+#include "scheduler.h"
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <assert.h>
+
+/****************************************************************************
+ * Private types/enumerations/variables                                     *
+ ****************************************************************************/
+
+typedef struct {
+  SchedulerTask task;
+  uint16_t period;  // Ticks, zero runs the task on every pass
+  uint16_t next;
+} Task;
+
+static Task tasks[SCHEDULER_MAX_TASKS];
+static uint8_t tasksCount = 0;
+static volatile uint16_t ticks = 0;
+
+/****************************************************************************
+ * Interrupt handler functions                                              *
+ ****************************************************************************/
+
+ISR(TIMER0_COMPA_vect)
+{
+  OCR0A += SCHEDULER_TICK_COUNTS;
+  ticks++;
+}
+
+/****************************************************************************
+ * Public functions                                                         *
+ ****************************************************************************/
+
+void SchedulerInit(void)
+{
+  tasksCount = 0;
+  OCR0A = TCNT0 + SCHEDULER_TICK_COUNTS;
+  TIFR0 = (1 << OCF0A);
+  TIMSK0 |= (1 << OCIE0A);
+  set_sleep_mode(SLEEP_MODE_IDLE);
+}
+
+// Tasks run in the order they are added
+void SchedulerAdd(SchedulerTask task, uint16_t period)
+{
+  assert(tasksCount < SCHEDULER_MAX_TASKS);
+  tasks[tasksCount].task = task;
+  tasks[tasksCount].period = period;
+  tasks[tasksCount].next = SchedulerTicks() + period;
+  tasksCount++;
+}
+
+uint16_t SchedulerTicks(void)
+{
+  uint16_t now;
+
+  cli();
+  now = ticks;
+  sei();
+  return now;
+}
+
+// Every pass runs the tasks that are due and then sleeps until an interrupt.
+// The tick wakes the CPU at least once per SCHEDULER_TICK_US, so that is the
+// longest a task waits for an event flagged by an interrupt.
+void SchedulerRun(void)
+{
+  uint8_t i;
+  uint16_t now;
+  Task* t;
+
+  while (1)
+  {
+    now = SchedulerTicks();
+    for (i = 0; i < tasksCount; i++)
+    {
+      t = &tasks[i];
+      if (t->period == 0)
+      {
+        t->task();
+      }
+      else if ((int16_t)(now - t->next) >= 0)
+      {
+        // A task that fell behind is not run twice to catch up
+        t->next += t->period;
+        if ((int16_t)(now - t->next) >= 0)
+        {
+          t->next = now + t->period;
+        }
+        t->task();
+      }
+    }
+    // Interrupt that comes between sei and sleep still wakes the CPU up
+    cli();
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+  }
+}
@@ -0,0 +1,24 @@
+#ifndef __SCHEDULER_H_
+#define __SCHEDULER_H_
+
+#include "dataflash_at45db321b.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+// Tick comes from the compare unit of Timer0, the timer itself runs free for
+// the dataflash driver and is set up by DataflashInit()
+#define SCHEDULER_TICK_COUNTS  20
+#define SCHEDULER_TICK_US      ((uint32_t)SCHEDULER_TICK_COUNTS * DB321_TIMER_PRESCALE * 1000 / (F_CPU / 1000))
+#define SCHEDULER_MS(ms)       ((uint16_t)((uint32_t)(ms) * 1000 / SCHEDULER_TICK_US))
+
+#define SCHEDULER_MAX_TASKS  6
+
+typedef void (*SchedulerTask)(void);
+
+void SchedulerInit(void);
+void SchedulerAdd(SchedulerTask task, uint16_t period);
+uint16_t SchedulerTicks(void);
+void SchedulerRun(void);
+
+#endif // __SCHEDULER_H_
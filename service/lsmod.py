@@ -1,7 +1,7 @@
 import sys
 import serial
 import serial.tools.list_ports
-import wave, struct
+import wave, struct, binascii
 import numpy as np
 from PyQt5.QtWidgets import QApplication, QMainWindow, QPushButton, QButtonGroup, QAction, QActionGroup, QMessageBox, QFileDialog
 from PyQt5.QtGui import QPalette, QFont
@@ -20,27 +20,145 @@ LedColors = {'#d3d3d3' : 0x778899, '#0000ff' : 0x191970, '#add8e6' : 0x4682b4, \
              '#008000' : 0x006400, '#800080' : 0x9400d3, '#40e0d0' : 0x228b22}
 
 LSMOD_BAUDRATE = 115200
+LSMOD_BAUDRATE_FAST = 500000
+LSMOD_BAUD_TIMEOUT_MS = 500
 
 LSMOD_PACKET_HDR = 0xDA
 LSMOD_PACKET_MSK = 0xB0
 LSMOD_PACKET_END = 0xBA
 
-LSMOD_SRV_LEN      =   6
+LSMOD_SRV_LEN      =   7
+LSMOD_CRC_LEN      =   2
+LSMOD_CRC_INIT     = 0xFFFF
+LSMOD_DATA_SEQ_LEN =   1
 LSMOD_DATA_IDX_LEN =   4
-LSMOD_DATA_MAX_LEN = 262
-LSMOD_STAT_MAX_LEN =   6
+LSMOD_DATA_MAX_LEN = 134
+LSMOD_PAGE_HDR_LEN =   5
+LSMOD_STAT_MAX_LEN =  25
+LSMOD_TELEMETRY_LEN = 11
+LSMOD_READ_MAX_LEN = 64
+LSMOD_PAGE_CRC_MAX = 16
+
+LSMOD_LOAD_WINDOW = 2
+
+DB321_PAGE_ERASE_PGM_T_MS = 20
+DB321_PAGE_SIZE = 528
+
+LSMOD_AUDIO_CYCLES = 453  # F_CPU / 44100 Hz a sample
+
+LSMOD_TELEMETRY_TICK_MS = 1.024
+LSMOD_EVENTS = ['activated', 'hit', 'swing', 'clash', 'sensor']
 
 LSMOD_CONTROL_PING       = 0x00
 LSMOD_CONTROL_STAT       = 0x01
 LSMOD_CONTROL_COLOR      = 0x02
+LSMOD_CONTROL_TELEMETRY  = 0x03
+LSMOD_CONTROL_BAUD       = 0x04
+LSMOD_CONTROL_CRC        = 0x05
+LSMOD_CONTROL_READ       = 0x06
+LSMOD_CONTROL_PAGE_CRC   = 0x07
+LSMOD_CONTROL_TRACK      = 0x08
 LSMOD_CONTROL_LOAD_BEGIN = 0x10
 LSMOD_CONTROL_LOAD       = 0x11
 LSMOD_CONTROL_LOAD_END   = 0x12
+LSMOD_CONTROL_LOAD_PAGE  = 0x13
 
 LSMOD_REPLY_ERROR  = 0x00
 LSMOD_REPLY_ACK    = 0x01
 LSMOD_REPLY_LOADED = 0x02
 LSMOD_REPLY_STAT   = 0x03
+LSMOD_REPLY_TELEMETRY = 0x04
+LSMOD_REPLY_NAK    = 0x05
+LSMOD_REPLY_CRC    = 0x06
+LSMOD_REPLY_READ   = 0x07
+LSMOD_REPLY_PAGE_CRC = 0x08
+LSMOD_REPLY_TRACK  = 0x09
+
+PLAYER_FORMAT_PCM8  = 0
+PLAYER_FORMAT_ADPCM = 1
+
+PLAYER_FREQ_HZ  = 44100
+PLAYER_RATE_MIN = 4000
+
+# Rates in the order of comboBoxRate, None keeps the rate of the file
+LOAD_RATES = [None, 44100, 22050, 16000]
+
+TRACK_HUM = 1
+
+ADPCM_STEP = [7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, \
+              50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, \
+              253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, \
+              1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, \
+              3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, \
+              11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, \
+              32767]
+ADPCM_INDEX = [-1, -1, -1, -1, 2, 4, 6, 8]
+
+def adpcmEncode(samples):
+    # Mirrors the decoder in player.c, two codes per byte, low nibble first
+    predictor = 0
+    index = 0
+    codes = []
+    for sample in samples:
+        step = ADPCM_STEP[index]
+        delta = int(sample) - predictor
+        code = 0
+        if delta < 0:
+            code = 8
+            delta = -delta
+        diff = step >> 3
+        if delta >= step:
+            code |= 4
+            delta -= step
+            diff += step
+        if delta >= (step >> 1):
+            code |= 2
+            delta -= step >> 1
+            diff += step >> 1
+        if delta >= (step >> 2):
+            code |= 1
+            diff += step >> 2
+        if code & 8:
+            predictor = max(predictor - diff, -0x8000)
+        else:
+            predictor = min(predictor + diff, 0x7FFF)
+        index = min(max(index + ADPCM_INDEX[code & 7], 0), len(ADPCM_STEP) - 1)
+        codes.append(code)
+    if len(codes) % 2:
+        codes.append(0)
+    return [codes[i] | (codes[i + 1] << 4) for i in range(0, len(codes), 2)]
+
+# Band-limited resampling with a Kaiser windowed sinc. Cutoff sits a little
+# below the lower of the two Nyquist frequencies, so nothing folds back.
+def resample(samples, src, dst, zeros = 16, beta = 8.6):
+    samples = np.asarray(samples, dtype = np.float64)
+    n = len(samples) * dst // src
+    cutoff = 0.92 * min(1.0, float(dst) / src)
+    half = int(np.ceil(zeros / cutoff))
+    t = np.arange(n) * (float(src) / dst)
+    base = np.floor(t).astype(np.int64)
+    out = np.zeros(n)
+    for k in range(1 - half, half + 1):
+        idx = base + k
+        x = idx - t
+        w = cutoff * np.sinc(cutoff * x) * np.i0(beta * np.sqrt(np.clip(1.0 - (x / half) ** 2, 0.0, 1.0))) / np.i0(beta)
+        valid = (idx >= 0) & (idx < len(samples))
+        out += np.where(valid, samples[np.clip(idx, 0, len(samples) - 1)], 0.0) * w
+    return out
+
+# First loop of the sampler chunk as start and end, the end is one past the
+# last sample. None when the file has no loop.
+def wavLoop(name):
+    with open(str(name), 'rb') as f:
+        data = f.read()
+    pos = 12
+    while pos + 8 <= len(data):
+        (chunk, size) = struct.unpack_from('<4sI', data, pos)
+        if (chunk == b'smpl') and (size >= 36 + 24) and (struct.unpack_from('<I', data, pos + 8 + 28)[0] > 0):
+            (start, end) = struct.unpack_from('<II', data, pos + 8 + 36 + 8)
+            return (start, end + 1) if start <= end else None
+        pos = pos + 8 + size + (size & 1)
+    return None
 
 class MainWindow(QMainWindow):
     ui = Ui_Lsmod()
@@ -49,6 +167,17 @@ class MainWindow(QMainWindow):
     timPeriodMs = 10
     get = QTimer()
     getPeriodMs = 100
+    underruns = 0
+    programTime = 0
+    latency = (0, 0)
+    linkErrors = (0, 0, 0)
+    audioCycles = 0
+    rxBuffer = bytearray()
+    telemetryPeriodMs = 10
+    telemetryFile = None
+    telemetryFrames = 0
+    telemetryTicks = 0
+    telemetryStamp = 0
     triggerTestStatus = 0
     turnOnFile = str()
     turnOn = QMediaPlayer()
@@ -72,7 +201,26 @@ class MainWindow(QMainWindow):
     loadContinue = pyqtSignal()
     loadRepeat = QTimer()
     loadRepeatPeriodMs = 100
+    loadInFlight = []
+    loadResent = 0
     loadEnd = pyqtSignal()
+    loadStep = None
+    loadFormat = 0
+    loadRate = PLAYER_FREQ_HZ
+    loadLoop = None
+    loadOld = (0, 0, 0, 0, 0, 0, 0, 0)
+    loadCrcs = []
+    loadPages = []
+    askTimer = QTimer()
+    askPacket = None
+    verifyTracks = []
+    verifyIdx = 0
+    verifyAddr = None
+    verifyPos = -1
+    verifyDiffer = 0
+    verifyFirst = 0
+    baudTimer = QTimer()
+    baudNext = LSMOD_BAUDRATE
     pushButtonColorsGroup = QButtonGroup()
     pushButtonColors = {}
     
@@ -100,8 +248,12 @@ class MainWindow(QMainWindow):
         self.ui.textEdit.setReadOnly(True)
         self.loadActivated.connect(self.loadSamples)
         self.loadContinue.connect(self.loadSamples)
-        self.loadRepeat.timeout.connect(self.loadSamples)
+        self.loadRepeat.timeout.connect(self.repeatSamples)
         self.loadEnd.connect(self.endLoad)
+        self.askTimer.setSingleShot(True)
+        self.askTimer.timeout.connect(self.askAgain)
+        self.baudTimer.setSingleShot(True)
+        self.baudTimer.timeout.connect(self.baudFailed)
         assert(np.sqrt(len(LedColors)) % 1 == 0)
         for i in range(int(np.sqrt(len(LedColors)))):
             for j in range(int(np.sqrt(len(LedColors)))):
@@ -132,8 +284,7 @@ class MainWindow(QMainWindow):
     def closeEvent(self, event):
         choice = QMessageBox.question(self, 'Exit', 'Are you sure?', QMessageBox.Yes | QMessageBox.No)
         if choice == QMessageBox.Yes:
-            if self.ser.isOpen():
-                self.ser.close()
+            self.closePort()
             event.accept()
         else:
             event.ignore()
@@ -141,35 +292,34 @@ class MainWindow(QMainWindow):
     def sendPacket(self, cmd, data = []):
         if self.ser.isOpen():
             packet = bytearray()
-            crc = 0
             packet.append(LSMOD_PACKET_HDR)
-            crc = crc + LSMOD_PACKET_HDR
             packet.append(LSMOD_ADDR)
-            crc = crc + LSMOD_ADDR
             packet.append(PC_ADDR)
-            crc = crc + PC_ADDR
             packet.append(cmd)
-            crc = crc + cmd
-            if (len(data) > 0):
-                for i in range (0, len(data)):
-                    if (data[i] == LSMOD_PACKET_HDR) or (data[i] == LSMOD_PACKET_MSK) or (data[i] == LSMOD_PACKET_END):
-                        packet.append(LSMOD_PACKET_MSK)
-                        packet.append(0xFF - data[i])
-                    else:
-                        packet.append(data[i])
-                    crc = crc + data[i]
-            crc = crc & 0xFF
-            if (crc == LSMOD_PACKET_HDR) or (crc == LSMOD_PACKET_MSK) or (crc == LSMOD_PACKET_END):
-                packet.append(LSMOD_PACKET_MSK)
-                packet.append(0xFF - crc)
-            else:
-                packet.append(crc)
+            crc = binascii.crc_hqx(bytes(packet), LSMOD_CRC_INIT)
+            crc = binascii.crc_hqx(bytes(data), crc)
+            for byte in list(data) + [crc >> 8, crc & 0xFF]:
+                if (byte == LSMOD_PACKET_HDR) or (byte == LSMOD_PACKET_MSK) or (byte == LSMOD_PACKET_END):
+                    packet.append(LSMOD_PACKET_MSK)
+                    packet.append(0xFF - byte)
+                else:
+                    packet.append(byte)
             packet.append(LSMOD_PACKET_END)
             print(' '.join('0x{:02X}'.format(x) for x in packet))
             self.ser.write(packet)
         else:
             self.ui.textEdit.append('Port not open')
 
+    # Request is repeated until its reply comes
+    def ask(self, cmd, data, timeoutMs = 500):
+        self.askPacket = (cmd, data, timeoutMs)
+        self.askAgain()
+
+    def askAgain(self):
+        (cmd, data, timeoutMs) = self.askPacket
+        self.sendPacket(cmd, data)
+        self.askTimer.start(timeoutMs)
+
     def getStat(self):
         self.sendPacket(LSMOD_CONTROL_STAT)
         
@@ -321,40 +471,46 @@ class MainWindow(QMainWindow):
             self.ui.textEdit.append('Set color #%06X' % num)
             self.sendPacket(LSMOD_CONTROL_COLOR, [((num >> 16) & 0xFF), ((num >> 8) & 0xFF), num & 0xFF])
 
+    # Tracks go independently, a missing file leaves its track as it is
     def pickFile(self):
-        if (self.trackIdx == 0) and QFile.exists(self.turnOnFile):
-            self.loadedFile = self.turnOnFile
-            self.startLoad()
-        elif (self.trackIdx == 1) and QFile.exists(self.humFile):
-            self.loadedFile = self.humFile
-            self.startLoad()
-        elif (self.trackIdx == 2) and QFile.exists(self.swingFile):
-            self.loadedFile = self.swingFile
-            self.startLoad()
-        elif (self.trackIdx == 3) and QFile.exists(self.hitFile):
-            self.loadedFile = self.hitFile
-            self.startLoad()
-        elif (self.trackIdx == 4) and QFile.exists(self.clashFile):
-            self.loadedFile = self.clashFile
-            self.startLoad()
-        elif (self.trackIdx == 5) and QFile.exists(self.turnOffFile):
-            self.loadedFile = self.turnOffFile
+        while (self.trackIdx < MAX_TRACKS) and not QFile.exists(self.trackFile(self.trackIdx)):
+            self.trackIdx = self.trackIdx + 1
+        if self.trackIdx < MAX_TRACKS:
+            self.loadedFile = self.trackFile(self.trackIdx)
             self.startLoad()
         else:
-            self.ui.textEdit.append('No file')
+            self.ui.textEdit.append('All files loaded')
+            self.ui.progressBar.setValue(self.ui.progressBar.minimum())
+            self.on_pushButtonVerify_released()
 
-    def startLoad(self):
-        self.ui.textEdit.append('Loading %s' % QFileInfo(self.loadedFile).fileName())
-        wav = wave.open(str(self.loadedFile), 'rb')
+    # Files make up font 0, a track per sound in the order of trackFile()
+    def trackKind(self):
+        return self.trackIdx
+
+    def trackFile(self, idx):
+        return [self.turnOnFile, self.humFile, self.swingFile, self.hitFile, self.clashFile, self.turnOffFile][idx]
+
+    # Rate the track is stored at, a file is never taken to a higher one
+    def trackRate(self, framerate):
+        rate = min(max(framerate, PLAYER_RATE_MIN), PLAYER_FREQ_HZ)
+        if LOAD_RATES[self.ui.comboBoxRate.currentIndex()] is not None:
+            rate = min(rate, LOAD_RATES[self.ui.comboBoxRate.currentIndex()])
+        return rate
+
+    # Bytes the track takes in the flash, None if the file cannot be stored.
+    # The rate they are at is left in loadRate, the loop of the file in
+    # loadLoop as samples at that rate.
+    def trackBytes(self, name):
+        wav = wave.open(str(name), 'rb')
         (nchannels, sampwidth, framerate, nframes, comptype, compname) = wav.getparams()
-        if framerate != 44100:
-            self.ui.textEdit.append('Only 44100 framerate supported')
-            return
+        self.loadRate = self.trackRate(framerate)
+        if self.loadRate != framerate:
+            self.ui.textEdit.append('Resampling %s from %d to %d Hz' % (QFileInfo(name).fileName(), framerate, self.loadRate))
         if comptype != 'NONE':
             self.ui.textEdit.append('Compressed file not supported yet')
-            return
+            return None
         frames = wav.readframes(nframes * nchannels)
-        self.bytelist = []
+        bytelist = []
         if sampwidth == 1:
             out = struct.unpack_from('%dB' %(nframes * nchannels), frames)
             if nchannels == 1:
@@ -364,12 +520,17 @@ class MainWindow(QMainWindow):
                 left = np.array(out[0:][::2], dtype = np.uint8)
                 right = np.array(out[1:][::2], dtype = np.uint8)
                 self.sound = left / 2 + right / 2
+            if self.loadRate != framerate:
+                self.sound = np.clip(np.round(resample(self.sound.astype(np.float64) - 0x80, framerate, self.loadRate)) + 0x80, 0, 0xFF).astype(np.uint8)
             print(' '.join('{:d}'.format(x) for x in self.sound[0:50]))
             self.values = self.sound
             print(' '.join('0x{:02X}'.format(x) for x in self.values[0:50]))
-            for elem in self.values:
-                self.bytelist.append(elem & 0xFF)
-            print(' '.join('0x{:02X}'.format(x) for x in self.bytelist[0:50]))
+            if self.ui.checkBoxCompress.isChecked():
+                bytelist = adpcmEncode((self.values.astype(np.int32) - 0x80) << 8)
+            else:
+                for elem in self.values:
+                    bytelist.append(elem & 0xFF)
+            print(' '.join('0x{:02X}'.format(x) for x in bytelist[0:50]))
         elif sampwidth == 2:
             out = struct.unpack_from('%dh' %(nframes * nchannels), frames)
             if nchannels == 1:
@@ -379,60 +540,319 @@ class MainWindow(QMainWindow):
                 left = np.array(out[0:][::2], dtype = np.int32)
                 right = np.array(out[1:][::2], dtype = np.int32)
                 self.sound = left / 2 + right / 2
+            if self.loadRate != framerate:
+                self.sound = np.clip(np.round(resample(self.sound, framerate, self.loadRate)), -0x8000, 0x7FFF).astype(np.int32)
             print(' '.join('{:d}'.format(x) for x in self.sound[0:50]))
             self.values = (self.sound + 0x8000).astype(np.uint16)
             print(' '.join('0x{:04X}'.format(x) for x in self.values[0:50]))
-            for elem in self.values:
-                self.bytelist.append((elem >> 8) & 0xFF)                 
-            print(' '.join('0x{:02X}'.format(x) for x in self.bytelist[0:50]))
+            if self.ui.checkBoxCompress.isChecked():
+                bytelist = adpcmEncode(self.values.astype(np.int32) - 0x8000)
+            else:
+                for elem in self.values:
+                    bytelist.append((elem >> 8) & 0xFF)                 
+            print(' '.join('0x{:02X}'.format(x) for x in bytelist[0:50]))
+        if self.ui.checkBoxCompress.isChecked():
+            self.ui.textEdit.append('Compressed to %d bytes' % len(bytelist))
+        self.loadLoop = wavLoop(name)
+        if self.loadLoop is not None:
+            self.loadLoop = tuple(min(x * self.loadRate // framerate, len(self.sound)) for x in self.loadLoop)
+        return bytelist
+
+    # Track in the module is looked at first. The same one is left alone,
+    # otherwise only the pages that differ are sent if it keeps its place.
+    def startLoad(self):
+        self.bytelist = self.trackBytes(self.loadedFile)
+        if self.bytelist is None:
+            return
+        if self.ui.checkBoxCompress.isChecked():
+            self.loadFormat = PLAYER_FORMAT_ADPCM
+        else:
+            self.loadFormat = PLAYER_FORMAT_PCM8
+        # Hum without a loop of its own goes round whole, a compressed loop
+        # starts and ends on a byte
+        if (self.loadLoop is None) and (self.trackIdx == TRACK_HUM):
+            self.loadLoop = (0, len(self.sound))
+        if self.loadLoop is None:
+            self.loadLoop = (0, 0)
+        if self.loadFormat == PLAYER_FORMAT_ADPCM:
+            self.loadLoop = tuple(x & ~1 for x in self.loadLoop)
+        self.loadStep = 'track'
+        self.ask(LSMOD_CONTROL_TRACK, [self.trackIdx])
+
+    def loadTrackFound(self, data):
+        if (len(data) < 23) or (data[0] != self.trackIdx):
+            return
+        self.askTimer.stop()
+        self.loadOld = struct.unpack('>IIBHBHII', bytes(data[1:23]))
+        (addr, size, fmt, crc, kind, rate, loopStart, loopEnd) = self.loadOld
+        self.loadCrcs = []
+        # Crc kept by the saber is checked against its flash as well
+        if (size == len(self.bytelist)) and (fmt == self.loadFormat) and (kind == self.trackKind()) and (rate == self.loadRate) and \
+           ((loopStart, loopEnd) == self.loadLoop) and \
+           (crc == binascii.crc_hqx(bytes(self.bytelist), LSMOD_CRC_INIT)):
+            self.loadStep = 'crc'
+            # Module reads the flash at some 100 kbytes/s
+            self.ask(LSMOD_CONTROL_CRC, list(struct.pack('>II', addr, size)), 500 + size // 50)
+        else:
+            self.loadStep = 'pages'
+            self.loadPageCrcs()
+
+    def loadCheckedCrc(self, data):
+        if (len(data) < 6) or (struct.unpack('>I', bytes(data[:4]))[0] != self.loadOld[0]):
+            return
+        self.askTimer.stop()
+        if struct.unpack('>H', bytes(data[4:6]))[0] == binascii.crc_hqx(bytes(self.bytelist), LSMOD_CRC_INIT):
+            self.loadStep = None
+            self.ui.textEdit.append('Unchanged %s' % QFileInfo(self.loadedFile).fileName())
+            self.trackIdx = self.trackIdx + 1
+            self.pickFile()
+        else:
+            self.loadStep = 'pages'
+            self.loadPageCrcs()
+
+    # Crcs of the pages full in both the old and the new track, a few per request
+    def loadPageCrcs(self):
+        (addr, size, fmt) = self.loadOld[:3]
+        full = 0
+        if fmt == self.loadFormat:
+            full = min(size, len(self.bytelist)) // DB321_PAGE_SIZE
+        if len(self.loadCrcs) < full:
+            count = min(LSMOD_PAGE_CRC_MAX, full - len(self.loadCrcs))
+            self.ask(LSMOD_CONTROL_PAGE_CRC, list(struct.pack('>IB', addr + len(self.loadCrcs) * DB321_PAGE_SIZE, count)), 500)
+        else:
+            self.loadStep = 'begin'
+            self.ask(LSMOD_CONTROL_LOAD_BEGIN, [self.trackIdx, self.loadFormat] + list(struct.pack('>I', len(self.bytelist))) + [self.trackKind()] + list(struct.pack('>HII', self.loadRate, *self.loadLoop)))
+
+    def loadCheckedPages(self, data):
+        if len(data) < 5:
+            return
+        (addr, count) = struct.unpack('>IB', bytes(data[:5]))
+        if (addr != self.loadOld[0] + len(self.loadCrcs) * DB321_PAGE_SIZE) or (len(data) < 5 + 2 * count):
+            return
+        self.askTimer.stop()
+        self.loadCrcs.extend(struct.unpack('>%dH' % count, bytes(data[5:(5 + 2 * count)])))
+        self.loadPageCrcs()
+
+    def loadBegun(self, data):
+        self.askTimer.stop()
+        pages = (len(self.bytelist) + DB321_PAGE_SIZE - 1) // DB321_PAGE_SIZE
+        self.loadPages = list(range(pages))
+        if (len(data) >= 5) and (struct.unpack('>I', bytes(data[1:5]))[0] == self.loadOld[0]):
+            self.loadPages = [page for page in self.loadPages
+                              if (page >= len(self.loadCrcs)) or (self.loadCrcs[page] != binascii.crc_hqx(
+                                  bytes(self.bytelist[(page * DB321_PAGE_SIZE):((page + 1) * DB321_PAGE_SIZE)]), LSMOD_CRC_INIT))]
+        self.ui.textEdit.append('Loading %s, %d of %d pages' % (QFileInfo(self.loadedFile).fileName(), len(self.loadPages), pages))
+        self.loadStep = 'load'
         self.trackPos = 0
-        self.sendPacket(LSMOD_CONTROL_LOAD_BEGIN, [self.trackIdx])
+        self.sendPos = 0
+        self.sendSeq = 0
+        self.loadInFlight = []
+        self.loadResent = 0
+        # Every page in flight may double on the wire when escaped and takes
+        # a page program after it
+        self.loadRepeatPeriodMs = 100 + LSMOD_LOAD_WINDOW * (DB321_PAGE_ERASE_PGM_T_MS + \
+            (LSMOD_SRV_LEN + LSMOD_PAGE_HDR_LEN + 2 * DB321_PAGE_SIZE) * 10 * 1000 // self.ser.baudrate)
+        self.loadActivated.emit()
 
+    # Positions count the pages to send, not the pages of the track
     def loadSamples(self):
-        progressBarValue = self.ui.progressBar.maximum() * (self.trackIdx + float(self.trackPos + 1) / float(len(self.bytelist))) / MAX_TRACKS
+        progressBarValue = self.ui.progressBar.maximum() * (self.trackIdx + float(self.trackPos + 1) / float(len(self.loadPages) + 1)) / MAX_TRACKS
         if progressBarValue > self.ui.progressBar.maximum():
             progressBarValue = self.ui.progressBar.maximum()
-        progressBarFileValue = self.ui.progressBarFile.maximum() * float(self.trackPos + 1) / float(len(self.bytelist))
+        progressBarFileValue = self.ui.progressBarFile.maximum() * float(self.trackPos + 1) / float(len(self.loadPages) + 1)
         if progressBarFileValue > self.ui.progressBarFile.maximum():
             progressBarFileValue = self.ui.progressBarFile.maximum()
-        self.ui.progressBar.setValue(progressBarValue)
-        self.ui.progressBarFile.setValue(progressBarFileValue)
-        print(self.trackPos)
-        print(len(self.bytelist))
-        if (self.trackPos < len(self.bytelist)):
-            if (len(self.bytelist) - self.trackPos) > ((LSMOD_DATA_MAX_LEN - LSMOD_DATA_IDX_LEN) / 2):
-                self.sendPacket(LSMOD_CONTROL_LOAD, [ord(i) for i in list(struct.pack('>I', self.trackPos))] + \
-                                                    self.bytelist[self.trackPos:(self.trackPos + (LSMOD_DATA_MAX_LEN - LSMOD_DATA_IDX_LEN) / 2)])
-            else:
-                self.sendPacket(LSMOD_CONTROL_LOAD, [ord(i) for i in list(struct.pack('>I', self.trackPos))] + \
-                                                    self.bytelist[self.trackPos:])
+        self.ui.progressBar.setValue(int(progressBarValue))
+        self.ui.progressBarFile.setValue(int(progressBarFileValue))
+        if (self.trackPos < len(self.loadPages)):
+            # Keep the window full, the module acknowledges the packets in order
+            while (len(self.loadInFlight) < LSMOD_LOAD_WINDOW) and (self.sendPos < len(self.loadPages)):
+                self.loadInFlight.append((self.sendSeq, self.sendPos))
+                self.sendLoad(*self.loadInFlight[-1])
+                self.sendPos = self.sendPos + 1
+                self.sendSeq = (self.sendSeq + 1) & 0xFF
             self.loadRepeat.start(self.loadRepeatPeriodMs)
         else:
-            self.sendPacket(LSMOD_CONTROL_LOAD_END, [self.trackIdx])
+            self.loadRepeat.stop()
+            self.loadStep = 'end'
+            self.ask(LSMOD_CONTROL_LOAD_END, [self.trackIdx] + list(struct.pack('>H', binascii.crc_hqx(bytes(self.bytelist), LSMOD_CRC_INIT))))
+
+    # Track goes a flash page per packet, the module writes the page as it comes
+    def sendLoad(self, seq, pos):
+        page = self.loadPages[pos]
+        data = self.bytelist[(page * DB321_PAGE_SIZE):((page + 1) * DB321_PAGE_SIZE)]
+        self.sendPacket(LSMOD_CONTROL_LOAD_PAGE, [seq] + list(struct.pack('>HH', page, len(data))) + list(data))
+
+    def repeatSamples(self):
+        # Packets after a lost one are not acknowledged by the module, so all of them go again
+        for packet in self.loadInFlight:
+            self.loadResent = self.loadResent + 1
+            self.sendLoad(*packet)
+        self.loadRepeat.start(self.loadRepeatPeriodMs)
+
+    def missingSamples(self, seq):
+        # Packets behind the missing one are kept by the module, it goes alone
+        for packet in self.loadInFlight:
+            if packet[0] == seq:
+                self.loadResent = self.loadResent + 1
+                self.sendLoad(*packet)
+                self.loadRepeat.start(self.loadRepeatPeriodMs)
+
+    def loadedSamples(self, seq):
+        # Acknowledge covers every packet up to this one
+        acked = [packet[0] for packet in self.loadInFlight]
+        if seq in acked:
+            self.trackPos = self.loadInFlight[acked.index(seq)][1] + 1
+            self.loadInFlight = self.loadInFlight[(acked.index(seq) + 1):]
+            self.loadContinue.emit()
 
     def endLoad(self):
+        if self.loadStep != 'end':
+            return
+        self.askTimer.stop()
+        self.loadStep = None
         self.ui.textEdit.append('Finished loading %s' % QFileInfo(self.loadedFile).fileName())
+        if self.loadResent > 0:
+            self.ui.textEdit.append('Packets sent again %d' % self.loadResent)
         self.ui.progressBarFile.setValue(self.ui.progressBar.minimum())
         self.trackIdx = self.trackIdx + 1
-        if self.trackIdx < MAX_TRACKS:
-            self.pickFile()
+        self.pickFile()
+
+    # Flash is checked against the files by crc at the addresses the module
+    # keeps, a track that differs is read back to see how much of it.
+    def on_pushButtonVerify_released(self):
+        self.verifyTracks = []
+        for idx in range(MAX_TRACKS):
+            name = self.trackFile(idx)
+            if not QFile.exists(name):
+                continue
+            bytelist = self.trackBytes(name)
+            if bytelist is None:
+                continue
+            self.verifyTracks.append((QFileInfo(name).fileName(), idx, bytelist))
+        if not self.verifyTracks:
+            self.ui.textEdit.append('No file')
+            return
+        self.verifyIdx = 0
+        self.verifyAddr = None
+        self.verifyPos = -1
+        self.verifyNext()
+
+    def verifyNext(self):
+        if self.verifyIdx < len(self.verifyTracks):
+            (_, idx, bytelist) = self.verifyTracks[self.verifyIdx]
+            if self.verifyAddr is None:
+                self.ask(LSMOD_CONTROL_TRACK, [idx])
+            elif self.verifyPos < 0:
+                # Module reads the flash at some 100 kbytes/s
+                self.ask(LSMOD_CONTROL_CRC, list(struct.pack('>II', self.verifyAddr, len(bytelist))), 500 + len(bytelist) // 50)
+            else:
+                size = min(LSMOD_READ_MAX_LEN, len(bytelist) - self.verifyPos)
+                self.ask(LSMOD_CONTROL_READ, list(struct.pack('>IB', self.verifyAddr + self.verifyPos, size)))
         else:
-            self.ui.textEdit.append('All files loaded')
-            self.ui.progressBar.setValue(self.ui.progressBar.minimum())
+            self.askTimer.stop()
+            self.verifyTracks = []
+            self.ui.textEdit.append('Verify finished')
+
+    def verifyNextTrack(self):
+        self.verifyAddr = None
+        self.verifyPos = -1
+        self.verifyIdx = self.verifyIdx + 1
+
+    def verifiedTrack(self, data):
+        if (len(data) < 12) or (self.verifyIdx >= len(self.verifyTracks)) or (self.verifyAddr is not None):
+            return
+        (name, idx, bytelist) = self.verifyTracks[self.verifyIdx]
+        if data[0] != idx:
+            return
+        (addr, size, _) = struct.unpack('>IIB', bytes(data[1:10]))
+        if size != len(bytelist):
+            self.ui.textEdit.append('%s differs in size, %d bytes in the saber' % (name, size))
+            self.verifyNextTrack()
+        else:
+            self.verifyAddr = addr
+        self.verifyNext()
+
+    def verifiedCrc(self, data):
+        if (len(data) < 6) or (self.verifyIdx >= len(self.verifyTracks)) or (self.verifyAddr is None) or (self.verifyPos >= 0):
+            return
+        (name, _, bytelist) = self.verifyTracks[self.verifyIdx]
+        (replyAddr, crc) = struct.unpack('>IH', bytes(data[:6]))
+        if replyAddr != self.verifyAddr:
+            return
+        if crc == binascii.crc_hqx(bytes(bytelist), LSMOD_CRC_INIT):
+            self.ui.textEdit.append('Verified %s' % name)
+            self.verifyNextTrack()
+        else:
+            self.verifyPos = 0
+            self.verifyDiffer = 0
+        self.verifyNext()
+
+    def verifiedRead(self, data):
+        if (len(data) <= 4) or (self.verifyIdx >= len(self.verifyTracks)) or (self.verifyAddr is None) or (self.verifyPos < 0):
+            return
+        (name, _, bytelist) = self.verifyTracks[self.verifyIdx]
+        if struct.unpack('>I', bytes(data[:4]))[0] != (self.verifyAddr + self.verifyPos):
+            return
+        for i, byte in enumerate(data[4:]):
+            if byte != bytelist[self.verifyPos + i]:
+                if self.verifyDiffer == 0:
+                    self.verifyFirst = self.verifyPos + i
+                self.verifyDiffer = self.verifyDiffer + 1
+        self.verifyPos = self.verifyPos + len(data) - 4
+        if self.verifyPos >= len(bytelist):
+            self.ui.textEdit.append('%s differs in %d bytes, first at %d' % (name, self.verifyDiffer, self.verifyFirst))
+            self.verifyNextTrack()
+        self.verifyNext()
        
     @pyqtSlot(bool)
     def on_pushButtonTest_clicked(self, arg):
         if arg:
             self.triggerTestStatus = 1
             self.ui.pushButtonLoad.setEnabled(False)
+            self.ui.pushButtonVerify.setEnabled(False)
             self.ui.pushButtonSet.setEnabled(False)
             self.get.start(self.getPeriodMs)
         else:
             self.triggerTestStatus = 0
             self.ui.pushButtonLoad.setEnabled(True)
+            self.ui.pushButtonVerify.setEnabled(True)
             self.ui.pushButtonSet.setEnabled(True)
             self.get.stop()
 
+    # Stream is written as it comes, one line per frame
+    @pyqtSlot(bool)
+    def on_pushButtonRecord_clicked(self, arg):
+        if arg:
+            name, _ = QFileDialog.getSaveFileName(self, filter = "CSV files (*.csv)")
+            if not name:
+                self.ui.pushButtonRecord.setChecked(False)
+                return
+            self.telemetryFile = open(name, 'w')
+            self.telemetryFile.write('time_ms,x,y,z,voltage,voices,' + ','.join(LSMOD_EVENTS) + '\n')
+            self.telemetryFrames = 0
+            self.sendPacket(LSMOD_CONTROL_TELEMETRY, [self.telemetryPeriodMs >> 8, self.telemetryPeriodMs & 0xFF])
+        else:
+            self.sendPacket(LSMOD_CONTROL_TELEMETRY, [0, 0])
+            if self.telemetryFile:
+                self.telemetryFile.close()
+                self.telemetryFile = None
+                self.ui.textEdit.append('Telemetry frames recorded %d' % self.telemetryFrames)
+
+    def recordTelemetry(self, data):
+        if (len(data) < LSMOD_TELEMETRY_LEN) or not self.telemetryFile:
+            return
+        ticks, x, y, z, voltage, voices, events = struct.unpack('>HhhhBBB', bytes(data[:LSMOD_TELEMETRY_LEN]))
+        # Time stamp wraps around every 67 s, time is counted from the first frame
+        if self.telemetryFrames == 0:
+            self.telemetryTicks = 0
+        else:
+            self.telemetryTicks += (ticks - self.telemetryStamp) & 0xFFFF
+        self.telemetryStamp = ticks
+        self.telemetryFile.write('%.3f,%d,%d,%d,%.1f,%d,' % (self.telemetryTicks * LSMOD_TELEMETRY_TICK_MS, x, y, z, float(voltage) / 10, voices) +
+                                 ','.join(str((events >> i) & 1) for i in range(len(LSMOD_EVENTS))) + '\n')
+        self.telemetryFrames += 1
+
     @pyqtSlot(bool)
     def on_actionOpen_triggered(self, arg):
         name, _ = QFileDialog.getOpenFileName(self)
@@ -457,8 +877,35 @@ class MainWindow(QMainWindow):
         if choice == QMessageBox.Yes:
             sys.exit()
 
+    # Saber is left at the default rate for the next connection
+    def closePort(self):
+        if self.ser.isOpen():
+            self.tim.stop()
+            self.baudTimer.stop()
+            if self.ser.baudrate != LSMOD_BAUDRATE:
+                self.sendPacket(LSMOD_CONTROL_BAUD, list(struct.pack('>I', LSMOD_BAUDRATE)))
+                self.ser.flush()
+            self.ser.close()
+
+    # Link starts at the default rate and asks for the fast one. The switch
+    # holds once the saber answers a ping at it, both ends fall back otherwise.
+    def requestBaud(self, baud):
+        self.baudNext = baud
+        self.sendPacket(LSMOD_CONTROL_BAUD, list(struct.pack('>I', baud)))
+        self.baudTimer.start(2 * LSMOD_BAUD_TIMEOUT_MS)
+
+    def switchBaud(self):
+        self.ser.flush()
+        self.ser.baudrate = self.baudNext
+        self.sendPacket(LSMOD_CONTROL_PING)
+
+    def baudFailed(self):
+        self.ser.baudrate = LSMOD_BAUDRATE
+        self.ui.textEdit.append('Link stays at %d baud' % LSMOD_BAUDRATE)
+
     def setPort(self, name):
         font = QFont()
+        self.closePort()
         self.ser = serial.Serial()
         self.ser.port = str(name)
         self.ser.baudrate = LSMOD_BAUDRATE
@@ -475,84 +922,143 @@ class MainWindow(QMainWindow):
             font.setBold(True)
             self.ui.labelConnection.setFont(font)
             self.ui.pushButtonLoad.setEnabled(True)
+            self.ui.pushButtonVerify.setEnabled(True)
             self.ui.pushButtonSet.setEnabled(True)
             self.ui.pushButtonTest.setEnabled(True)
+            self.ui.pushButtonRecord.setEnabled(True)
             self.ui.textEdit.append('Connected to ' + name)
+            if LSMOD_BAUDRATE_FAST != LSMOD_BAUDRATE:
+                self.requestBaud(LSMOD_BAUDRATE_FAST)
 
+    # Packets may come back to back or split between reads, the tail waits
+    # for the next call
     def readPort(self):
-        data = bytearray()
-        packet = list()
-        crc = 0
-        endFound = False
         if self.ser.isOpen():
-            while self.ser.inWaiting() and not endFound:
-                packet.append(ord(self.ser.read()))
-                if packet[-1] == LSMOD_PACKET_END:
+            if self.ser.inWaiting():
+                self.rxBuffer.extend(self.ser.read(self.ser.inWaiting()))
+            while LSMOD_PACKET_END in self.rxBuffer:
+                end = self.rxBuffer.index(LSMOD_PACKET_END) + 1
+                self.parsePacket(list(self.rxBuffer[:end]))
+                del self.rxBuffer[:end]
+
+    def parsePacket(self, packet):
+        data = bytearray()
+        if len(packet) >= LSMOD_SRV_LEN:
+            print(' '.join('0x{:02X}'.format(x) for x in packet))
+            endFound = False
+            i = 0
+            while not endFound and (i < len(packet)):
+                if (packet[i] == LSMOD_PACKET_END):
                     endFound = True
-            if len(packet) >= 6:
-                print(' '.join('0x{:02X}'.format(x) for x in packet))
-                endFound = False
-                i = 0
-                while not endFound and (i < len(packet)):
-                    if (packet[i] == LSMOD_PACKET_END):
-                        endFound = True
-                    elif (packet[i] == LSMOD_PACKET_MSK):
-                        packet[i] = 0xFF - packet[i + 1]
-                        for j in range ((i + 1), (len(packet) - 1)):
-                            packet[j] = packet[j + 1]
-                        packet.pop()
-                    i = i + 1
-                for i in range (0, (len(packet) - 2)):
-                    crc = crc + packet[i]
-                if (crc & 0xFF) == packet[-2]:
-                    if (packet[0] == LSMOD_PACKET_HDR) and (packet[1] == PC_ADDR) and (packet[2] == LSMOD_ADDR):
-                        if packet[3] == LSMOD_REPLY_ACK:
-                            if packet[4] == LSMOD_CONTROL_LOAD_BEGIN:
-                                self.loadActivated.emit()
-                            elif packet[4] == LSMOD_CONTROL_LOAD_END:
-                                self.loadEnd.emit()
-                            elif packet[4] == LSMOD_CONTROL_COLOR:
-                                self.ui.textEdit.append('Color set')
-                        elif packet[3] == LSMOD_REPLY_LOADED:
-                            self.loadRepeat.stop()
-                            self.trackPos = self.trackPos + packet[4]
-                            self.loadContinue.emit()
-                        elif packet[3] == LSMOD_REPLY_STAT:
-                            if len(packet) > 6:
-                                for i in range (0, (len(packet) - 6)):
-                                    data.append(packet[4 + i])
-                                realX = int(((data[0] & 0x7F) << 8) | data[1])
-                                if (data[0] & 0x80) != 0:
-                                    realX = -realX
-                                realY = int(((data[2] & 0x7F) << 8) | data[3])
-                                if (data[2] & 0x80) != 0:
-                                    realY = -realY
-                                realZ = int(((data[4] & 0x7F) << 8) | data[5])
-                                if (data[4] & 0x80) != 0:
-                                    realZ = -realZ
-                                if realX > self.ui.horizontalSliderX.maximum():
-                                    self.ui.horizontalSliderX.setMaximum(realX)
-                                if realX < self.ui.horizontalSliderX.minimum():
-                                    self.ui.horizontalSliderX.setMinimum(realX)
-                                if realY > self.ui.horizontalSliderY.maximum():
-                                    self.ui.horizontalSliderY.setMaximum(realY)
-                                if realY < self.ui.horizontalSliderY.minimum():
-                                    self.ui.horizontalSliderY.setMinimum(realY)
-                                if realZ > self.ui.horizontalSliderZ.maximum():
-                                    self.ui.horizontalSliderZ.setMaximum(realZ)
-                                if realZ < self.ui.horizontalSliderZ.minimum():
-                                    self.ui.horizontalSliderZ.setMinimum(realZ)
-                                self.ui.horizontalSliderX.setValue(realX)
-                                self.ui.horizontalSliderY.setValue(realY)
-                                self.ui.horizontalSliderZ.setValue(realZ)
-                                self.ui.lineEditVoltage.setText('%2.1f V' % (float(data[6]) / 10))
-                            else:
-                                self.ui.textEdit.append('No data')
-                        elif packet[3] == LSMOD_REPLY_ERROR:
-                            self.loadRepeat.stop()
-                            self.ui.textEdit.append('Error')
+                elif (packet[i] == LSMOD_PACKET_MSK):
+                    packet[i] = 0xFF - packet[i + 1]
+                    for j in range ((i + 1), (len(packet) - 1)):
+                        packet[j] = packet[j + 1]
+                    packet.pop()
+                i = i + 1
+            # Crc run over the crc bytes too leaves zero
+            if binascii.crc_hqx(bytes(packet[:-1]), LSMOD_CRC_INIT) == 0:
+                if (packet[0] == LSMOD_PACKET_HDR) and (packet[1] == PC_ADDR) and (packet[2] == LSMOD_ADDR):
+                    if packet[3] == LSMOD_REPLY_ACK:
+                        if packet[4] == LSMOD_CONTROL_BAUD:
+                            self.switchBaud()
+                        elif packet[4] == LSMOD_CONTROL_PING:
+                            if self.baudTimer.isActive():
+                                self.baudTimer.stop()
+                                self.ui.textEdit.append('Link at %d baud' % self.ser.baudrate)
+                        elif (packet[4] == LSMOD_CONTROL_LOAD_BEGIN) and (self.loadStep == 'begin'):
+                            self.loadBegun(packet[4:-(LSMOD_CRC_LEN + 1)])
+                        elif packet[4] == LSMOD_CONTROL_LOAD_END:
+                            self.loadEnd.emit()
+                        elif packet[4] == LSMOD_CONTROL_COLOR:
+                            self.ui.textEdit.append('Color set')
+                    elif packet[3] == LSMOD_REPLY_LOADED:
+                        self.loadedSamples(packet[4])
+                    elif packet[3] == LSMOD_REPLY_NAK:
+                        self.missingSamples(packet[4])
+                    elif packet[3] == LSMOD_REPLY_STAT:
+                        if len(packet) > LSMOD_SRV_LEN:
+                            for i in range (0, (len(packet) - LSMOD_SRV_LEN)):
+                                data.append(packet[4 + i])
+                            realX = int(((data[0] & 0x7F) << 8) | data[1])
+                            if (data[0] & 0x80) != 0:
+                                realX = -realX
+                            realY = int(((data[2] & 0x7F) << 8) | data[3])
+                            if (data[2] & 0x80) != 0:
+                                realY = -realY
+                            realZ = int(((data[4] & 0x7F) << 8) | data[5])
+                            if (data[4] & 0x80) != 0:
+                                realZ = -realZ
+                            if realX > self.ui.horizontalSliderX.maximum():
+                                self.ui.horizontalSliderX.setMaximum(realX)
+                            if realX < self.ui.horizontalSliderX.minimum():
+                                self.ui.horizontalSliderX.setMinimum(realX)
+                            if realY > self.ui.horizontalSliderY.maximum():
+                                self.ui.horizontalSliderY.setMaximum(realY)
+                            if realY < self.ui.horizontalSliderY.minimum():
+                                self.ui.horizontalSliderY.setMinimum(realY)
+                            if realZ > self.ui.horizontalSliderZ.maximum():
+                                self.ui.horizontalSliderZ.setMaximum(realZ)
+                            if realZ < self.ui.horizontalSliderZ.minimum():
+                                self.ui.horizontalSliderZ.setMinimum(realZ)
+                            self.ui.horizontalSliderX.setValue(realX)
+                            self.ui.horizontalSliderY.setValue(realY)
+                            self.ui.horizontalSliderZ.setValue(realZ)
+                            self.ui.lineEditVoltage.setText('%2.1f V' % (float(data[6]) / 10))
+                            if len(data) > 8:
+                                underruns = (data[7] << 8) | data[8]
+                                if underruns != self.underruns:
+                                    self.underruns = underruns
+                                    self.ui.textEdit.append('Player underruns %d' % underruns)
+                            if len(data) > 12:
+                                programTime = (data[9] << 24) | (data[10] << 16) | (data[11] << 8) | data[12]
+                                if programTime != self.programTime:
+                                    self.programTime = programTime
+                                    self.ui.textEdit.append('Flash page program %.1f ms, longest %.1f ms, datasheet %d ms' %
+                                                            (float((data[9] << 8) | data[10]) / 10,
+                                                             float((data[11] << 8) | data[12]) / 10,
+                                                             DB321_PAGE_ERASE_PGM_T_MS))
+                            if len(data) > 16:
+                                latency = ((data[13] << 8) | data[14], (data[15] << 8) | data[16])
+                                if latency != self.latency:
+                                    self.latency = latency
+                                    self.ui.textEdit.append('Sound start %d us, longest %d us' % latency)
+                            if len(data) > 22:
+                                linkErrors = ((data[17] << 8) | data[18], (data[19] << 8) | data[20], (data[21] << 8) | data[22])
+                                if linkErrors != self.linkErrors:
+                                    self.linkErrors = linkErrors
+                                    self.ui.textEdit.append('Link errors: %d packets dropped, %d crc, %d framing' % linkErrors)
+                            if len(data) > 24:
+                                audioCycles = (data[23] << 8) | data[24]
+                                if audioCycles != self.audioCycles:
+                                    self.audioCycles = audioCycles
+                                    self.ui.textEdit.append('Audio interrupt %d cycles at most, budget %d' %
+                                                            (audioCycles, LSMOD_AUDIO_CYCLES))
                         else:
-                            self.ui.textEdit.append('Unknown')
+                            self.ui.textEdit.append('No data')
+                    elif packet[3] == LSMOD_REPLY_TELEMETRY:
+                        self.recordTelemetry(packet[4:-(LSMOD_CRC_LEN + 1)])
+                    elif (packet[3] == LSMOD_REPLY_CRC) and (self.loadStep == 'crc'):
+                        self.loadCheckedCrc(packet[4:-(LSMOD_CRC_LEN + 1)])
+                    elif packet[3] == LSMOD_REPLY_CRC:
+                        self.verifiedCrc(packet[4:-(LSMOD_CRC_LEN + 1)])
+                    elif packet[3] == LSMOD_REPLY_PAGE_CRC:
+                        if self.loadStep == 'pages':
+                            self.loadCheckedPages(packet[4:-(LSMOD_CRC_LEN + 1)])
+                    elif (packet[3] == LSMOD_REPLY_TRACK) and (self.loadStep == 'track'):
+                        self.loadTrackFound(packet[4:-(LSMOD_CRC_LEN + 1)])
+                    elif packet[3] == LSMOD_REPLY_TRACK:
+                        self.verifiedTrack(packet[4:-(LSMOD_CRC_LEN + 1)])
+                    elif packet[3] == LSMOD_REPLY_READ:
+                        self.verifiedRead(packet[4:-(LSMOD_CRC_LEN + 1)])
+                    elif packet[3] == LSMOD_REPLY_ERROR:
+                        self.loadRepeat.stop()
+                        self.askTimer.stop()
+                        self.loadStep = None
+                        self.verifyTracks = []
+                        self.ui.textEdit.append('Error')
+                    else:
+                        self.ui.textEdit.append('Unknown')
 
 app = QApplication(sys.argv)
 main = MainWindow()